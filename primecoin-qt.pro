@@ -57,6 +57,8 @@ HEADERS += src/qt/primecoingui.h \
     src/uint256.h \
     src/serialize.h \
     src/main.h \
+    src/miner.h \
+    src/miningstats.h \
     src/net.h \
     src/network_peer.h \
     src/network_peer_database.h \
@@ -69,6 +71,7 @@ HEADERS += src/qt/primecoingui.h \
     src/bloom.h \
     src/mruset.h \
     src/checkqueue.h \
+    src/workqueue.h \
     src/qt/clientmodel.h \
     src/qt/guiutil.h \
     src/qt/transactionrecord.h \
@@ -100,7 +103,8 @@ HEADERS += src/qt/primecoingui.h \
     src/txdb.h \
     src/leveldb.h \
     src/limitedmap.h \
-    src/prime.h
+    src/prime.h \
+    src/fermat.h
 
 SOURCES += src/qt/primecoin.cpp \
     src/qt/primecoingui.cpp \
@@ -118,6 +122,8 @@ SOURCES += src/qt/primecoin.cpp \
     src/key.cpp \
     src/script.cpp \
     src/main.cpp \
+    src/miner.cpp \
+    src/miningstats.cpp \
     src/network_peer.cpp \
     src/network_peer_database.cpp \
     src/network_peer_manager.cpp \
@@ -152,7 +158,8 @@ SOURCES += src/qt/primecoin.cpp \
     src/noui.cpp \
     src/leveldb.cpp \
     src/txdb.cpp \
-    src/prime.cpp
+    src/prime.cpp \
+    src/fermat.cpp
 
 RESOURCES += src/qt/primecoin.qrc
 
@@ -0,0 +1,267 @@
+// Copyright (c) 2013 Primecoin developers
+// See COPYING for license.
+
+//
+// Microbenchmarks of the prime proof-of-work checks and the mining sieve
+//
+// Every benchmark runs one operation on fixed inputs, so runs on the same
+// machine can be compared over time. The iteration count is calibrated to
+// fill a sample of -benchtimems milliseconds, and the fastest and the median
+// of -benchsamples samples are reported. Allocations are the ones made with
+// operator new; OpenSSL allocates bignum buffers on its own and those are
+// not counted.
+//
+// Usage: bench_primecoin [-filter=<substring>] [-benchtimems=<n>] [-benchsamples=<n>]
+//
+#include <algorithm>
+#include <new>
+#include <stdlib.h>
+
+#include "fermat.h"
+#include "prime.h"
+#include "util.h"
+#include "wallet.h"
+
+CWallet* pwalletMain;
+CClientUIInterface uiInterface;
+
+void Shutdown(void* parg)
+{
+    exit(0);
+}
+
+void StartShutdown()
+{
+    exit(0);
+}
+
+static volatile uint64 nAllocations = 0;
+
+void* operator new(size_t nSize) throw(std::bad_alloc)
+{
+    nAllocations++;
+    void* p = malloc(nSize? nSize : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) throw()
+{
+    free(p);
+}
+
+// Primes woven into the benchmark sieves, and their segment size as
+// MineBuildSieve() uses it by default
+static const unsigned int nBenchSieveWeavePrimes = 10000;
+static const unsigned int nBenchSieveSegmentSize = 16 * 1024 * 8 / 4;
+// Chain target lengths of the sieve and miner chain test benchmarks
+static const unsigned int nBenchMinLength = 6;
+static const unsigned int nBenchMaxLength = 12;
+
+/** Header fields of a block with a prime chain */
+struct CBenchBlock
+{
+    const char* pszName;
+    int nVersion;
+    const char* pszHashPrevBlock;
+    const char* pszHashMerkleRoot;
+    unsigned int nTime;
+    unsigned int nBits;
+    unsigned int nNonce;
+    uint64 nPrimeChainMultiplier;
+};
+
+// Mainnet and testnet genesis blocks, then blocks mined with the sieve of
+// this tree on top of the mainnet genesis block, so the proof-of-work
+// checks also see the longer chains of later blocks. Multipliers are written
+// as the multiplier off the sieve times the primorial 23# or 37#.
+static const CBenchBlock vBenchBlocks[] =
+{
+    { "genesis", 2, "0x0", "0xaca30eb61dffbb9412d0ae743c3d74554f710853daec40ebd2514e830e05c9ff", 1373064429, 0x06000000, 383, 532541ull * 223092870 },
+    { "testnet", 2, "0x0", "0xaca30eb61dffbb9412d0ae743c3d74554f710853daec40ebd2514e830e05c9ff", 1373063882, 0x06000000, 1513, 585641ull * 223092870 },
+    { "length7", 2, "0x963d17ba4dc753138078a2f56afb3af9674e2546822badff26837db9a0152106", "0xaca30eb61dffbb9412d0ae743c3d74554f710853daec40ebd2514e830e05c9ff", 1373064436, 0x07000000, 47975, 187455ull * 7420738134810ull },
+};
+static const unsigned int nBenchBlocks = sizeof(vBenchBlocks) / sizeof(vBenchBlocks[0]);
+
+/** A mined prime chain: block header hash and multiplier */
+struct CBenchChain
+{
+    uint256 hashBlockHeader;
+    unsigned int nBits;
+    CBigNum bnPrimeChainMultiplier;
+    CBigNum bnFirstPrime; // first number of the chain
+};
+
+// Prime chains of the benchmark blocks
+static CBenchChain vChains[nBenchBlocks];
+// Fixed multiplier of the benchmark sieves
+static CBigNum bnSieveMultiplier;
+// First sieve candidates per target length for the miner chain tests
+static std::vector<CBigNum> vMinerOrigins[nBenchMaxLength + 1];
+static std::vector<unsigned int> vMinerTypes[nBenchMaxLength + 1];
+
+static void SetupChain(CBenchChain& chain, const CBenchBlock& bench)
+{
+    CBlock block;
+    block.nVersion = bench.nVersion;
+    block.hashPrevBlock = uint256(bench.pszHashPrevBlock);
+    block.hashMerkleRoot = uint256(bench.pszHashMerkleRoot);
+    block.nTime = bench.nTime;
+    block.nBits = bench.nBits;
+    block.nNonce = bench.nNonce;
+    chain.hashBlockHeader = block.GetHeaderHash();
+    chain.nBits = block.nBits;
+    chain.bnPrimeChainMultiplier = bench.nPrimeChainMultiplier;
+
+    unsigned int nChainType, nChainLength;
+    if (!CheckPrimeProofOfWork(chain.hashBlockHeader, chain.nBits, chain.bnPrimeChainMultiplier, nChainType, nChainLength))
+    {
+        fprintf(stderr, "bench_primecoin: proof-of-work check of block %s failed\n", bench.pszName);
+        exit(1);
+    }
+    CBigNum bnOrigin = CBigNum(chain.hashBlockHeader) * chain.bnPrimeChainMultiplier;
+    chain.bnFirstPrime = (nChainType == PRIME_CHAIN_CUNNINGHAM2)? bnOrigin + 1 : bnOrigin - 1;
+}
+
+static void Setup()
+{
+    GeneratePrimeTable();
+    for (unsigned int i = 0; i < nBenchBlocks; i++)
+        SetupChain(vChains[i], vBenchBlocks[i]);
+
+    Primorial(23, bnSieveMultiplier);
+    for (unsigned int nLength = nBenchMinLength; nLength <= nBenchMaxLength; nLength++)
+    {
+        CSieveOfEratosthenes sieve(nMaxSieveSize, TargetFromInt(nLength), vChains[0].hashBlockHeader, bnSieveMultiplier);
+        sieve.WeaveSegmented(nBenchSieveWeavePrimes, nBenchSieveSegmentSize);
+        CBigNum bnFixedFactor = CBigNum(vChains[0].hashBlockHeader) * bnSieveMultiplier;
+        unsigned int nVariableMultiplier, nCandidateType;
+        while (vMinerOrigins[nLength].size() < 4 * nFermatBatchSize && sieve.GetNextCandidateMultiplier(nVariableMultiplier, nCandidateType))
+        {
+            vMinerOrigins[nLength].push_back(bnFixedFactor * nVariableMultiplier);
+            vMinerTypes[nLength].push_back(nCandidateType);
+        }
+    }
+}
+
+static void BenchCheckPrimeProofOfWork(unsigned int nArg)
+{
+    const CBenchChain& chain = vChains[nArg];
+    unsigned int nChainType, nChainLength;
+    CheckPrimeProofOfWork(chain.hashBlockHeader, chain.nBits, chain.bnPrimeChainMultiplier, nChainType, nChainLength);
+}
+
+// nArg: index of the chain times two, plus one for the Fermat test
+static void BenchProbablePrimeChainTest(unsigned int nArg)
+{
+    const CBenchChain& chain = vChains[nArg / 2];
+    CBigNum bnOrigin = CBigNum(chain.hashBlockHeader) * chain.bnPrimeChainMultiplier;
+    unsigned int nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin;
+    ProbablePrimeChainTest(bnOrigin, chain.nBits, nArg % 2 != 0, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin);
+}
+
+static void BenchFermatTest(unsigned int nArg)
+{
+    CFermatEngine engine;
+    engine.SetModulus(vChains[nArg].bnFirstPrime);
+    unsigned int nFractionalLength;
+    engine.FermatTest(nFractionalLength);
+}
+
+static void BenchSieve(unsigned int nArg)
+{
+    CSieveOfEratosthenes sieve(nMaxSieveSize, TargetFromInt(nArg), vChains[0].hashBlockHeader, bnSieveMultiplier);
+    sieve.WeaveSegmented(nBenchSieveWeavePrimes, nBenchSieveSegmentSize);
+    sieve.GetCandidateCount();
+}
+
+static void BenchMinerChainTest(unsigned int nArg)
+{
+    std::vector<unsigned int> vChainLength;
+    ProbablePrimeChainTestBatchForMiner(vMinerOrigins[nArg], vMinerTypes[nArg], TargetFromInt(nArg), true, vChainLength);
+}
+
+struct CBenchmark
+{
+    std::string strName;
+    void (*pfnRun)(unsigned int nArg);
+    unsigned int nArg;
+    unsigned int nItems; // items processed per operation, for the throughput
+};
+
+static void RunBenchmark(const CBenchmark& bench, int64 nSampleMicro, unsigned int nSamples)
+{
+    // Double the iterations until a sample takes long enough
+    unsigned int nIterations = 1;
+    loop
+    {
+        int64 nStart = GetTimeMicros();
+        for (unsigned int i = 0; i < nIterations; i++)
+            bench.pfnRun(bench.nArg);
+        if (GetTimeMicros() - nStart >= nSampleMicro || nIterations >= (1u << 30))
+            break;
+        nIterations *= 2;
+    }
+
+    std::vector<double> vNanosPerOp;
+    uint64 nAllocationsStart = nAllocations;
+    for (unsigned int nSample = 0; nSample < nSamples; nSample++)
+    {
+        int64 nStart = GetTimeMicros();
+        for (unsigned int i = 0; i < nIterations; i++)
+            bench.pfnRun(bench.nArg);
+        vNanosPerOp.push_back(1000.0 * (GetTimeMicros() - nStart) / nIterations);
+    }
+    double dAllocationsPerOp = (double)(nAllocations - nAllocationsStart) / ((uint64)nSamples * nIterations);
+
+    std::sort(vNanosPerOp.begin(), vNanosPerOp.end());
+    double dNanosMin = vNanosPerOp.front();
+    double dNanosMedian = vNanosPerOp[vNanosPerOp.size() / 2];
+    printf("%-40s %14.0f %14.0f %10.1f %14.1f\n", bench.strName.c_str(), dNanosMin, dNanosMedian,
+        dAllocationsPerOp, (dNanosMin > 0.0)? 1e9 * bench.nItems / dNanosMin : 0.0);
+}
+
+static void AddBenchmark(std::vector<CBenchmark>& vBenchmarks, const std::string& strName, void (*pfnRun)(unsigned int), unsigned int nArg, unsigned int nItems)
+{
+    CBenchmark bench;
+    bench.strName = strName;
+    bench.pfnRun = pfnRun;
+    bench.nArg = nArg;
+    bench.nItems = nItems;
+    vBenchmarks.push_back(bench);
+}
+
+int main(int argc, char* argv[])
+{
+    ParseParameters(argc, argv);
+    fPrintToConsole = true;
+    std::string strFilter = GetArg("-filter", "");
+    int64 nSampleMicro = 1000 * std::max((int64)1, GetArg("-benchtimems", 200));
+    unsigned int nSamples = (unsigned int)std::max((int64)1, GetArg("-benchsamples", 5));
+
+    Setup();
+
+    std::vector<CBenchmark> vBenchmarks;
+    for (unsigned int i = 0; i < nBenchBlocks; i++)
+        AddBenchmark(vBenchmarks, strprintf("CheckPrimeProofOfWork/%s", vBenchBlocks[i].pszName), BenchCheckPrimeProofOfWork, i, 1);
+    AddBenchmark(vBenchmarks, "ProbablePrimeChainTest/ell", BenchProbablePrimeChainTest, 0, 1);
+    AddBenchmark(vBenchmarks, "ProbablePrimeChainTest/fermat", BenchProbablePrimeChainTest, 1, 1);
+    for (unsigned int i = 2; i < nBenchBlocks; i++)
+    {
+        AddBenchmark(vBenchmarks, strprintf("ProbablePrimeChainTest/%s/ell", vBenchBlocks[i].pszName), BenchProbablePrimeChainTest, 2 * i, 1);
+        AddBenchmark(vBenchmarks, strprintf("ProbablePrimeChainTest/%s/fermat", vBenchBlocks[i].pszName), BenchProbablePrimeChainTest, 2 * i + 1, 1);
+    }
+    AddBenchmark(vBenchmarks, "FermatTest/genesis", BenchFermatTest, 0, 1);
+    AddBenchmark(vBenchmarks, "FermatTest/testnet", BenchFermatTest, 1, 1);
+    for (unsigned int nLength = nBenchMinLength; nLength <= nBenchMaxLength; nLength += 2)
+        AddBenchmark(vBenchmarks, strprintf("Sieve/%u", nLength), BenchSieve, nLength, nMaxSieveSize);
+    for (unsigned int nLength = nBenchMinLength; nLength <= nBenchMaxLength; nLength++)
+        AddBenchmark(vBenchmarks, strprintf("MinerChainTest/%u", nLength), BenchMinerChainTest, nLength, vMinerOrigins[nLength].size());
+
+    printf("%-40s %14s %14s %10s %14s\n", "benchmark", "ns/op (min)", "ns/op (median)", "allocs/op", "items/s");
+    BOOST_FOREACH(const CBenchmark& bench, vBenchmarks)
+        if (bench.strName.find(strFilter) != std::string::npos)
+            RunBenchmark(bench, nSampleMicro, nSamples);
+    return 0;
+}
@@ -0,0 +1,436 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under conditional MIT/X11 software license,
+// see the accompanying file COPYING
+
+#include <algorithm>
+
+#include "fermat.h"
+#include "prime.h"
+
+static const unsigned int nFermatLimbBytes = sizeof(fermat_limb);
+
+bool CFermatEngine::SetModulus(const CBigNum& bn)
+{
+    if (BN_is_negative(&bn) || !BN_is_odd(&bn) || BN_num_bits(&bn) < 2)
+        return false;
+    unsigned int nBytes = BN_num_bytes(&bn);
+    if (nBytes > nFermatLimbBytes * nFermatMaxLimbs)
+        return false;
+
+    // Big endian bytes to little endian limbs
+    unsigned char vch[nFermatLimbBytes * nFermatMaxLimbs];
+    BN_bn2bin(&bn, vch);
+    nLimbs = (nBytes + nFermatLimbBytes - 1) / nFermatLimbBytes;
+    for (unsigned int i = 0; i < nLimbs; i++)
+        vModulus[i] = 0;
+    for (unsigned int i = 0; i < nBytes; i++)
+        vModulus[i / nFermatLimbBytes] |= ((fermat_limb) vch[nBytes - 1 - i]) << (8 * (i % nFermatLimbBytes));
+    nModulusBits = BN_num_bits(&bn) - 1;
+    InitModulus();
+    return true;
+}
+
+bool CFermatEngine::SetChainNext(bool fSophieGermain)
+{
+    unsigned int nTopLimb = (nModulusBits + 1) / nFermatLimbBits;
+    if (nTopLimb >= nFermatMaxLimbs)
+        return false;
+    if (nTopLimb == nLimbs)
+        vModulus[nLimbs++] = 0;
+    for (unsigned int j = nLimbs; j-- > 1; )
+        vModulus[j] = (vModulus[j] << 1) | (vModulus[j - 1] >> (nFermatLimbBits - 1));
+    // n is odd, so 2n ends in binary 10: 2n+1 sets bit 0, 2n-1 flips both
+    vModulus[0] = (vModulus[0] << 1) ^ (fSophieGermain? 1 : 3);
+    nModulusBits++;
+    InitModulus();
+    return true;
+}
+
+// Reduction constants of the modulus in vModulus
+void CFermatEngine::InitModulus()
+{
+    // Newton iteration doubles the correct low bits of the inverse each step,
+    // starting from the 3 bits any odd number is its own inverse for
+    fermat_limb nInverse = vModulus[0];
+    for (unsigned int i = 0; i < 5; i++)
+        nInverse *= 2 - vModulus[0] * nInverse;
+    nModulusInverse = -nInverse;
+
+    // Montgomery form of 1: 2^nModulusBits is already below the modulus,
+    // double it up to 2^(nFermatLimbBits*nLimbs)
+    for (unsigned int i = 0; i < nLimbs; i++)
+        vMontgomeryOne[i] = 0;
+    vMontgomeryOne[nModulusBits / nFermatLimbBits] = ((fermat_limb) 1) << (nModulusBits % nFermatLimbBits);
+    for (unsigned int i = nModulusBits; i < nFermatLimbBits * nLimbs; i++)
+        ModularDouble(vMontgomeryOne);
+}
+
+// pr = pa * pb / 2^(nFermatLimbBits*nLimbs) mod modulus, operands below the modulus
+// Coarsely integrated operand scanning; pr may alias pa or pb
+void CFermatEngine::MontgomeryMultiply(fermat_limb* pr, const fermat_limb* pa, const fermat_limb* pb) const
+{
+    fermat_limb t[nFermatMaxLimbs + 2];
+    for (unsigned int j = 0; j < nLimbs + 2; j++)
+        t[j] = 0;
+    for (unsigned int i = 0; i < nLimbs; i++)
+    {
+        fermat_dlimb nCarry = 0;
+        fermat_dlimb b = pb[i];
+        for (unsigned int j = 0; j < nLimbs; j++)
+        {
+            nCarry += t[j] + pa[j] * b;
+            t[j] = (fermat_limb) nCarry;
+            nCarry >>= nFermatLimbBits;
+        }
+        nCarry += t[nLimbs];
+        t[nLimbs] = (fermat_limb) nCarry;
+        t[nLimbs + 1] = (fermat_limb) (nCarry >> nFermatLimbBits);
+
+        // Add a multiple of the modulus clearing the lowest limb, shift it out
+        fermat_dlimb m = (fermat_limb) (t[0] * nModulusInverse);
+        nCarry = (t[0] + m * vModulus[0]) >> nFermatLimbBits;
+        for (unsigned int j = 1; j < nLimbs; j++)
+        {
+            nCarry += t[j] + m * vModulus[j];
+            t[j - 1] = (fermat_limb) nCarry;
+            nCarry >>= nFermatLimbBits;
+        }
+        nCarry += t[nLimbs];
+        t[nLimbs - 1] = (fermat_limb) nCarry;
+        t[nLimbs] = t[nLimbs + 1] + (fermat_limb) (nCarry >> nFermatLimbBits);
+    }
+
+    ReduceOnce(t, pr);
+}
+
+// pr = t mod modulus for t of nLimbs+1 limbs below twice the modulus
+void CFermatEngine::ReduceOnce(const fermat_limb* t, fermat_limb* pr) const
+{
+    bool fSubtract = (t[nLimbs] != 0);
+    if (!fSubtract)
+    {
+        fSubtract = true;
+        for (unsigned int j = nLimbs; j-- > 0; )
+            if (t[j] != vModulus[j])
+            {
+                fSubtract = (t[j] > vModulus[j]);
+                break;
+            }
+    }
+    if (fSubtract)
+    {
+        fermat_limb nBorrow = 0;
+        for (unsigned int j = 0; j < nLimbs; j++)
+        {
+            fermat_limb nDiff = t[j] - vModulus[j] - nBorrow;
+            nBorrow = (t[j] < vModulus[j] || (t[j] == vModulus[j] && nBorrow));
+            pr[j] = nDiff;
+        }
+    }
+    else
+    {
+        for (unsigned int j = 0; j < nLimbs; j++)
+            pr[j] = t[j];
+    }
+}
+
+// pa = 2 * pa mod modulus, pa below the modulus
+// Return value:
+//   true - the modulus was subtracted
+bool CFermatEngine::ModularDouble(fermat_limb* pa) const
+{
+    fermat_limb nCarry = 0;
+    for (unsigned int j = 0; j < nLimbs; j++)
+    {
+        fermat_limb nLimb = pa[j];
+        pa[j] = (nLimb << 1) | nCarry;
+        nCarry = nLimb >> (nFermatLimbBits - 1);
+    }
+    bool fSubtract = (nCarry != 0);
+    if (!fSubtract)
+    {
+        fSubtract = true;
+        for (unsigned int j = nLimbs; j-- > 0; )
+            if (pa[j] != vModulus[j])
+            {
+                fSubtract = (pa[j] > vModulus[j]);
+                break;
+            }
+    }
+    if (fSubtract)
+    {
+        fermat_limb nBorrow = 0;
+        for (unsigned int j = 0; j < nLimbs; j++)
+        {
+            fermat_limb nDiff = pa[j] - vModulus[j] - nBorrow;
+            nBorrow = (pa[j] < vModulus[j] || (pa[j] == vModulus[j] && nBorrow));
+            pa[j] = nDiff;
+        }
+    }
+    return fSubtract;
+}
+
+bool CFermatEngine::IsEqual(const fermat_limb* pa, const fermat_limb* pb) const
+{
+    for (unsigned int j = 0; j < nLimbs; j++)
+        if (pa[j] != pb[j])
+            return false;
+    return true;
+}
+
+// pr = 2 ** ((n-1) >> nShift) in Montgomery form
+void CFermatEngine::PowTwo(unsigned int nShift, fermat_limb* pr) const
+{
+    // The exponent bits are those of the modulus above nShift, bit 0 cleared;
+    // its top bit turns the starting 1 into 2
+    for (unsigned int j = 0; j < nLimbs; j++)
+        pr[j] = vMontgomeryOne[j];
+    ModularDouble(pr);
+    for (unsigned int nBit = nModulusBits; nBit-- > nShift; )
+    {
+        MontgomeryMultiply(pr, pr, pr);
+        if (nBit > 0 && ((vModulus[nBit / nFermatLimbBits] >> (nBit % nFermatLimbBits)) & 1))
+            ModularDouble(pr);
+    }
+}
+
+// pr = pa / 2^(nFermatLimbBits*nLimbs) mod modulus, back to normal form
+void CFermatEngine::FromMontgomery(const fermat_limb* pa, fermat_limb* pr) const
+{
+    fermat_limb vOne[nFermatMaxLimbs];
+    vOne[0] = 1;
+    for (unsigned int j = 1; j < nLimbs; j++)
+        vOne[j] = 0;
+    MontgomeryMultiply(pr, pa, vOne);
+}
+
+// ((n-r) << nFractionalBits) / n for the Fermat remainder r, one quotient
+// bit per doubling of n-r
+unsigned int CFermatEngine::GetFractionalLength() const
+{
+    fermat_limb t[nFermatMaxLimbs];
+    fermat_limb nBorrow = 0;
+    for (unsigned int j = 0; j < nLimbs; j++)
+    {
+        t[j] = vModulus[j] - vRemainder[j] - nBorrow;
+        nBorrow = (vModulus[j] < vRemainder[j] || (vModulus[j] == vRemainder[j] && nBorrow));
+    }
+    unsigned int nFractionalLength = 0;
+    for (unsigned int i = 0; i < nFractionalBits; i++)
+        nFractionalLength = (nFractionalLength << 1) | (ModularDouble(t)? 1 : 0);
+    return nFractionalLength;
+}
+
+bool CFermatEngine::FermatTest(unsigned int& nFractionalLength)
+{
+    fermat_limb vResidue[nFermatMaxLimbs];
+    PowTwo(0, vResidue);
+    FromMontgomery(vResidue, vRemainder);
+    if (IsRemainderOne())
+        return true;
+    nFractionalLength = GetFractionalLength();
+    return false;
+}
+
+bool CFermatEngine::IsRemainderOne() const
+{
+    if (vRemainder[0] != 1)
+        return false;
+    for (unsigned int j = 1; j < nLimbs; j++)
+        if (vRemainder[j] != 0)
+            return false;
+    return true;
+}
+
+bool CFermatEngine::EulerCriterionTest(bool fExpectMinusOne, unsigned int& nFractionalLength)
+{
+    fermat_limb vResidue[nFermatMaxLimbs];
+    PowTwo(1, vResidue);
+
+    // Montgomery form of -1 is the modulus minus the form of 1
+    fermat_limb vExpected[nFermatMaxLimbs];
+    if (fExpectMinusOne)
+    {
+        fermat_limb nBorrow = 0;
+        for (unsigned int j = 0; j < nLimbs; j++)
+        {
+            vExpected[j] = vModulus[j] - vMontgomeryOne[j] - nBorrow;
+            nBorrow = (vModulus[j] < vMontgomeryOne[j] || (vModulus[j] == vMontgomeryOne[j] && nBorrow));
+        }
+    }
+    else
+    {
+        for (unsigned int j = 0; j < nLimbs; j++)
+            vExpected[j] = vMontgomeryOne[j];
+    }
+    bool fPassed = IsEqual(vResidue, vExpected);
+
+    // Derive the Fermat remainder
+    MontgomeryMultiply(vResidue, vResidue, vResidue);
+    FromMontgomery(vResidue, vRemainder);
+    if (fPassed)
+        return true;
+    nFractionalLength = GetFractionalLength();
+    return false;
+}
+
+bool CFermatEngine::EulerFermatTest(bool fExpectMinusOne, bool& fEulerPassed, unsigned int& nFractionalLength)
+{
+    fEulerPassed = EulerCriterionTest(fExpectMinusOne, nFractionalLength);
+    return (fEulerPassed || IsRemainderOne());
+}
+
+// Little endian limbs to a bignum
+static void LimbsToBigNum(const fermat_limb* pa, unsigned int nLimbs, CBigNum& bn)
+{
+    unsigned int nBytes = nFermatLimbBytes * nLimbs;
+    unsigned char vch[nFermatLimbBytes * nFermatMaxLimbs];
+    for (unsigned int i = 0; i < nBytes; i++)
+        vch[nBytes - 1 - i] = (unsigned char) (pa[i / nFermatLimbBytes] >> (8 * (i % nFermatLimbBytes)));
+    BN_bin2bn(vch, nBytes, &bn);
+}
+
+void CFermatEngine::GetModulus(CBigNum& bnModulus) const
+{
+    LimbsToBigNum(vModulus, nLimbs, bnModulus);
+}
+
+void CFermatEngine::GetRemainder(CBigNum& bnRemainder) const
+{
+    LimbsToBigNum(vRemainder, nLimbs, bnRemainder);
+}
+
+// The lanes below are written out for a batch of four; this fails to compile
+// if nFermatBatchSize changes without them
+typedef char FermatBatchSizeIsFour[nFermatBatchSize == 4 ? 1 : -1];
+
+// Lockstep Montgomery squaring of nFermatBatchSize lanes; t receives the
+// unreduced results. N is the limb count when known at compile time, which
+// lets the compiler keep the short limb loops unrolled.
+template<unsigned int N>
+static void MontgomerySquareLanes(unsigned int nLimbs, const fermat_limb* const* ppModulus, const fermat_limb* pInverse, const fermat_limb (*pa)[nFermatMaxLimbs], fermat_limb (*t)[nFermatMaxLimbs + 2])
+{
+    if (N != 0)
+        nLimbs = N;
+    fermat_limb *t0 = t[0], *t1 = t[1], *t2 = t[2], *t3 = t[3];
+    const fermat_limb *a0 = pa[0], *a1 = pa[1], *a2 = pa[2], *a3 = pa[3];
+    const fermat_limb *n0 = ppModulus[0], *n1 = ppModulus[1], *n2 = ppModulus[2], *n3 = ppModulus[3];
+    for (unsigned int j = 0; j < nLimbs + 2; j++)
+        t0[j] = t1[j] = t2[j] = t3[j] = 0;
+    for (unsigned int i = 0; i < nLimbs; i++)
+    {
+        fermat_dlimb c0 = 0, c1 = 0, c2 = 0, c3 = 0;
+        fermat_dlimb b0 = a0[i], b1 = a1[i], b2 = a2[i], b3 = a3[i];
+        for (unsigned int j = 0; j < nLimbs; j++)
+        {
+            c0 += t0[j] + a0[j] * b0; t0[j] = (fermat_limb) c0; c0 >>= nFermatLimbBits;
+            c1 += t1[j] + a1[j] * b1; t1[j] = (fermat_limb) c1; c1 >>= nFermatLimbBits;
+            c2 += t2[j] + a2[j] * b2; t2[j] = (fermat_limb) c2; c2 >>= nFermatLimbBits;
+            c3 += t3[j] + a3[j] * b3; t3[j] = (fermat_limb) c3; c3 >>= nFermatLimbBits;
+        }
+        c0 += t0[nLimbs]; t0[nLimbs] = (fermat_limb) c0; t0[nLimbs + 1] = (fermat_limb) (c0 >> nFermatLimbBits);
+        c1 += t1[nLimbs]; t1[nLimbs] = (fermat_limb) c1; t1[nLimbs + 1] = (fermat_limb) (c1 >> nFermatLimbBits);
+        c2 += t2[nLimbs]; t2[nLimbs] = (fermat_limb) c2; t2[nLimbs + 1] = (fermat_limb) (c2 >> nFermatLimbBits);
+        c3 += t3[nLimbs]; t3[nLimbs] = (fermat_limb) c3; t3[nLimbs + 1] = (fermat_limb) (c3 >> nFermatLimbBits);
+
+        // Add multiples of the moduli clearing the lowest limbs, shift them out
+        fermat_dlimb m0 = (fermat_limb) (t0[0] * pInverse[0]);
+        fermat_dlimb m1 = (fermat_limb) (t1[0] * pInverse[1]);
+        fermat_dlimb m2 = (fermat_limb) (t2[0] * pInverse[2]);
+        fermat_dlimb m3 = (fermat_limb) (t3[0] * pInverse[3]);
+        c0 = (t0[0] + m0 * n0[0]) >> nFermatLimbBits;
+        c1 = (t1[0] + m1 * n1[0]) >> nFermatLimbBits;
+        c2 = (t2[0] + m2 * n2[0]) >> nFermatLimbBits;
+        c3 = (t3[0] + m3 * n3[0]) >> nFermatLimbBits;
+        for (unsigned int j = 1; j < nLimbs; j++)
+        {
+            c0 += t0[j] + m0 * n0[j]; t0[j - 1] = (fermat_limb) c0; c0 >>= nFermatLimbBits;
+            c1 += t1[j] + m1 * n1[j]; t1[j - 1] = (fermat_limb) c1; c1 >>= nFermatLimbBits;
+            c2 += t2[j] + m2 * n2[j]; t2[j - 1] = (fermat_limb) c2; c2 >>= nFermatLimbBits;
+            c3 += t3[j] + m3 * n3[j]; t3[j - 1] = (fermat_limb) c3; c3 >>= nFermatLimbBits;
+        }
+        c0 += t0[nLimbs]; t0[nLimbs - 1] = (fermat_limb) c0; t0[nLimbs] = t0[nLimbs + 1] + (fermat_limb) (c0 >> nFermatLimbBits);
+        c1 += t1[nLimbs]; t1[nLimbs - 1] = (fermat_limb) c1; t1[nLimbs] = t1[nLimbs + 1] + (fermat_limb) (c1 >> nFermatLimbBits);
+        c2 += t2[nLimbs]; t2[nLimbs - 1] = (fermat_limb) c2; t2[nLimbs] = t2[nLimbs + 1] + (fermat_limb) (c2 >> nFermatLimbBits);
+        c3 += t3[nLimbs]; t3[nLimbs - 1] = (fermat_limb) c3; t3[nLimbs] = t3[nLimbs + 1] + (fermat_limb) (c3 >> nFermatLimbBits);
+    }
+}
+
+// pa[k] = pa[k] * pa[k] / 2^(nFermatLimbBits*nLimbs) mod modulus of engine k,
+// for nFermatBatchSize engines of equal limb count
+void CFermatEngine::MontgomerySquareBatch(const CFermatEngine* const* ppengine, fermat_limb (*pa)[nFermatMaxLimbs])
+{
+    const fermat_limb* vpModulus[nFermatBatchSize];
+    fermat_limb vInverse[nFermatBatchSize];
+    for (unsigned int k = 0; k < nFermatBatchSize; k++)
+    {
+        vpModulus[k] = ppengine[k]->vModulus;
+        vInverse[k] = ppengine[k]->nModulusInverse;
+    }
+    fermat_limb t[nFermatBatchSize][nFermatMaxLimbs + 2];
+    // Sizes of mined numbers with 64-bit limbs get unrolled kernels
+    switch (ppengine[0]->nLimbs)
+    {
+    case 4: MontgomerySquareLanes<4>(4, vpModulus, vInverse, pa, t); break;
+    case 5: MontgomerySquareLanes<5>(5, vpModulus, vInverse, pa, t); break;
+    case 6: MontgomerySquareLanes<6>(6, vpModulus, vInverse, pa, t); break;
+    case 7: MontgomerySquareLanes<7>(7, vpModulus, vInverse, pa, t); break;
+    case 8: MontgomerySquareLanes<8>(8, vpModulus, vInverse, pa, t); break;
+    default: MontgomerySquareLanes<0>(ppengine[0]->nLimbs, vpModulus, vInverse, pa, t); break;
+    }
+    for (unsigned int k = 0; k < nFermatBatchSize; k++)
+        ppengine[k]->ReduceOnce(t[k], pa[k]);
+}
+
+void CFermatEngine::FermatTestBatch(CFermatEngine* pengines, unsigned int nCount, bool* pfProbablePrime, unsigned int* pnFractionalLength)
+{
+    for (unsigned int nFirst = 0; nFirst < nCount; nFirst += nFermatBatchSize)
+    {
+        // Pad a short batch with copies of its last lane
+        unsigned int nLanes = std::min(nCount - nFirst, nFermatBatchSize);
+        CFermatEngine* ppengine[nFermatBatchSize];
+        bool fLockstep = (nLanes > 1);
+        unsigned int nTopBit = 0;
+        for (unsigned int k = 0; k < nFermatBatchSize; k++)
+        {
+            ppengine[k] = &pengines[nFirst + std::min(k, nLanes - 1)];
+            fLockstep = fLockstep && (ppengine[k]->nLimbs == ppengine[0]->nLimbs);
+            nTopBit = std::max(nTopBit, ppengine[k]->nModulusBits);
+        }
+        if (!fLockstep)
+        {
+            for (unsigned int k = 0; k < nLanes; k++)
+                pfProbablePrime[nFirst + k] = ppengine[k]->FermatTest(pnFractionalLength[nFirst + k]);
+            continue;
+        }
+
+        // Exponent bits above the top bit of a shorter modulus are zero,
+        // its lane keeps squaring 1 until its own top bit comes up
+        fermat_limb vResidue[nFermatBatchSize][nFermatMaxLimbs];
+        for (unsigned int k = 0; k < nFermatBatchSize; k++)
+            for (unsigned int j = 0; j < ppengine[k]->nLimbs; j++)
+                vResidue[k][j] = ppengine[k]->vMontgomeryOne[j];
+        for (unsigned int nBit = nTopBit + 1; nBit-- > 0; )
+        {
+            if (nBit < nTopBit)
+                MontgomerySquareBatch(ppengine, vResidue);
+            if (nBit == 0)
+                break;
+            for (unsigned int k = 0; k < nFermatBatchSize; k++)
+            {
+                const CFermatEngine& engine = *ppengine[k];
+                if (nBit <= engine.nModulusBits && ((engine.vModulus[nBit / nFermatLimbBits] >> (nBit % nFermatLimbBits)) & 1))
+                    engine.ModularDouble(vResidue[k]);
+            }
+        }
+
+        for (unsigned int k = 0; k < nLanes; k++)
+        {
+            CFermatEngine& engine = *ppengine[k];
+            engine.FromMontgomery(vResidue[k], engine.vRemainder);
+            pfProbablePrime[nFirst + k] = engine.IsRemainderOne();
+            if (!pfProbablePrime[nFirst + k])
+                pnFractionalLength[nFirst + k] = engine.GetFractionalLength();
+        }
+    }
+}
@@ -0,0 +1,105 @@
+// Copyright (c) 2013 Primecoin developers
+// Distributed under conditional MIT/X11 software license,
+// see the accompanying file COPYING
+
+#ifndef PRIMECOIN_FERMAT_H
+#define PRIMECOIN_FERMAT_H
+
+#include "bignum.h"
+
+// Limbs are 64-bit where the compiler offers a 128-bit product
+#ifdef __SIZEOF_INT128__
+typedef uint64 fermat_limb;
+typedef unsigned __int128 fermat_dlimb;
+#else
+typedef unsigned int fermat_limb;
+typedef uint64 fermat_dlimb;
+#endif
+static const unsigned int nFermatLimbBits = 8 * sizeof(fermat_limb);
+// Capacity of the fixed-width engine (2176 bits), enough for every number
+// of a chain starting below bnPrimeMax
+static const unsigned int nFermatMaxLimbs = 2176 / nFermatLimbBits;
+// Numbers tested in lockstep by a batch (lanes written out in MontgomerySquareLanes)
+static const unsigned int nFermatBatchSize = 4;
+
+/** Base 2 probable primality tests with fixed-width Montgomery arithmetic
+  *
+  * The modulus and all intermediate values live in fixed-size arrays of
+  * limbs, least significant first, so the engine is meant to be a
+  * stack object and a test does no heap allocation. Only the limbs the
+  * modulus actually occupies take part in the arithmetic.
+  *
+  * With base 2 the window multiplications of a sliding-window exponentiation
+  * are multiplications by powers of two: the engine squares in Montgomery
+  * form and applies each set exponent bit as a modular doubling, so it needs
+  * neither a table of window powers nor any general multiplication.
+  */
+class CFermatEngine
+{
+private:
+    unsigned int nLimbs;                      // limbs occupied by the modulus
+    unsigned int nModulusBits;                // index of the top bit of the modulus
+    fermat_limb vModulus[nFermatMaxLimbs];
+    fermat_limb nModulusInverse;              // -modulus^-1 mod 2^nFermatLimbBits
+    fermat_limb vMontgomeryOne[nFermatMaxLimbs]; // 2^(nFermatLimbBits*nLimbs) mod modulus
+    fermat_limb vRemainder[nFermatMaxLimbs];  // Fermat remainder of the last test
+
+    void MontgomeryMultiply(fermat_limb* pr, const fermat_limb* pa, const fermat_limb* pb) const;
+    void ReduceOnce(const fermat_limb* t, fermat_limb* pr) const;
+    bool ModularDouble(fermat_limb* pa) const;
+    bool IsEqual(const fermat_limb* pa, const fermat_limb* pb) const;
+    void PowTwo(unsigned int nShift, fermat_limb* pr) const;
+    void FromMontgomery(const fermat_limb* pa, fermat_limb* pr) const;
+    unsigned int GetFractionalLength() const;
+    bool IsRemainderOne() const;
+    void InitModulus();
+    static void MontgomerySquareBatch(const CFermatEngine* const* ppengine, fermat_limb (*pa)[nFermatMaxLimbs]);
+
+public:
+    // Set the modulus of the following tests
+    // Return value:
+    //   false - modulus is even, below 3 or too large for the engine
+    bool SetModulus(const CBigNum& bn);
+
+    // Move the modulus n on to the next number of its Cunningham Chain,
+    // 2n+1 for the first kind and 2n-1 for the second kind, in place
+    // Return value:
+    //   false - the next number is too large for the engine; modulus unchanged
+    bool SetChainNext(bool fSophieGermain);
+
+    void GetModulus(CBigNum& bnModulus) const;
+    unsigned int GetModulusMod8() const { return vModulus[0] & 7; }
+
+    // Fermat test (2-PRP): 2 ** (n-1) = 1 (mod n)
+    // Return values:
+    //   true  - n is probable prime
+    //   false - n is composite; nFractionalLength set to ((n-r) << nFractionalBits) / n
+    bool FermatTest(unsigned int& nFractionalLength);
+
+    // Euler criterion for base 2: 2 ** ((n-1)/2) = +/-1 (mod n)
+    // fExpectMinusOne selects which of the two residues means probable prime
+    // Return values:
+    //   true  - n is probable prime
+    //   false - n is composite; nFractionalLength set from the Fermat remainder
+    bool EulerCriterionTest(bool fExpectMinusOne, unsigned int& nFractionalLength);
+
+    // Euler criterion and Fermat test from one exponentiation
+    // fEulerPassed receives what EulerCriterionTest() returns
+    // Return values:
+    //   true  - n is probable prime by the Fermat test
+    //   false - n is composite; nFractionalLength set from the Fermat remainder
+    bool EulerFermatTest(bool fExpectMinusOne, bool& fEulerPassed, unsigned int& nFractionalLength);
+
+    // Fermat remainder 2 ** (n-1) mod n of the last test
+    void GetRemainder(CBigNum& bnRemainder) const;
+
+    // Fermat tests of nCount engines, results as FermatTest() gives them
+    // Engines whose moduli have the same number of limbs, as the numbers of
+    // one sieve round do, run nFermatBatchSize at a time with their
+    // multiplications interleaved limb by limb. The independent carry chains
+    // of the lanes keep the multiplier busy where a single test would wait
+    // for each product in turn.
+    static void FermatTestBatch(CFermatEngine* pengines, unsigned int nCount, bool* pfProbablePrime, unsigned int* pnFractionalLength);
+};
+
+#endif
@@ -66,6 +66,38 @@ public:
 };
 
 
+/** Double SHA-256 of an 80-byte block header for a run of nonces
+  *
+  * The nonce is the last field of the header, so the first 64-byte SHA-256
+  * block is the same for every nonce. Its state is computed once, and each
+  * nonce only hashes the last 16 bytes on top of it.
+  */
+class CHeaderHasher
+{
+private:
+    SHA256_CTX ctxMidstate;     // state after the first 64 bytes
+    unsigned char pchTail[16];  // last 16 bytes, ending with the nonce
+
+public:
+    CHeaderHasher(const char* pchHeader) {
+        SHA256_Init(&ctxMidstate);
+        SHA256_Update(&ctxMidstate, pchHeader, 64);
+        memcpy(pchTail, pchHeader + 64, sizeof(pchTail));
+    }
+
+    uint256 GetHash(unsigned int nNonce) {
+        memcpy(pchTail + 12, &nNonce, sizeof(nNonce));
+        SHA256_CTX ctx = ctxMidstate;
+        SHA256_Update(&ctx, pchTail, sizeof(pchTail));
+        uint256 hash1;
+        SHA256_Final((unsigned char*)&hash1, &ctx);
+        uint256 hash2;
+        SHA256((unsigned char*)&hash1, sizeof(hash1), (unsigned char*)&hash2);
+        return hash2;
+    }
+};
+
+
 template<typename T1, typename T2>
 inline uint256 Hash(const T1 p1begin, const T1 p1end,
                     const T2 p2begin, const T2 p2end)
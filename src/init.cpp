@@ -15,6 +15,7 @@
 
 #include <openssl/crypto.h>
 
+#include "miner.h"
 #include "net.h"
 #include "network_peer_database.h"
 #include "txdb.h"
@@ -79,8 +80,6 @@ bool ShutdownRequested()
     return fRequestShutdown;
 }
 
-static CCoinsViewDB *pcoinsdbview;
-
 void Shutdown()
 {
     printf("Shutdown : In progress...\n");
@@ -91,6 +90,7 @@ void Shutdown()
     RenameThread("primecoin-shutoff");
     nTransactionsUpdated++;
     bitdb.Flush(false);
+    GeneratePrimecoins(false, NULL);
     StopNode();
     {
         LOCK(cs_main);
@@ -243,6 +243,8 @@ std::string HelpMessage()
         std::string("  -conf=<file>           Specify configuration file (default: primecoin.conf)\n") +
         std::string("  -pid=<file>            Specify pid file (default: primecoind.pid)\n") +
         std::string("  -gen                   Generate coins (default: 0)\n") +
+        std::string("  -genproclimit=<n>      Set the number of miner threads when generating coins (-1 = all cores, default: -1)\n") +
+        std::string("  -genfulllengths        Follow chains short of the target to their full length for the chain statistics (default: 0)\n") +
         std::string("  -datadir=<dir>         Specify data directory\n") +
         std::string("  -dbcache=<n>           Set database cache size in megabytes (default: 25)\n") +
         std::string("  -timeout=<n>           Specify connection timeout in milliseconds (default: 5000)\n") +
@@ -259,6 +261,8 @@ std::string HelpMessage()
         std::string("  -listen                Accept connections from outside (default: 1 if no -connect)\n") +
         std::string("  -bind=<addr>           Bind to given address and always listen on it. Use [host]:port notation for IPv6\n") +
         std::string("  -dnsseed               Find peers using DNS lookup (default: 1 unless -connect)\n") +
+        std::string("  -assumevalid=<hash>    Do not check the scripts of this block and its ancestors, only their coins, amounts and proof-of-work (implies -headersfirst)\n") +
+        std::string("  -headersfirst          Download the header chain first, then its blocks from all peers in parallel (default: 0)\n") +
         std::string("  -banscore=<n>          Threshold for disconnecting misbehaving peers (default: 100)\n") +
         std::string("  -bantime=<n>           Number of seconds to keep misbehaving peers from reconnecting (default: 86400)\n") +
         std::string("  -maxreceivebuffer=<n>  Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)\n") +
@@ -283,10 +287,15 @@ std::string HelpMessage()
         std::string("  -salvagewallet         Attempt to recover private keys from a corrupt wallet.dat\n") +
         std::string("  -checkblocks=<n>       How many blocks to check at startup (default: 288, 0 = all)\n") +
         std::string("  -checklevel=<n>        How thorough the block verification is (0-4, default: 3)\n") +
+        std::string("  -checkblockindexpow    Verify the proof-of-work of all blocks in the block index at startup, adding the multiplier of blocks indexed by older versions from the block files\n") +
         std::string("  -txindex               Maintain a full transaction index (default: 0)\n") +
         std::string("  -loadblock=<file>      Imports blocks from external blk000??.dat file\n") +
         std::string("  -reindex               Rebuild block chain index from current blk000??.dat files\n") +
-        std::string("  -par=<n>               Set the number of script verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)\n") +
+        std::string("  -maxpowcachesize=<n>   Keep at most <n> verified proofs-of-work in memory (default: 100000)\n") +
+        std::string("  -par=<n>               Set the number of script, input and proof-of-work verification threads (up to 16, 0 = auto, <0 = leave that many cores free, default: 0)\n") +
+        std::string("  -parallelinputs        Check the amounts and sigops of the inputs of large blocks on the verification threads (default: 0)\n") +
+        std::string("  -prefetchthreads=<n>   Set the number of threads reading the coins a block spends before connecting it (up to 16, 0 = off, default: 0)\n") +
+        std::string("  -blockpipeline         Check and connect received blocks on their own threads (default: 0)\n") +
 
         std::string("\nBlock creation options:\n") +
         std::string("  -blockminsize=<n>      Set minimum block size in bytes (default: 0)\n") +
@@ -316,6 +325,7 @@ void ThreadImport(std::vector<boost::filesystem::path> vImportFiles)
     // -reindex
     if (fReindex) {
         CImportingNow imp;
+        FindReindexAssumeValidChain();
         int nFile = 0;
         while (true) {
             CDiskBlockPos pos(nFile, 0);
@@ -412,6 +422,12 @@ bool AppInit2(boost::thread_group& threadGroup)
         SoftSetBoolArg("-rescan", true);
     }
 
+    if (mapArgs.count("-assumevalid")) {
+        // a download only finds the ancestors of the -assumevalid block ahead
+        // of connecting them from the header chain
+        SoftSetBoolArg("-headersfirst", true);
+    }
+
     // Make sure enough file descriptors are available
     int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
@@ -426,6 +442,14 @@ bool AppInit2(boost::thread_group& threadGroup)
 
     fDebug = GetBoolArg("-debug");
     fBenchmark = GetBoolArg("-benchmark");
+    fHeadersFirst = GetBoolArg("-headersfirst");
+    fParallelInputsCheck = GetBoolArg("-parallelinputs");
+    if (mapArgs.count("-assumevalid"))
+    {
+        hashAssumeValid.SetHex(mapArgs["-assumevalid"]);
+        if (hashAssumeValid != 0 && !fHeadersFirst)
+            InitWarning("Warning: -assumevalid without -headersfirst only skips script checks once the -assumevalid block is in the block index, or during -reindex.");
+    }
 
     // -par=0 means autodetect, but nScriptCheckThreads==0 means no concurrency
     nScriptCheckThreads = GetArg("-par", 0);
@@ -436,6 +460,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    nCoinsPrefetchThreads = std::max(0, std::min((int)GetArg("-prefetchthreads", 0), MAX_COINS_PREFETCH_THREADS));
+
     // -debug implies fDebug*
     if (fDebug)
         fDebugNet = true;
@@ -505,6 +531,25 @@ bool AppInit2(boost::thread_group& threadGroup)
         printf("Using %u threads for script verification\n", nScriptCheckThreads);
         for (int i=0; i<nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        for (int i=0; i<nScriptCheckThreads-1; i++)
+            threadGroup.create_thread(&ThreadPowCheck);
+        if (fParallelInputsCheck)
+            for (int i=0; i<nScriptCheckThreads-1; i++)
+                threadGroup.create_thread(&ThreadInputsCheck);
+    }
+
+    if (hashAssumeValid != 0)
+        printf("Assuming the scripts of block %s and its ancestors valid\n", hashAssumeValid.ToString().c_str());
+
+    if (nCoinsPrefetchThreads) {
+        printf("Using %u threads for coins prefetch\n", nCoinsPrefetchThreads);
+        for (int i=0; i<nCoinsPrefetchThreads-1; i++)
+            threadGroup.create_thread(&ThreadCoinsPrefetch);
+    }
+
+    if (GetBoolArg("-blockpipeline", false)) {
+        threadGroup.create_thread(&ThreadBlockCheck);
+        threadGroup.create_thread(&ThreadBlockConnect);
     }
 
     int64 nStart;
@@ -676,6 +721,11 @@ bool AppInit2(boost::thread_group& threadGroup)
                     strLoadError = "Corrupted block database detected";
                     break;
                 }
+
+                if (GetBoolArg("-checkblockindexpow") && !VerifyBlockIndexProofOfWork()) {
+                    strLoadError = "Corrupted block database detected";
+                    break;
+                }
             } catch(std::exception &e) {
                 strLoadError = "Error opening block database";
                 break;
@@ -870,5 +920,8 @@ bool AppInit2(boost::thread_group& threadGroup)
     // Run a thread to flush wallet periodically
     threadGroup.create_thread(boost::bind(&ThreadFlushWalletDB, boost::ref(pwalletMain->strWalletFile)));
 
+    // Generate coins in the background
+    GeneratePrimecoins(GetBoolArg("-gen", false), pwalletMain);
+
     return !fRequestShutdown;
 }
@@ -34,6 +34,7 @@ unsigned int nTransactionsUpdated = 0;
 
 std::map<uint256, CBlockIndex*> mapBlockIndex;
 uint256 hashGenesisBlock = hashGenesisBlockOfficial;
+uint256 hashAssumeValid = 0;
 CBlockIndex* pindexGenesisBlock = NULL;
 int nBestHeight = -1;
 uint256 nBestChainWork = 0;
@@ -43,9 +44,12 @@ CBlockIndex* pindexBest = NULL;
 std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid; // may contain all CBlockIndex*'s that have validness >=BLOCK_VALID_TRANSACTIONS, and must contain those who aren't failed
 int64 nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
+int nCoinsPrefetchThreads = 0;
 bool fImporting = false;
 bool fReindex = false;
 bool fBenchmark = false;
+bool fHeadersFirst = false;
+bool fParallelInputsCheck = false;
 bool fTestNet = false;
 bool fTxIndex = false;
 unsigned int nCoinCacheSize = 5000;
@@ -60,6 +64,66 @@ CMedianFilter<int> cPeerBlockCounts(8, 0); // Amount of blocks that other nodes
 std::map<uint256, CBlock*> mapOrphanBlocks;
 std::multimap<uint256, CBlock*> mapOrphanBlocksByPrev;
 
+// Headers-first sync: the header chain ahead of the best block, in chain
+// order, following the block hashSyncHeadersBase we have, and the work of
+// its headers; and the blocks requested from it, with the time and node of
+// the request. A header keeps what the checks of the next ones need.
+struct CSyncHeader
+{
+    uint256 hash;
+    unsigned int nTime;
+    unsigned int nBits;
+};
+static std::deque<CSyncHeader> vSyncHeaders;
+static uint256 hashSyncHeadersBase = 0;
+static int nSyncHeadersBaseHeight = -1;
+static uint256 nSyncHeadersWork = 0;
+// When the header chain last grew or had a block come in
+static int64 nSyncHeadersLastProgress = 0;
+static std::map<uint256, std::pair<int64, CNode*> > mapSyncBlocksInFlight;
+// A node that had more headers for us went away, another one is to ask
+static bool fSyncGetHeadersOrphaned = false;
+// Height of the -assumevalid block in the header chain, -1 if it is not there
+static int nSyncAssumeValidHeight = -1;
+
+// -reindex: the -assumevalid block and its ancestors by height, as found in
+// the headers of the block files before they are reindexed
+static std::vector<uint256> vReindexAssumeValidChain;
+
+static bool IsHeadersSyncActive()
+{
+    return fHeadersFirst && !vSyncHeaders.empty();
+}
+
+// Whether pindex is the -assumevalid block or one of its ancestors, going by
+// the block index, the block files of a -reindex or the header chain of a
+// headers-first sync
+static bool IsAssumedValid(const CBlockIndex* pindex)
+{
+    if (hashAssumeValid == 0)
+        return false;
+
+    std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashAssumeValid);
+    if (mi != mapBlockIndex.end())
+    {
+        if (!vReindexAssumeValidChain.empty())
+            std::vector<uint256>().swap(vReindexAssumeValidChain);
+        const CBlockIndex* pindexWalk = mi->second;
+        if (pindexWalk->nHeight < pindex->nHeight)
+            return false;
+        while (pindexWalk->nHeight > pindex->nHeight)
+            pindexWalk = pindexWalk->pprev;
+        return pindexWalk == pindex;
+    }
+
+    if (pindex->nHeight < (int)vReindexAssumeValidChain.size())
+        return vReindexAssumeValidChain[pindex->nHeight] == pindex->GetBlockHash();
+
+    int nPos = pindex->nHeight - nSyncHeadersBaseHeight - 1;
+    return pindex->nHeight <= nSyncAssumeValidHeight && nPos >= 0 && nPos < (int)vSyncHeaders.size() &&
+        vSyncHeaders[nPos].hash == pindex->GetBlockHash();
+}
+
 std::map<uint256, CTransaction> mapOrphanTransactions;
 std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
 
@@ -71,6 +135,8 @@ const std::string strMessageMagic = "Primecoin Signed Message:\n";
 double dPrimesPerSec = 0.0;
 double dChainsPerDay = 0.0;
 int64 nHPSTimerStart = 0;
+uint64 nLastBlockTx = 0;
+uint64 nLastBlockSize = 0;
 
 // Settings
 int64 nTransactionFee = 0;
@@ -182,7 +248,7 @@ void CCoinsViewBacked::SetBackend(CCoinsView &viewIn) { base = &viewIn; }
 bool CCoinsViewBacked::BatchWrite(const std::map<uint256, CCoins> &mapCoins, CBlockIndex *pindex) { return base->BatchWrite(mapCoins, pindex); }
 bool CCoinsViewBacked::GetStats(CCoinsStats &stats) { return base->GetStats(stats); }
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView &baseIn, bool fDummy) : CCoinsViewBacked(baseIn), pindexTip(NULL), nFlushes(0) { }
 
 bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) {
     if (cacheCoins.count(txid)) {
@@ -245,6 +311,7 @@ bool CCoinsViewCache::Flush() {
     bool fOk = base->BatchWrite(cacheCoins, pindexTip);
     if (fOk)
         cacheCoins.clear();
+    nFlushes++;
     return fOk;
 }
 
@@ -252,6 +319,22 @@ unsigned int CCoinsViewCache::GetCacheSize() {
     return cacheCoins.size();
 }
 
+bool CCoinsViewCache::HaveCachedCoins(const uint256 &txid) {
+    return cacheCoins.count(txid) > 0;
+}
+
+void CCoinsViewCache::AddPrefetchedCoins(std::map<uint256,CCoins> &mapCoins, unsigned int nFlushesRead) {
+    if (nFlushes != nFlushesRead)
+        return;
+    for (std::map<uint256,CCoins>::iterator it = mapCoins.begin(); it != mapCoins.end(); it++) {
+        std::map<uint256,CCoins>::iterator itCache = cacheCoins.lower_bound(it->first);
+        if (itCache != cacheCoins.end() && itCache->first == it->first)
+            continue;
+        itCache = cacheCoins.insert(itCache, std::make_pair(it->first, CCoins()));
+        it->second.swap(itCache->second);
+    }
+}
+
 /** CCoinsView that brings transactions from a memorypool into view.
     It does not check for spendings by memory pool transactions. */
 CCoinsViewMemPool::CCoinsViewMemPool(CCoinsView &baseIn, CTxMemPool &mempoolIn) : CCoinsViewBacked(baseIn), mempool(mempoolIn) { }
@@ -272,6 +355,7 @@ bool CCoinsViewMemPool::HaveCoins(const uint256 &txid) {
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsView *pcoinsdbview = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -1069,7 +1153,7 @@ uint256 static GetOrphanRoot(const CBlockHeader* pblock)
     return pblock->GetHash();
 }
 
-int64 static GetBlockValue(int nBits, int64 nFees)
+int64 GetBlockValue(int nBits, int64 nFees)
 {
     uint64 nSubsidy = 0;
     if (!TargetGetMint(nBits, nSubsidy))
@@ -1091,37 +1175,45 @@ unsigned int ComputeMinWork(unsigned int nBase, int64 nTime)
     return nBase;
 }
 
-unsigned int static GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
+// Target of the block following a block with nBitsLast and nTimeLast at
+// nHeightLast, whose parent has nTimePrev
+static unsigned int GetNextTarget(int nHeightLast, unsigned int nBitsLast, int64 nTimeLast, int64 nTimePrev)
 {
-    unsigned int nBits = TargetGetLimit();
-
-    // Genesis block
-    if (pindexLast == NULL)
-        return nBits;
-
-    const CBlockIndex* pindexPrev = pindexLast;
-    if (pindexPrev->pprev == NULL)
-        return TargetGetInitial(); // first block
-    const CBlockIndex* pindexPrevPrev = pindexPrev->pprev;
-    if (pindexPrevPrev->pprev == NULL)
-        return TargetGetInitial(); // second block
+    if (nHeightLast < 2)
+        return TargetGetInitial(); // first and second block
 
     // Primecoin: continuous target adjustment on every block
+    unsigned int nBits = TargetGetLimit();
     int64 nInterval = nTargetTimespan / nTargetSpacing;
-    int64 nActualSpacing = pindexPrev->GetBlockTime() - pindexPrevPrev->GetBlockTime();
-    if (!TargetGetNext(pindexPrev->nBits, nInterval, nTargetSpacing, nActualSpacing, nBits))
+    int64 nActualSpacing = nTimeLast - nTimePrev;
+    if (!TargetGetNext(nBitsLast, nInterval, nTargetSpacing, nActualSpacing, nBits))
         return error("GetNextWorkRequired() : failed to get next target");
 
     if (fDebug && GetBoolArg("-printtarget"))
         printf("GetNextWorkRequired() : lastindex=%u prev=0x%08x new=0x%08x\n",
-            pindexLast->nHeight, pindexPrev->nBits, nBits);
+            nHeightLast, nBitsLast, nBits);
     return nBits;
 }
 
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock)
+{
+    // Genesis block
+    if (pindexLast == NULL)
+        return TargetGetLimit();
+
+    return GetNextTarget(pindexLast->nHeight, pindexLast->nBits, pindexLast->GetBlockTime(),
+                         pindexLast->pprev ? pindexLast->pprev->GetBlockTime() : 0);
+}
+
 bool CheckProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnProbablePrime, unsigned int& nChainType, unsigned int& nChainLength)
 {
+    static CPrimeProofOfWorkCache powCache;
+
+    if (powCache.Get(hashBlockHeader, nBits, bnProbablePrime, nChainType, nChainLength))
+        return true;
     if (!CheckPrimeProofOfWork(hashBlockHeader, nBits, bnProbablePrime, nChainType, nChainLength))
         return error("CheckProofOfWork() : check failed for prime proof-of-work");
+    powCache.Set(hashBlockHeader, nBits, bnProbablePrime, nChainType, nChainLength);
     return true;
 }
 
@@ -1262,6 +1354,15 @@ int64 CTransaction::GetValueIn(CCoinsViewCache& inputs) const
     return nResult;
 }
 
+int64 CTransaction::GetValueIn(const std::vector<CSpentOutput>& vSpent) const
+{
+    int64 nResult = 0;
+    BOOST_FOREACH(const CSpentOutput& spent, vSpent)
+        nResult += spent.txout.nValue;
+
+    return nResult;
+}
+
 unsigned int CTransaction::GetP2SHSigOpCount(CCoinsViewCache& inputs) const
 {
     if (IsCoinBase())
@@ -1277,6 +1378,18 @@ unsigned int CTransaction::GetP2SHSigOpCount(CCoinsViewCache& inputs) const
     return nSigOps;
 }
 
+unsigned int CTransaction::GetP2SHSigOpCount(const std::vector<CSpentOutput>& vSpent) const
+{
+    unsigned int nSigOps = 0;
+    for (unsigned int i = 0; i < vSpent.size(); i++)
+    {
+        const CTxOut &prevout = vSpent[i].txout;
+        if (prevout.scriptPubKey.IsPayToScriptHash())
+            nSigOps += prevout.scriptPubKey.GetSigOpCount(vin[i].scriptSig);
+    }
+    return nSigOps;
+}
+
 void CTransaction::UpdateCoins(CValidationState &state, CCoinsViewCache &inputs, CTxUndo &txundo, int nHeight, const uint256 &txhash) const
 {
     // mark inputs spent
@@ -1326,7 +1439,20 @@ bool VerifySignature(const CCoins& txFrom, const CTransaction& txTo, unsigned in
     return CScriptCheck(txFrom, txTo, nIn, flags, nHashType)();
 }
 
-bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs, unsigned int flags, std::vector<CScriptCheck> *pvChecks) const
+void CTransaction::GetSpentOutputs(CCoinsViewCache &inputs, std::vector<CSpentOutput> &vSpent) const
+{
+    vSpent.clear();
+    vSpent.reserve(vin.size());
+    for (unsigned int i = 0; i < vin.size(); i++)
+    {
+        const COutPoint &prevout = vin[i].prevout;
+        const CCoins &coins = inputs.GetCoins(prevout.hash);
+        assert(coins.IsAvailable(prevout.n));
+        vSpent.push_back(CSpentOutput(coins.vout[prevout.n], coins.IsCoinBase(), coins.nHeight));
+    }
+}
+
+bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs, unsigned int flags, std::vector<CScriptCheck> *pvChecks, bool fScriptChecks) const
 {
     if (!IsCoinBase())
     {
@@ -1378,6 +1504,8 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
         // The first loop above does all the inexpensive checks.
         // Only if ALL inputs pass do we perform expensive ECDSA signature checks.
         // Helps prevent CPU exhaustion attacks.
+        if (!fScriptChecks)
+            return true;
         for (unsigned int i = 0; i < vin.size(); i++) {
             const COutPoint &prevout = vin[i].prevout;
             const CCoins &coins = inputs.GetCoins(prevout.hash);
@@ -1403,6 +1531,78 @@ bool CTransaction::CheckInputs(CValidationState &state, CCoinsViewCache &inputs,
     return true;
 }
 
+bool CTransaction::CheckInputValues(CValidationState &state, const std::vector<CSpentOutput> &vSpent, int nSpendHeight) const
+{
+    if (!IsCoinBase())
+    {
+        int64 nValueIn = 0;
+        int64 nFees = 0;
+        for (unsigned int i = 0; i < vin.size(); i++)
+        {
+            const CSpentOutput &spent = vSpent[i];
+
+            // If prev is coinbase, check that it's matured
+            if (spent.fCoinBase) {
+                if (nSpendHeight - spent.nHeight < COINBASE_MATURITY)
+                    return state.Invalid(error("CheckInputs() : tried to spend coinbase at depth %d", nSpendHeight - spent.nHeight));
+            }
+
+            // Check for negative or overflow input values
+            nValueIn += spent.txout.nValue;
+            if (!MoneyRange(spent.txout.nValue) || !MoneyRange(nValueIn))
+                return state.DoS(100, error("CheckInputs() : txin values out of range"));
+
+        }
+
+        if (nValueIn < GetValueOut())
+            return state.DoS(100, error("CheckInputs() : %s value in < value out", GetHash().ToString().c_str()));
+
+        // Tally transaction fees
+        int64 nTxFee = nValueIn - GetValueOut();
+        if (nTxFee < 0)
+            return state.DoS(100, error("CheckInputs() : %s nTxFee < 0", GetHash().ToString().c_str()));
+        // ppcoin: enforce transaction fees for every block
+        if (nTxFee < GetMinFee())
+            return state.DoS(100, error("CheckInputs() : %s not paying required fee=%s, paid=%s", GetHash().ToString().substr(0,10).c_str(), FormatMoney(GetMinFee()).c_str(), FormatMoney(nTxFee).c_str()));
+        nFees += nTxFee;
+        if (!MoneyRange(nFees))
+            return state.DoS(100, error("CheckInputs() : nFees out of range"));
+    }
+
+    return true;
+}
+
+bool CTransaction::CheckInputScripts(CValidationState &state, const std::vector<CSpentOutput> &vSpent, unsigned int flags, std::vector<CScriptCheck> *pvChecks) const
+{
+    if (!IsCoinBase())
+    {
+        if (pvChecks)
+            pvChecks->reserve(pvChecks->size() + vin.size());
+
+        for (unsigned int i = 0; i < vin.size(); i++) {
+            const CTxOut &txout = vSpent[i].txout;
+
+            // Verify signature
+            CScriptCheck check(txout, *this, i, flags, 0);
+            if (pvChecks) {
+                pvChecks->push_back(CScriptCheck());
+                check.swap(pvChecks->back());
+            } else if (!check()) {
+                if (flags & SCRIPT_VERIFY_STRICTENC) {
+                    // For now, check whether the failure was caused by non-canonical
+                    // encodings or not; if so, don't trigger DoS protection.
+                    CScriptCheck check(txout, *this, i, flags & (~SCRIPT_VERIFY_STRICTENC), 0);
+                    if (check())
+                        return state.Invalid();
+                }
+                return state.DoS(100,false);
+            }
+        }
+    }
+
+    return true;
+}
+
 
 
 
@@ -1525,77 +1725,259 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
-bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck)
+/** Closure representing one proof-of-work check.
+ *  Ahead of ProcessBlock, a valid proof-of-work lands in the proof-of-work
+ *  cache, an invalid one is left for ProcessBlock to reject, so the check
+ *  itself never fails. For a block index entry, the check fails unless the
+ *  proof-of-work is valid and matches the chain recorded in the index.
+ */
+class CPowCheck
 {
-    // Check it again in case a previous version let a bad block in
-    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
-        return false;
+private:
+    uint256 hashBlockHeader;
+    unsigned int nBits;
+    CBigNum bnPrimeChainMultiplier;
+    const CBlockIndex* pindex;
 
-    // verify that the view's current state corresponds to the previous block
-    assert(pindex->pprev == view.GetBestBlock());
+public:
+    CPowCheck() : nBits(0), pindex(NULL) {}
+    CPowCheck(const CBlock& block) : hashBlockHeader(block.GetHeaderHash()), nBits(block.nBits), bnPrimeChainMultiplier(block.bnPrimeChainMultiplier), pindex(NULL) {}
+    CPowCheck(const CBlockIndex* pindexIn) : hashBlockHeader(pindexIn->GetBlockHeader().GetHeaderHash()), nBits(pindexIn->nBits), bnPrimeChainMultiplier(pindexIn->bnPrimeChainMultiplier), pindex(pindexIn) {}
+
+    bool operator()() {
+        unsigned int nChainType = 0;
+        unsigned int nChainLength = 0;
+        if (pindex == NULL) {
+            CheckProofOfWork(hashBlockHeader, nBits, bnPrimeChainMultiplier, nChainType, nChainLength);
+            return true;
+        }
+        if (!CheckPrimeProofOfWork(hashBlockHeader, nBits, bnPrimeChainMultiplier, nChainType, nChainLength))
+            return error("CPowCheck() : invalid proof-of-work at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        if (nChainType != pindex->nPrimeChainType || nChainLength != pindex->nPrimeChainLength)
+            return error("CPowCheck() : prime chain %s differs from the block index %s at %d, hash=%s",
+                GetPrimeChainName(nChainType, nChainLength).c_str(), GetPrimeChainName(pindex->nPrimeChainType, pindex->nPrimeChainLength).c_str(),
+                pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+        return true;
+    }
 
-    // Special case for the genesis block, skipping connection of its transactions
-    // (its coinbase is unspendable)
-    if (GetHash() == hashGenesisBlock) {
-        view.SetBestBlock(pindex);
-        pindexGenesisBlock = pindex;
+    void swap(CPowCheck &check) {
+        std::swap(hashBlockHeader, check.hashBlockHeader);
+        std::swap(nBits, check.nBits);
+        std::swap(bnPrimeChainMultiplier, check.bnPrimeChainMultiplier);
+        std::swap(pindex, check.pindex);
+    }
+};
+
+static CCheckQueue<CPowCheck> powcheckqueue(1);
+static CCriticalSection cs_powcheckqueue;
+
+void ThreadPowCheck() {
+    RenameThread("primecoin-powch");
+    powcheckqueue.Thread();
+}
+
+void PreCheckProofOfWork(const std::vector<const CBlock*>& vpblock)
+{
+    if (!nScriptCheckThreads || vpblock.size() < 2)
+        return;
+
+    std::vector<CPowCheck> vChecks;
+    vChecks.reserve(vpblock.size());
+    BOOST_FOREACH(const CBlock* pblock, vpblock)
+        vChecks.push_back(CPowCheck(*pblock));
+
+    // One batch at a time: the queue has a single master
+    LOCK(cs_powcheckqueue);
+    CCheckQueueControl<CPowCheck> control(&powcheckqueue);
+    control.Add(vChecks);
+    control.Wait();
+}
+
+/** Closure reading the coins of one transaction from the coin database */
+class CCoinsPrefetch
+{
+private:
+    uint256 txid;
+    CCoins *pcoins;
+    char *pfFound;
+
+public:
+    CCoinsPrefetch() : pcoins(NULL), pfFound(NULL) {}
+    CCoinsPrefetch(const uint256 &txidIn, CCoins *pcoinsIn, char *pfFoundIn) : txid(txidIn), pcoins(pcoinsIn), pfFound(pfFoundIn) {}
+
+    bool operator()() {
+        *pfFound = pcoinsdbview->GetCoins(txid, *pcoins);
         return true;
     }
 
-    // Do not allow blocks that contain transactions which 'overwrite' older transactions,
-    // unless those are already completely spent.
-    // If such overwrites are allowed, coinbases and transactions depending upon those
-    // can be duplicated to remove the ability to spend the first instance -- even after
-    // being sent to another address.
-    // See BIP30 and http://r6.ca/blog/20120206T005236Z.html for more information.
-    // This logic is not necessary for memory pool transactions, as AcceptToMemoryPool
-    // already refuses previously-known transaction ids entirely.
-    // This rule was originally applied all blocks whose timestamp was after March 15, 2012, 0:00 UTC.
-    // Now that the whole chain is irreversibly beyond that time it is applied to all blocks except the
-    // two in the chain that violate it. This prevents exploiting the issue against nodes in their
-    // initial block download.
-    bool fEnforceBIP30 = (!pindex->phashBlock) ||
-                          !((pindex->nHeight==91842 && pindex->GetBlockHash() == uint256("0x00000000000a4d0a398161ffc163c503763b1f4360639393e0e4c8e300e0caec")) ||
-                           (pindex->nHeight==91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
-    if (fEnforceBIP30) {
-        for (unsigned int i=0; i<vtx.size(); i++) {
-            uint256 hash = GetTxHash(i);
-            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
-                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
+    void swap(CCoinsPrefetch &check) {
+        std::swap(txid, check.txid);
+        std::swap(pcoins, check.pcoins);
+        std::swap(pfFound, check.pfFound);
+    }
+};
+
+static CCheckQueue<CCoinsPrefetch> coinsprefetchqueue(8);
+static CCriticalSection cs_coinsprefetchqueue;
+
+void ThreadCoinsPrefetch() {
+    RenameThread("primecoin-prefetch");
+    coinsprefetchqueue.Thread();
+}
+
+void PrefetchCoins(const std::vector<const CBlock*>& vpblock)
+{
+    // pcoinsTip and pcoinsdbview only change during startup and shutdown,
+    // when no blocks are processed
+    if (!nCoinsPrefetchThreads || pcoinsTip == NULL || pcoinsdbview == NULL)
+        return;
+
+    // The spent coins, and the block transactions themselves for BIP30
+    std::set<uint256> setTxid;
+    BOOST_FOREACH(const CBlock* pblock, vpblock) {
+        BOOST_FOREACH(const CTransaction& tx, pblock->vtx) {
+            setTxid.insert(tx.GetHash());
+            if (!tx.IsCoinBase()) {
+                BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                    setTxid.insert(txin.prevout.hash);
+            }
         }
     }
 
-    // BIP16 didn't become active until Apr 1 2012
-    int64 nBIP16SwitchTime = 1333238400;
-    bool fStrictPayToScriptHash = (pindex->nTime >= nBIP16SwitchTime);
+    // Without cs_main (the block pipeline checks blocks while another one
+    // connects), cached coins cannot be told apart and are read as well
+    std::vector<uint256> vTxid;
+    unsigned int nFlushes;
+    {
+        TRY_LOCK(cs_main, lockMain);
+        nFlushes = pcoinsTip->GetFlushes();
+        BOOST_FOREACH(const uint256& txid, setTxid)
+            if (!lockMain || !pcoinsTip->HaveCachedCoins(txid))
+                vTxid.push_back(txid);
+    }
+    if (vTxid.empty())
+        return;
 
-    unsigned int flags = SCRIPT_VERIFY_NOCACHE |
-                         (fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE);
+    std::vector<CCoins> vCoins(vTxid.size());
+    std::vector<char> vFound(vTxid.size(), 0);
+    {
+        std::vector<CCoinsPrefetch> vPrefetch;
+        vPrefetch.reserve(vTxid.size());
+        for (unsigned int i = 0; i < vTxid.size(); i++)
+            vPrefetch.push_back(CCoinsPrefetch(vTxid[i], &vCoins[i], &vFound[i]));
+
+        // One batch at a time: the queue has a single master
+        LOCK(cs_coinsprefetchqueue);
+        CCheckQueueControl<CCoinsPrefetch> control(&coinsprefetchqueue);
+        control.Add(vPrefetch);
+        control.Wait();
+    }
 
-    CBlockUndo blockundo;
+    std::map<uint256, CCoins> mapCoins;
+    for (unsigned int i = 0; i < vTxid.size(); i++)
+        if (vFound[i])
+            mapCoins[vTxid[i]].swap(vCoins[i]);
+    LOCK(cs_main);
+    pcoinsTip->AddPrefetchedCoins(mapCoins, nFlushes);
+}
 
-    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+// Blocks with fewer transactions check their inputs in block order
+static const unsigned int nInputsCheckMinTransactions = 16;
 
-    int64 nStart = GetTimeMicros();
-    int64 nFees = 0;
-    int64 nValueIn = 0;
-    int64 nValueOut = 0;
-    int nInputs = 0;
-    unsigned int nSigOps = 0;
-    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
-    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
-    vPos.reserve(vtx.size());
+/** Outcome of the input checks of one transaction */
+struct CInputsCheckResult
+{
+    CValidationState state;
+    int64 nValueIn;
+    unsigned int nSigOps; // pay-to-script-hash sigops
+};
+
+/** Closure running the input checks of one transaction in ConnectBlock that
+ *  need no coins view: amounts, coinbase maturity, fee and pay-to-script-hash
+ *  sigops, on the outputs spent as they were looked up in block order.
+ *  The outcome goes to the result, so the check itself never fails.
+ */
+class CInputsCheck
+{
+private:
+    const CTransaction *ptx;
+    const std::vector<CSpentOutput> *pvSpent;
+    int nSpendHeight;
+    bool fStrictPayToScriptHash;
+    CInputsCheckResult *presult;
+
+public:
+    CInputsCheck() : ptx(NULL), pvSpent(NULL), nSpendHeight(0), fStrictPayToScriptHash(false), presult(NULL) {}
+    CInputsCheck(const CTransaction& txIn, const std::vector<CSpentOutput>& vSpentIn, int nSpendHeightIn, bool fStrictPayToScriptHashIn, CInputsCheckResult* presultIn) :
+        ptx(&txIn), pvSpent(&vSpentIn), nSpendHeight(nSpendHeightIn), fStrictPayToScriptHash(fStrictPayToScriptHashIn), presult(presultIn) {}
+
+    bool operator()() {
+        presult->nSigOps = fStrictPayToScriptHash ? ptx->GetP2SHSigOpCount(*pvSpent) : 0;
+        presult->nValueIn = ptx->GetValueIn(*pvSpent);
+        ptx->CheckInputValues(presult->state, *pvSpent, nSpendHeight);
+        return true;
+    }
+
+    void swap(CInputsCheck &check) {
+        std::swap(ptx, check.ptx);
+        std::swap(pvSpent, check.pvSpent);
+        std::swap(nSpendHeight, check.nSpendHeight);
+        std::swap(fStrictPayToScriptHash, check.fStrictPayToScriptHash);
+        std::swap(presult, check.presult);
+    }
+};
+
+// ConnectBlock runs under cs_main, so the queue has a single master
+static CCheckQueue<CInputsCheck> inputscheckqueue(16);
+
+void ThreadInputsCheck() {
+    RenameThread("primecoin-inputch");
+    inputscheckqueue.Thread();
+}
+
+bool CBlock::ConnectInputs(CValidationState &state, int nHeight, CCoinsViewCache &view, unsigned int flags, bool fScriptChecks, bool fParallelInputs,
+                           CCheckQueueControl<CScriptCheck> *pcontrol, CBlockUndo &blockundo,
+                           unsigned int &nSigOps, int64 &nValueIn, int64 &nValueOut, int64 &nFees) const
+{
+    bool fStrictPayToScriptHash = (flags & SCRIPT_VERIFY_P2SH) != 0;
+
+    // With fParallelInputs, the input checks that need no coins view run in
+    // parallel after this loop. The loop still looks up the outputs spent
+    // and updates the coins in block order, as the view is not thread-safe and
+    // transactions may spend outputs of earlier ones in the block. It stops at
+    // the first transaction that fails its own checks, whose failure is only
+    // reported if all earlier transactions pass theirs.
+    std::vector<std::vector<CSpentOutput> > vSpent(fParallelInputs ? vtx.size() : 0);
+    std::vector<unsigned int> vLegacySigOps(fParallelInputs ? vtx.size() : 0);
+    unsigned int nLegacySigOps = 0;
+    unsigned int nFail = vtx.size();
     for (unsigned int i=0; i<vtx.size(); i++)
     {
         const CTransaction &tx = vtx[i];
 
-        nInputs += tx.vin.size();
-        nSigOps += tx.GetLegacySigOpCount();
-        if (nSigOps > MAX_BLOCK_SIGOPS)
-            return state.DoS(100, error("ConnectBlock() : too many sigops"));
+        if (fParallelInputs)
+        {
+            // Without the pay-to-script-hash sigops of earlier transactions,
+            // the total is at most the one the block order sees
+            vLegacySigOps[i] = tx.GetLegacySigOpCount();
+            nLegacySigOps += vLegacySigOps[i];
+            if (nLegacySigOps > MAX_BLOCK_SIGOPS || (!tx.IsCoinBase() && !tx.HaveInputs(view)))
+            {
+                nFail = i;
+                break;
+            }
+        }
+        else
+        {
+            nSigOps += tx.GetLegacySigOpCount();
+            if (nSigOps > MAX_BLOCK_SIGOPS)
+                return state.DoS(100, error("ConnectBlock() : too many sigops"));
+        }
 
         if (tx.IsCoinBase())
             nValueOut += tx.GetValueOut();
+        else if (fParallelInputs)
+            tx.GetSpentOutputs(view, vSpent[i]);
         else
         {
             if (!tx.HaveInputs(view))
@@ -1618,44 +2000,197 @@ bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsVi
             nFees += nTxValueIn-nTxValueOut;
 
             std::vector<CScriptCheck> vChecks;
-            if (!tx.CheckInputs(state, view, flags, nScriptCheckThreads ? &vChecks : NULL))
+            if (!tx.CheckInputs(state, view, flags, pcontrol ? &vChecks : NULL, fScriptChecks))
                 return false;
-            control.Add(vChecks);
+            if (pcontrol)
+                pcontrol->Add(vChecks);
         }
 
         CTxUndo txundo;
-        tx.UpdateCoins(state, view, txundo, pindex->nHeight, GetTxHash(i));
+        tx.UpdateCoins(state, view, txundo, nHeight, GetTxHash(i));
         if (!tx.IsCoinBase())
             blockundo.vtxundo.push_back(txundo);
-
-        vPos.push_back(std::make_pair(GetTxHash(i), pos));
-        pos.nTxOffset += ::GetSerializeSize(tx, SER_DISK, CLIENT_VERSION);
     }
 
-    if (!fJustCheck)
+    if (fParallelInputs)
     {
-        // primecoin: track money supply
-        pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
-        CDiskBlockIndex blockindex(pindex);
-        if (!pblocktree->WriteBlockIndex(blockindex))
-            return state.Abort("Failed to write block index for moneysupply");
-    }
+        std::vector<CInputsCheckResult> vResult(nFail);
+        {
+            std::vector<CInputsCheck> vChecks;
+            vChecks.reserve(nFail);
+            for (unsigned int i=1; i<nFail; i++)
+                vChecks.push_back(CInputsCheck(vtx[i], vSpent[i], nHeight, fStrictPayToScriptHash, &vResult[i]));
+            CCheckQueueControl<CInputsCheck> controlInputs(&inputscheckqueue);
+            controlInputs.Add(vChecks);
+            controlInputs.Wait();
+        }
 
-    int64 nTime = GetTimeMicros() - nStart;
-    if (fBenchmark)
-        printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)vtx.size(), 0.001 * nTime, 0.001 * nTime / vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+        // Merge the outcomes in block order, so the first failure is the one reported
+        for (unsigned int i=0; i<nFail; i++)
+        {
+            const CTransaction &tx = vtx[i];
+            CInputsCheckResult &result = vResult[i];
+
+            nSigOps += vLegacySigOps[i];
+            if (nSigOps > MAX_BLOCK_SIGOPS)
+                return state.DoS(100, error("ConnectBlock() : too many sigops"));
+            if (tx.IsCoinBase())
+                continue;
+
+            nSigOps += result.nSigOps;
+            if (nSigOps > MAX_BLOCK_SIGOPS)
+                return state.DoS(100, error("ConnectBlock() : too many sigops"));
+            if (!result.state.IsValid()) {
+                state = result.state;
+                return false;
+            }
 
-    if (vtx[0].GetValueOut() > GetBlockValue(pindex->nBits, nFees) - vtx[0].GetMinFee() + MIN_TX_FEE)
-        return state.DoS(100, error("ConnectBlock() : coinbase pays too much (actual=%s vs limit=%s)", FormatMoney(vtx[0].GetValueOut()).c_str(), FormatMoney(GetBlockValue(pindex->nBits, nFees) - vtx[0].GetMinFee() + MIN_TX_FEE).c_str()));
+            int64 nTxValueOut = tx.GetValueOut();
+            nValueIn += result.nValueIn;
+            nValueOut += nTxValueOut;
+            nFees += result.nValueIn-nTxValueOut;
 
-    if (!control.Wait())
-        return state.DoS(100, false);
-    int64 nTime2 = GetTimeMicros() - nStart;
-    if (fBenchmark)
-        printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+            if (fScriptChecks)
+            {
+                std::vector<CScriptCheck> vChecks;
+                if (!tx.CheckInputScripts(state, vSpent[i], flags, pcontrol ? &vChecks : NULL))
+                    return false;
+                if (pcontrol)
+                    pcontrol->Add(vChecks);
+            }
+        }
 
-    if (fJustCheck)
-        return true;
+        // The transaction the loop stopped at, checked as in block order
+        if (nFail < vtx.size())
+        {
+            nSigOps += vLegacySigOps[nFail];
+            if (nSigOps > MAX_BLOCK_SIGOPS)
+                return state.DoS(100, error("ConnectBlock() : too many sigops"));
+            return state.DoS(100, error("ConnectBlock() : inputs missing/spent"));
+        }
+    }
+
+    return true;
+}
+
+bool CBlock::ConnectBlock(CValidationState &state, CBlockIndex* pindex, CCoinsViewCache &view, bool fJustCheck, bool fCheckAllScripts)
+{
+    // Check it again in case a previous version let a bad block in
+    if (!CheckBlock(state, !fJustCheck, !fJustCheck))
+        return false;
+
+    // verify that the view's current state corresponds to the previous block
+    assert(pindex->pprev == view.GetBestBlock());
+
+    // Special case for the genesis block, skipping connection of its transactions
+    // (its coinbase is unspendable)
+    if (GetHash() == hashGenesisBlock) {
+        view.SetBestBlock(pindex);
+        pindexGenesisBlock = pindex;
+        return true;
+    }
+
+    // Read the coins of the block from the database in parallel, instead of
+    // one at a time as the checks below miss the cache
+    PrefetchCoins(std::vector<const CBlock*>(1, this));
+
+    // Scripts of the -assumevalid block and its ancestors are not checked,
+    // unless the block is just being checked or re-verified. Only the
+    // connection of the chain itself logs where the checks switch.
+    bool fScriptChecks = fJustCheck || fCheckAllScripts || !IsAssumedValid(pindex);
+    static bool fScriptChecksLast = true;
+    if (!fJustCheck && !fCheckAllScripts && fScriptChecks != fScriptChecksLast)
+    {
+        if (fScriptChecks)
+            printf("ConnectBlock() : checking scripts from height %d on\n", pindex->nHeight);
+        else
+            printf("ConnectBlock() : assuming scripts valid from height %d up to block %s\n", pindex->nHeight, hashAssumeValid.ToString().c_str());
+        fScriptChecksLast = fScriptChecks;
+    }
+
+    // Do not allow blocks that contain transactions which 'overwrite' older transactions,
+    // unless those are already completely spent.
+    // If such overwrites are allowed, coinbases and transactions depending upon those
+    // can be duplicated to remove the ability to spend the first instance -- even after
+    // being sent to another address.
+    // See BIP30 and http://r6.ca/blog/20120206T005236Z.html for more information.
+    // This logic is not necessary for memory pool transactions, as AcceptToMemoryPool
+    // already refuses previously-known transaction ids entirely.
+    // This rule was originally applied all blocks whose timestamp was after March 15, 2012, 0:00 UTC.
+    // Now that the whole chain is irreversibly beyond that time it is applied to all blocks except the
+    // two in the chain that violate it. This prevents exploiting the issue against nodes in their
+    // initial block download.
+    bool fEnforceBIP30 = (!pindex->phashBlock) ||
+                          !((pindex->nHeight==91842 && pindex->GetBlockHash() == uint256("0x00000000000a4d0a398161ffc163c503763b1f4360639393e0e4c8e300e0caec")) ||
+                           (pindex->nHeight==91880 && pindex->GetBlockHash() == uint256("0x00000000000743f190a18c5577a3c2d2a1f610ae9601ac046a38084ccb7cd721")));
+
+    if (fEnforceBIP30) {
+        for (unsigned int i=0; i<vtx.size(); i++) {
+            uint256 hash = GetTxHash(i);
+            if (view.HaveCoins(hash) && !view.GetCoins(hash).IsPruned())
+                return state.DoS(100, error("ConnectBlock() : tried to overwrite transaction"));
+        }
+    }
+
+    // BIP16 didn't become active until Apr 1 2012
+    int64 nBIP16SwitchTime = 1333238400;
+    bool fStrictPayToScriptHash = (pindex->nTime >= nBIP16SwitchTime);
+
+    unsigned int flags = SCRIPT_VERIFY_NOCACHE |
+                         (fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE);
+
+    CBlockUndo blockundo;
+
+    CCheckQueueControl<CScriptCheck> control(nScriptCheckThreads ? &scriptcheckqueue : NULL);
+
+    int64 nStart = GetTimeMicros();
+    int64 nFees = 0;
+    int64 nValueIn = 0;
+    int64 nValueOut = 0;
+    unsigned int nSigOps = 0;
+    bool fParallelInputs = fParallelInputsCheck && nScriptCheckThreads && vtx.size() >= nInputsCheckMinTransactions;
+    if (!ConnectInputs(state, pindex->nHeight, view, flags, fScriptChecks, fParallelInputs, nScriptCheckThreads ? &control : NULL,
+                       blockundo, nSigOps, nValueIn, nValueOut, nFees))
+        return false;
+
+    int nInputs = 0;
+    CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(vtx.size()));
+    std::vector<std::pair<uint256, CDiskTxPos> > vPos;
+    vPos.reserve(vtx.size());
+    for (unsigned int i=0; i<vtx.size(); i++)
+    {
+        nInputs += vtx[i].vin.size();
+        vPos.push_back(std::make_pair(GetTxHash(i), pos));
+        pos.nTxOffset += ::GetSerializeSize(vtx[i], SER_DISK, CLIENT_VERSION);
+    }
+
+    if (!fJustCheck)
+    {
+        // primecoin: track money supply
+        pindex->nMoneySupply = (pindex->pprev? pindex->pprev->nMoneySupply : 0) + nValueOut - nValueIn;
+        // Fill in the multiplier of entries written by older clients
+        if (pindex->bnPrimeChainMultiplier == 0)
+            pindex->bnPrimeChainMultiplier = bnPrimeChainMultiplier;
+        CDiskBlockIndex blockindex(pindex);
+        if (!pblocktree->WriteBlockIndex(blockindex))
+            return state.Abort("Failed to write block index for moneysupply");
+    }
+
+    int64 nTime = GetTimeMicros() - nStart;
+    if (fBenchmark)
+        printf("- Connect %u transactions: %.2fms (%.3fms/tx, %.3fms/txin)\n", (unsigned)vtx.size(), 0.001 * nTime, 0.001 * nTime / vtx.size(), nInputs <= 1 ? 0 : 0.001 * nTime / (nInputs-1));
+
+    if (vtx[0].GetValueOut() > GetBlockValue(pindex->nBits, nFees) - vtx[0].GetMinFee() + MIN_TX_FEE)
+        return state.DoS(100, error("ConnectBlock() : coinbase pays too much (actual=%s vs limit=%s)", FormatMoney(vtx[0].GetValueOut()).c_str(), FormatMoney(GetBlockValue(pindex->nBits, nFees) - vtx[0].GetMinFee() + MIN_TX_FEE).c_str()));
+
+    if (!control.Wait())
+        return state.DoS(100, false);
+    int64 nTime2 = GetTimeMicros() - nStart;
+    if (fBenchmark)
+        printf("- Verify %u txins: %.2fms (%.3fms/txin)\n", nInputs - 1, 0.001 * nTime2, nInputs <= 1 ? 0 : 0.001 * nTime2 / (nInputs-1));
+
+    if (fJustCheck)
+        return true;
 
     // Write undo information to disk
     if (pindex->GetUndoPos().IsNull() || (pindex->nStatus & BLOCK_VALID_MASK) < BLOCK_VALID_SCRIPTS)
@@ -2173,8 +2708,8 @@ bool CBlock::AcceptBlock(CValidationState &state, CDiskBlockPos *dbp)
     return true;
 }
 
-// Get block work value for main chain protocol
-CBigNum CBlockIndex::GetBlockWork() const
+// Get block work value for main chain protocol, of a block with target nBits
+static CBigNum GetTargetWork(unsigned int nBits)
 {
     // Primecoin: 
     // Difficulty multiplier of extra prime is estimated by nWorkTransitionRatio
@@ -2196,6 +2731,11 @@ CBigNum CBlockIndex::GetBlockWork() const
     return bnWork;
 }
 
+CBigNum CBlockIndex::GetBlockWork() const
+{
+    return GetTargetWork(nBits);
+}
+
 bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned int nRequired, unsigned int nToCheck)
 {
     unsigned int nFound = 0;
@@ -2208,7 +2748,7 @@ bool CBlockIndex::IsSuperMajority(int minVersion, const CBlockIndex* pstart, uns
     return (nFound >= nRequired);
 }
 
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp, bool fChecked)
 {
     // Check for duplicate
     uint256 hash = pblock->GetHash();
@@ -2217,8 +2757,8 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     if (mapOrphanBlocks.count(hash))
         return state.Invalid(error("ProcessBlock() : already have block (orphan) %s", hash.ToString().c_str()));
 
-    // Preliminary checks
-    if (!pblock->CheckBlock(state))
+    // Preliminary checks, unless the caller did them
+    if (!fChecked && !pblock->CheckBlock(state))
         return error("ProcessBlock() : CheckBlock FAILED");
 
     // Check proof of work matches claimed amount
@@ -2246,8 +2786,10 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             mapOrphanBlocks.insert(std::make_pair(hash, pblock2));
             mapOrphanBlocksByPrev.insert(std::make_pair(pblock2->hashPrevBlock, pblock2));
 
-            // Ask this guy to fill in what we're missing
-            pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
+            // Ask this guy to fill in what we're missing, unless the
+            // headers-first sync is asking for it already
+            if (!IsHeadersSyncActive())
+                pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(pblock2));
         }
         return true;
     }
@@ -2648,7 +3190,7 @@ bool VerifyDB() {
             CBlock block;
             if (!block.ReadFromDisk(pindex))
                 return error("VerifyDB() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
-            if (!block.ConnectBlock(state, pindex, coins))
+            if (!block.ConnectBlock(state, pindex, coins, false, true))
                 return error("VerifyDB() : *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
         }
     }
@@ -2658,6 +3200,73 @@ bool VerifyDB() {
     return true;
 }
 
+bool VerifyBlockIndexProofOfWork()
+{
+    // Checked in batches, so progress and shutdown requests are noticed
+    static const unsigned int nBatchSize = 1000;
+
+    std::vector<CPowCheck> vChecks;
+    vChecks.reserve(nBatchSize);
+    unsigned int nChecked = 0;
+    unsigned int nUnknown = 0;
+    int64 nStart = GetTimeMillis();
+    printf("Verifying proof-of-work of %u blocks in the block index\n", (unsigned int) mapBlockIndex.size());
+    unsigned int nUpgraded = 0;
+    std::vector<CBlockIndex*> vpindexUpgraded; // multiplier taken from the block files in this batch
+    for (std::map<uint256, CBlockIndex*>::const_iterator mi = mapBlockIndex.begin(); mi != mapBlockIndex.end(); )
+    {
+        CBlockIndex* pindex = (*mi).second;
+        mi++;
+        // Entries written before the multiplier was stored take it from the
+        // block files once; the block hash covers the multiplier. It is only
+        // written to the block index once its proof-of-work checked out.
+        if (pindex->bnPrimeChainMultiplier == 0 && (pindex->nStatus & BLOCK_HAVE_DATA))
+        {
+            CBlock block;
+            if (!block.ReadFromDisk(pindex))
+                return error("VerifyBlockIndexProofOfWork() : *** block.ReadFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString().c_str());
+            pindex->bnPrimeChainMultiplier = block.bnPrimeChainMultiplier;
+            if (pindex->bnPrimeChainMultiplier != 0)
+                vpindexUpgraded.push_back(pindex);
+        }
+        if (pindex->bnPrimeChainMultiplier == 0)
+            nUnknown++;
+        else
+            vChecks.push_back(CPowCheck(pindex));
+        if (vChecks.size() < nBatchSize && mi != mapBlockIndex.end())
+            continue;
+
+        boost::this_thread::interruption_point();
+        nChecked += vChecks.size();
+        if (nScriptCheckThreads) {
+            LOCK(cs_powcheckqueue);
+            CCheckQueueControl<CPowCheck> control(&powcheckqueue);
+            control.Add(vChecks);
+            if (!control.Wait())
+                return error("VerifyBlockIndexProofOfWork() : *** found bad proof-of-work");
+        } else {
+            BOOST_FOREACH(CPowCheck& check, vChecks)
+                if (!check())
+                    return error("VerifyBlockIndexProofOfWork() : *** found bad proof-of-work");
+        }
+        vChecks.clear();
+        BOOST_FOREACH(CBlockIndex* pindexUpgraded, vpindexUpgraded)
+            if (!pblocktree->WriteBlockIndex(CDiskBlockIndex(pindexUpgraded)))
+                return error("VerifyBlockIndexProofOfWork() : failed to write block index");
+        nUpgraded += vpindexUpgraded.size();
+        vpindexUpgraded.clear();
+    }
+    if (nUpgraded > 0) {
+        pblocktree->Sync();
+        printf("VerifyBlockIndexProofOfWork() : added the multiplier of %u blocks to the block index\n", nUpgraded);
+    }
+    if (nUnknown > 0)
+        return error("VerifyBlockIndexProofOfWork() : *** %u blocks have no multiplier in the block index nor block data, restart with -reindex", nUnknown);
+    printf("No proof-of-work inconsistencies in %u blocks in %"PRI64d"ms\n", nChecked, GetTimeMillis() - nStart);
+
+    return true;
+}
+
 void UnloadBlockIndex()
 {
     mapBlockIndex.clear();
@@ -2772,12 +3381,52 @@ bool InitBlockIndex() {
     return true;
 }
 
+// Blocks read from a block file before their proof-of-work is checked in
+// parallel and they are processed in order
+static const unsigned int nLoadBatchBlocks = 128;
+static const unsigned int nLoadBatchBytes = 4 * MAX_BLOCK_SIZE;
+
+// Process a batch of blocks read from a block file, in file order
+// Return value: false if a system error stops the loading
+static bool LoadBlockBatch(std::vector<CBlock>& vBlock, std::vector<uint64>& vBlockPos, CDiskBlockPos *dbp, int& nLoaded)
+{
+    std::vector<const CBlock*> vpblock;
+    BOOST_FOREACH(const CBlock& block, vBlock)
+        vpblock.push_back(&block);
+    PreCheckProofOfWork(vpblock);
+
+    bool fContinue = true;
+    for (unsigned int i = 0; i < vBlock.size(); i++) {
+        try {
+            LOCK(cs_main);
+            if (dbp)
+                dbp->nPos = vBlockPos[i];
+            CValidationState state;
+            if (ProcessBlock(state, NULL, &vBlock[i], dbp))
+                nLoaded++;
+            if (state.IsError()) {
+                fContinue = false;
+                break;
+            }
+        } catch (std::exception &e) {
+            printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+        }
+    }
+    vBlock.clear();
+    vBlockPos.clear();
+    return fContinue;
+}
+
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
 {
     int64 nStart = GetTimeMillis();
 
     int nLoaded = 0;
     try {
+        std::vector<CBlock> vBlock;
+        std::vector<uint64> vBlockPos;
+        unsigned int nBatchBytes = 0;
+        vBlock.reserve(nLoadBatchBlocks);
         CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
         uint64 nStartByte = 0;
         if (dbp) {
@@ -2820,21 +3469,25 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
                 blkdat >> block;
                 nRewind = blkdat.GetPos();
 
-                // process block
+                // queue block for processing
                 if (nBlockPos >= nStartByte) {
-                    LOCK(cs_main);
-                    if (dbp)
-                        dbp->nPos = nBlockPos;
-                    CValidationState state;
-                    if (ProcessBlock(state, NULL, &block, dbp))
-                        nLoaded++;
-                    if (state.IsError())
-                        break;
+                    vBlock.push_back(block);
+                    vBlockPos.push_back(nBlockPos);
+                    nBatchBytes += nSize;
                 }
             } catch (std::exception &e) {
                 printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
             }
+
+            // process queued blocks
+            if (vBlock.size() >= nLoadBatchBlocks || nBatchBytes >= nLoadBatchBytes) {
+                nBatchBytes = 0;
+                if (!LoadBlockBatch(vBlock, vBlockPos, dbp, nLoaded))
+                    break;
+            }
         }
+        if (!vBlock.empty())
+            LoadBlockBatch(vBlock, vBlockPos, dbp, nLoaded);
         fclose(fileIn);
     } catch(std::runtime_error &e) {
         AbortNode(std::string("Error: system error: ") + e.what());
@@ -2844,6 +3497,92 @@ bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp)
     return nLoaded > 0;
 }
 
+// Add the hash and previous block hash of every block in a block file to vPrev
+static void ReadBlockFileHeaders(FILE* fileIn, std::vector<std::pair<uint256, uint256> >& vPrev)
+{
+    try {
+        CBufferedFile blkdat(fileIn, 2*MAX_BLOCK_SIZE, MAX_BLOCK_SIZE+8, SER_DISK, CLIENT_VERSION);
+        uint64 nRewind = blkdat.GetPos();
+        while (blkdat.good() && !blkdat.eof()) {
+            boost::this_thread::interruption_point();
+
+            blkdat.SetPos(nRewind);
+            nRewind++; // start one byte further next time, in case of failure
+            blkdat.SetLimit(); // remove former limit
+            unsigned int nSize = 0;
+            try {
+                // locate a header
+                unsigned char buf[4];
+                blkdat.FindByte(pchMessageStart[0]);
+                nRewind = blkdat.GetPos()+1;
+                blkdat >> FLATDATA(buf);
+                if (memcmp(buf, pchMessageStart, 4))
+                    continue;
+                // read size
+                blkdat >> nSize;
+                if (nSize < 80 || nSize > MAX_BLOCK_SIZE)
+                    continue;
+            } catch (std::exception &e) {
+                // no valid block header found; don't complain
+                break;
+            }
+            try {
+                // read the block header only, and skip the transactions
+                uint64 nBlockPos = blkdat.GetPos();
+                blkdat.SetLimit(nBlockPos + nSize);
+                CBlockHeader header;
+                blkdat >> header;
+                vPrev.push_back(std::make_pair(header.GetHash(), header.hashPrevBlock));
+                nRewind = nBlockPos + nSize;
+                blkdat.SetLimit();
+                blkdat.Seek(nRewind);
+            } catch (std::exception &e) {
+                printf("%s() : Deserialize or I/O error caught during load\n", __PRETTY_FUNCTION__);
+            }
+        }
+        fclose(fileIn);
+    } catch(std::runtime_error &e) {
+        AbortNode(std::string("Error: system error: ") + e.what());
+    }
+}
+
+void FindReindexAssumeValidChain()
+{
+    if (hashAssumeValid == 0)
+        return;
+
+    int64 nStart = GetTimeMillis();
+    std::vector<std::pair<uint256, uint256> > vPrev;
+    for (int nFile = 0; ; nFile++) {
+        FILE *file = OpenBlockFile(CDiskBlockPos(nFile, 0), true);
+        if (!file)
+            break;
+        ReadBlockFileHeaders(file, vPrev);
+    }
+    std::sort(vPrev.begin(), vPrev.end());
+
+    // Walk back from the -assumevalid block to the genesis block
+    std::vector<uint256> vChain;
+    uint256 hash = hashAssumeValid;
+    while (true) {
+        vChain.push_back(hash);
+        if (hash == hashGenesisBlock)
+            break;
+        std::vector<std::pair<uint256, uint256> >::const_iterator it = std::lower_bound(vPrev.begin(), vPrev.end(), std::make_pair(hash, uint256(0)));
+        if (it == vPrev.end() || it->first != hash || vChain.size() > vPrev.size()) {
+            printf("FindReindexAssumeValidChain() : block %s and its ancestors not found in the block files\n", hashAssumeValid.ToString().c_str());
+            return;
+        }
+        hash = it->second;
+    }
+    std::reverse(vChain.begin(), vChain.end());
+    printf("FindReindexAssumeValidChain() : found block %s at height %d in the headers of %"PRIszu" blocks in %"PRI64d"ms\n",
+        hashAssumeValid.ToString().c_str(), (int)vChain.size() - 1, vPrev.size(), GetTimeMillis() - nStart);
+
+    LOCK(cs_main);
+    vReindexAssumeValidChain.swap(vChain);
+}
+
 std::string GetWarnings(std::string strFor)
 {
     std::string strStatusBar;
@@ -2899,6 +3638,314 @@ bool static AlreadyHave(const CInv& inv)
     return true;
 }
 
+//
+// Headers-first sync
+//
+// The sync node sends the header chain ahead of our best block, and the
+// proof-of-work of each header is checked as it comes in. The blocks of the
+// first SYNC_BLOCK_WINDOW headers are requested from all peers, at most
+// SYNC_BLOCKS_PER_PEER at a time from each. A block not delivered within
+// SYNC_BLOCK_TIMEOUT seconds is asked from the next peer with room. Blocks
+// arriving ahead of their parent wait among the orphan blocks and connect in
+// chain order once the parent is in.
+//
+
+// Restart the header chain at a block we have
+static void SetSyncHeadersBase(const CBlockIndex* pindex)
+{
+    vSyncHeaders.clear();
+    hashSyncHeadersBase = pindex->GetBlockHash();
+    nSyncHeadersBaseHeight = pindex->nHeight;
+    nSyncHeadersWork = 0;
+    nSyncAssumeValidHeight = -1;
+}
+
+// Most headers to keep ahead of the best block: with -assumevalid, the header
+// chain reaches further until it finds the block, so that its ancestors skip
+// their script checks
+static unsigned int GetSyncHeadersMax()
+{
+    if (hashAssumeValid != 0 && nSyncAssumeValidHeight < 0 && !mapBlockIndex.count(hashAssumeValid))
+        return SYNC_HEADERS_ASSUMEVALID_MAX;
+    return SYNC_HEADERS_MAX;
+}
+
+static uint256 GetSyncHeadersTip()
+{
+    return vSyncHeaders.empty()? hashSyncHeadersBase : vSyncHeaders.back().hash;
+}
+
+// Position of a header in the header chain, -1 if it is not there
+static int FindSyncHeader(const uint256& hash)
+{
+    // Most lookups are for the last headers
+    for (int i = vSyncHeaders.size(); i-- > 0; )
+        if (vSyncHeaders[i].hash == hash)
+            return i;
+    return -1;
+}
+
+// Drop the headers of the blocks that have come in
+static void PruneSyncHeaders()
+{
+    while (!vSyncHeaders.empty())
+    {
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(vSyncHeaders.front().hash);
+        if (mi == mapBlockIndex.end())
+            break;
+        hashSyncHeadersBase = vSyncHeaders.front().hash;
+        nSyncHeadersBaseHeight = mi->second->nHeight;
+        nSyncHeadersWork -= GetTargetWork(vSyncHeaders.front().nBits).getuint256();
+        nSyncHeadersLastProgress = GetTime();
+        vSyncHeaders.pop_front();
+    }
+    if (vSyncHeaders.empty())
+        mapSyncBlocksInFlight.clear();
+}
+
+// Ask pto for the headers following the header chain
+static void PushGetHeaders(CNode* pto)
+{
+    CBlockLocator locator(pindexBest);
+    if (!vSyncHeaders.empty())
+        locator.PushFront(vSyncHeaders.back().hash);
+    pto->fGetHeaders = false;
+    pto->fGetHeadersPending = true;
+    pto->PushMessage("getheaders", locator, uint256(0));
+}
+
+// Add the headers pfrom sent to the header chain. Headers we have are
+// skipped; the others have to follow each other and carry the target due
+// after their parent. Headers forking off the header chain, or off a block we
+// have, replace it from there only with more work than the header chain and
+// the best chain have. A fork is weighed by the headers of one message.
+static bool AddSyncHeaders(CNode* pfrom, const std::vector<CBlock>& vHeaders)
+{
+    unsigned int nFirst = 0;
+    while (nFirst < vHeaders.size())
+    {
+        uint256 hash = vHeaders[nFirst].GetHash();
+        if (!mapBlockIndex.count(hash) && FindSyncHeader(hash) < 0)
+            break;
+        nFirst++;
+    }
+    if (nFirst == vHeaders.size())
+        return true;
+
+    // The new headers follow the first nKeep headers of the header chain, or
+    // a block we have other than its base, which becomes the new base
+    const uint256& hashPrevFirst = vHeaders[nFirst].hashPrevBlock;
+    const CBlockIndex* pindexNewBase = NULL;
+    const CBlockIndex* pindexLast = NULL;
+    unsigned int nKeep = FindSyncHeader(hashPrevFirst) + 1;
+    if (nKeep == 0)
+    {
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashPrevFirst);
+        if (mi == mapBlockIndex.end())
+            return error("AddSyncHeaders() : header %s does not connect", vHeaders[nFirst].GetHash().ToString().c_str());
+        pindexLast = mi->second;
+        if (hashPrevFirst != hashSyncHeadersBase)
+            pindexNewBase = pindexLast;
+    }
+
+    // What the target of the next header depends on
+    int nHeightLast;
+    unsigned int nBitsLast;
+    int64 nTimeLast, nTimePrev;
+    if (pindexLast)
+    {
+        nHeightLast = pindexLast->nHeight;
+        nBitsLast = pindexLast->nBits;
+        nTimeLast = pindexLast->GetBlockTime();
+        nTimePrev = pindexLast->pprev ? pindexLast->pprev->GetBlockTime() : 0;
+    }
+    else
+    {
+        nHeightLast = nSyncHeadersBaseHeight + nKeep;
+        nBitsLast = vSyncHeaders[nKeep - 1].nBits;
+        nTimeLast = vSyncHeaders[nKeep - 1].nTime;
+        nTimePrev = (nKeep > 1)? vSyncHeaders[nKeep - 2].nTime : mapBlockIndex[hashSyncHeadersBase]->GetBlockTime();
+    }
+
+    std::vector<CSyncHeader> vBranch;
+    uint256 nBranchWork = 0;
+    uint256 hashLast = hashPrevFirst;
+    for (unsigned int i = nFirst; i < vHeaders.size() && nKeep + vBranch.size() < GetSyncHeadersMax(); i++)
+    {
+        const CBlock& header = vHeaders[i];
+        uint256 hash = header.GetHash();
+        if (header.hashPrevBlock != hashLast)
+        {
+            pfrom->Misbehaving(20);
+            return error("AddSyncHeaders() : header %s does not follow the one before", hash.ToString().c_str());
+        }
+        if (header.nBits != GetNextTarget(nHeightLast, nBitsLast, nTimeLast, nTimePrev))
+        {
+            pfrom->Misbehaving(100);
+            return error("AddSyncHeaders() : incorrect target of header %s", hash.ToString().c_str());
+        }
+        unsigned int nChainType, nChainLength;
+        if (!CheckProofOfWork(header.GetHeaderHash(), header.nBits, header.bnPrimeChainMultiplier, nChainType, nChainLength))
+        {
+            pfrom->Misbehaving(100);
+            return error("AddSyncHeaders() : proof of work failed for header %s", hash.ToString().c_str());
+        }
+        if (header.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+            return error("AddSyncHeaders() : header %s timestamp too far in the future", hash.ToString().c_str());
+
+        CSyncHeader syncheader;
+        syncheader.hash = hash;
+        syncheader.nTime = header.nTime;
+        syncheader.nBits = header.nBits;
+        vBranch.push_back(syncheader);
+        nBranchWork += GetTargetWork(header.nBits).getuint256();
+        hashLast = hash;
+        nHeightLast++;
+        nBitsLast = header.nBits;
+        nTimePrev = nTimeLast;
+        nTimeLast = header.GetBlockTime();
+    }
+    if (vBranch.empty())
+        return true;
+
+    // Compare the chain work with the new headers to the most we know of
+    uint256 nReplacedWork = 0;
+    for (unsigned int i = nKeep; i < vSyncHeaders.size(); i++)
+        nReplacedWork += GetTargetWork(vSyncHeaders[i].nBits).getuint256();
+    uint256 nWorkBest = nBestChainWork;
+    uint256 nWorkNew = nBranchWork;
+    if (!vSyncHeaders.empty() || !pindexNewBase)
+    {
+        uint256 nWorkHeaders = mapBlockIndex[hashSyncHeadersBase]->nChainWork + nSyncHeadersWork;
+        if (nWorkHeaders > nWorkBest)
+            nWorkBest = nWorkHeaders;
+        if (!pindexNewBase)
+            nWorkNew += nWorkHeaders - nReplacedWork;
+    }
+    if (pindexNewBase)
+        nWorkNew += pindexNewBase->nChainWork;
+    if (nWorkNew <= nWorkBest)
+    {
+        printf("AddSyncHeaders() : ignoring %"PRIszu" headers from %s with less work than we have\n", vBranch.size(), pfrom->addrName.c_str());
+        return true;
+    }
+
+    if (pindexNewBase || nKeep < vSyncHeaders.size())
+    {
+        if (!vSyncHeaders.empty())
+            printf("AddSyncHeaders() : switching the header chain to a branch with more work from %s\n", pfrom->addrName.c_str());
+        if (pindexNewBase)
+            SetSyncHeadersBase(pindexNewBase);
+        else
+        {
+            vSyncHeaders.erase(vSyncHeaders.begin() + nKeep, vSyncHeaders.end());
+            nSyncHeadersWork -= nReplacedWork;
+            if (nSyncAssumeValidHeight > nSyncHeadersBaseHeight + (int)vSyncHeaders.size())
+                nSyncAssumeValidHeight = -1;
+        }
+    }
+    if (vSyncHeaders.empty())
+        nSyncHeadersLastProgress = GetTime();
+    BOOST_FOREACH(const CSyncHeader& syncheader, vBranch)
+    {
+        vSyncHeaders.push_back(syncheader);
+        if (syncheader.hash == hashAssumeValid)
+        {
+            nSyncAssumeValidHeight = nSyncHeadersBaseHeight + vSyncHeaders.size();
+            printf("AddSyncHeaders() : found the assumed-valid block %s at height %d\n", syncheader.hash.ToString().c_str(), nSyncAssumeValidHeight);
+        }
+    }
+    nSyncHeadersWork += nBranchWork;
+    return true;
+}
+
+// Request blocks of the header chain from pto, and more headers when there
+// is room for them
+static void SendSyncGetData(CNode* pto)
+{
+    PruneSyncHeaders();
+    int64 nNow = GetTime();
+
+    // Forget the requests that were answered, timed out or went to another node
+    for (std::set<uint256>::iterator it = pto->setBlocksInFlight.begin(); it != pto->setBlocksInFlight.end(); )
+    {
+        std::map<uint256, std::pair<int64, CNode*> >::iterator mi = mapSyncBlocksInFlight.find(*it);
+        if (mi == mapSyncBlocksInFlight.end() || mi->second.second != pto || nNow - mi->second.first >= SYNC_BLOCK_TIMEOUT ||
+            AlreadyHave(CInv(MSG_BLOCK, *it)))
+            pto->setBlocksInFlight.erase(it++);
+        else
+            it++;
+    }
+
+    if (!pto->fSuccessfullyConnected || pto->fClient || pto->fDisconnect)
+        return;
+
+    // Fall back to getblocks when the blocks of the header chain stop coming in
+    if (!vSyncHeaders.empty() && nNow - nSyncHeadersLastProgress > SYNC_HEADERS_STALL_TIMEOUT)
+    {
+        printf("headers-first sync stalled at height %d, asking %s for blocks instead\n", nSyncHeadersBaseHeight + 1, pto->addrName.c_str());
+        SetSyncHeadersBase(pindexBest);
+        mapSyncBlocksInFlight.clear();
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                pnode->fGetHeaders = false;
+        }
+        pto->PushGetBlocks(pindexBest, uint256(0));
+        return;
+    }
+
+    // Take over asking for headers from a node that went away
+    if (fSyncGetHeadersOrphaned && pto->nStartingHeight > nSyncHeadersBaseHeight + (int)vSyncHeaders.size())
+    {
+        fSyncGetHeadersOrphaned = false;
+        pto->fGetHeaders = true;
+    }
+
+    std::vector<CInv> vGetData;
+    for (unsigned int i = 0; i < vSyncHeaders.size() && i < SYNC_BLOCK_WINDOW && pto->setBlocksInFlight.size() < SYNC_BLOCKS_PER_PEER; i++)
+    {
+        // Only ask for blocks the node had when it connected
+        if (pto->nStartingHeight < nSyncHeadersBaseHeight + 1 + (int)i)
+            break;
+        CInv inv(MSG_BLOCK, vSyncHeaders[i].hash);
+        if (AlreadyHave(inv))
+            continue;
+        std::map<uint256, std::pair<int64, CNode*> >::iterator mi = mapSyncBlocksInFlight.find(inv.hash);
+        if (mi != mapSyncBlocksInFlight.end())
+        {
+            if (nNow - mi->second.first < SYNC_BLOCK_TIMEOUT)
+                continue;
+            printf("block %s stalled, asking %s\n", inv.hash.ToString().c_str(), pto->addrName.c_str());
+        }
+        mapSyncBlocksInFlight[inv.hash] = std::make_pair(nNow, pto);
+        pto->setBlocksInFlight.insert(inv.hash);
+        vGetData.push_back(inv);
+    }
+    if (!vGetData.empty())
+        pto->PushMessage("getdata", vGetData);
+
+    if (pto->fGetHeaders && vSyncHeaders.size() + MAX_HEADERS_RESULTS <= GetSyncHeadersMax())
+        PushGetHeaders(pto);
+}
+
+void FinalizeNode(CNode* pnode)
+{
+    // Other nodes are asked for the blocks requested from it right away
+    BOOST_FOREACH(const uint256& hash, pnode->setBlocksInFlight)
+    {
+        std::map<uint256, std::pair<int64, CNode*> >::iterator mi = mapSyncBlocksInFlight.find(hash);
+        if (mi != mapSyncBlocksInFlight.end() && mi->second.second == pnode)
+            mapSyncBlocksInFlight.erase(mi);
+    }
+    pnode->setBlocksInFlight.clear();
+
+    if (pnode->fGetHeaders || pnode->fGetHeadersPending)
+        fSyncGetHeadersOrphaned = true;
+    pnode->fGetHeaders = false;
+    pnode->fGetHeadersPending = false;
+}
+
 // The message start string is designed to be unlikely to occur in normal data.
 // The characters are rarely used upper ASCII, not valid as UTF-8, and produce
 // a large 4-byte int at any alignment.
@@ -3015,6 +4062,23 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Process a block received from pfrom; fChecked if it passed CheckBlock() already
+// requires LOCK(cs_main)
+static void ProcessBlockMessage(CNode* pfrom, CBlock& block, bool fChecked)
+{
+    CInv inv(MSG_BLOCK, block.GetHash());
+    mapSyncBlocksInFlight.erase(inv.hash);
+    pfrom->setBlocksInFlight.erase(inv.hash);
+
+    CValidationState state;
+    if (ProcessBlock(state, pfrom, &block, NULL, fChecked) || state.CorruptionPossible())
+        mapAlreadyAskedFor.erase(inv);
+    int nDoS = 0;
+    if (state.IsInvalid(nDoS))
+        if (nDoS > 0)
+            pfrom->Misbehaving(nDoS);
+}
+
 bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3236,6 +4300,8 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex)
                     pfrom->AskFor(inv);
+            } else if (IsHeadersSyncActive()) {
+                // the headers-first sync fetches what we're missing
             } else if (inv.type == MSG_BLOCK && mapOrphanBlocks.count(inv.hash)) {
                 pfrom->PushGetBlocks(pindexBest, GetOrphanRoot(mapOrphanBlocks[inv.hash]));
             } else if (nInv == nLastBlock) {
@@ -3333,7 +4399,7 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         std::vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         printf("getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString().c_str());
         for (; pindex; pindex = pindex->pnext)
         {
@@ -3345,6 +4411,36 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     }
 
 
+    else if (strCommand == "headers" && fHeadersFirst && !fImporting && !fReindex)
+    {
+        std::vector<CBlock> vHeaders;
+        vRecv >> vHeaders;
+        if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        {
+            pfrom->Misbehaving(20);
+            return error("message headers size() = %"PRIszu"", vHeaders.size());
+        }
+        if (fDebug)
+            printf("received %"PRIszu" headers\n", vHeaders.size());
+
+        // Only the answer to our getheaders may change the header chain
+        if (!pfrom->fGetHeadersPending)
+        {
+            if (fDebug)
+                printf("ignoring unrequested headers from %s\n", pfrom->addrName.c_str());
+            return true;
+        }
+        pfrom->fGetHeadersPending = false;
+
+        uint256 hashTip = GetSyncHeadersTip();
+        if (!AddSyncHeaders(pfrom, vHeaders))
+            return false;
+        // A full message extending the header chain means the node has more
+        if (vHeaders.size() == MAX_HEADERS_RESULTS && GetSyncHeadersTip() != hashTip)
+            pfrom->fGetHeaders = true;
+    }
+
+
     else if (strCommand == "tx")
     {
         std::vector<uint256> vWorkQueue;
@@ -3434,16 +4530,8 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
         printf("received block %s\n", block.GetHash().ToString().c_str());
         // block.print();
 
-        CInv inv(MSG_BLOCK, block.GetHash());
-        pfrom->AddInventoryKnown(inv);
-
-        CValidationState state;
-        if (ProcessBlock(state, pfrom, &block) || state.CorruptionPossible())
-            mapAlreadyAskedFor.erase(inv);
-        int nDoS = 0;
-        if (state.IsInvalid(nDoS))
-            if (nDoS > 0)
-                pfrom->Misbehaving(nDoS);
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, block.GetHash()));
+        ProcessBlockMessage(pfrom, block, false);
     }
 
 
@@ -3559,6 +4647,272 @@ bool static ProcessMessage(CNode* pfrom, std::string strCommand, CDataStream& vR
     return true;
 }
 
+// Block messages whose proof-of-work is checked together ahead of processing
+static const unsigned int nPreCheckBlockMessages = 128;
+
+// Check the proof-of-work of the block message at itBegin and of the block
+// messages received after it in parallel, outside cs_main
+// requires LOCK(cs_vRecvMsg)
+static void PreCheckBlockMessages(CNode* pfrom, std::deque<CNetMessage>::iterator itBegin)
+{
+    std::vector<CBlock> vBlock;
+    for (std::deque<CNetMessage>::iterator it = itBegin; it != pfrom->vRecvMsg.end() && vBlock.size() < nPreCheckBlockMessages; it++) {
+        CNetMessage& msg = *it;
+        if (!msg.complete())
+            break;
+        if (msg.fPreChecked || !msg.hdr.IsValid() || msg.hdr.GetCommand() != "block")
+            continue;
+        msg.fPreChecked = true;
+        try {
+            CDataStream vRecv(msg.vRecv.begin(), msg.vRecv.end(), msg.vRecv.nType, msg.vRecv.nVersion);
+            vBlock.push_back(CBlock());
+            vRecv >> vBlock.back();
+        } catch (std::exception &e) {
+            // left for ProcessMessage to complain about
+            vBlock.pop_back();
+        }
+    }
+
+    std::vector<const CBlock*> vpblock;
+    BOOST_FOREACH(const CBlock& block, vBlock)
+        vpblock.push_back(&block);
+    PreCheckProofOfWork(vpblock);
+}
+
+// Check the proof-of-work of the headers of a headers message in parallel,
+// outside cs_main
+static void PreCheckHeadersMessage(CNetMessage& msg)
+{
+    msg.fPreChecked = true;
+    std::vector<CBlock> vHeaders;
+    try {
+        CDataStream vRecv(msg.vRecv.begin(), msg.vRecv.end(), msg.vRecv.nType, msg.vRecv.nVersion);
+        vRecv >> vHeaders;
+    } catch (std::exception &e) {
+        // left for ProcessMessage to complain about
+        return;
+    }
+    if (vHeaders.size() > MAX_HEADERS_RESULTS)
+        return;
+
+    std::vector<const CBlock*> vpblock;
+    BOOST_FOREACH(const CBlock& header, vHeaders)
+        vpblock.push_back(&header);
+    PreCheckProofOfWork(vpblock);
+}
+
+//
+// Block message pipeline
+//
+// Block messages pass through stages, each on its own thread, so the
+// message handler does not hold cs_main while a block is checked and
+// connected:
+//  1. the message handler deserializes the block and queues it, outside
+//     cs_main; a node's block messages wait while the pipeline holds
+//     nBlockPipelineQueueSize blocks, in whichever stage
+//  2. the check thread checks the proof-of-work of the blocks queued in
+//     parallel, runs the context-free checks of CheckBlock(), and reads the
+//     coins the blocks spend into the coins cache
+//  3. the connect thread takes cs_main and hands the blocks to
+//     ProcessBlock() in the order they were received
+// Other messages still take cs_main, so they wait for the block being
+// connected.
+// Blocks still in the pipeline when its threads are interrupted are dropped.
+//
+
+static const unsigned int nBlockPipelineQueueSize = 128;
+
+/** A block on its way through the pipeline */
+struct CPipelineBlock
+{
+    CBlock* pblock;
+    CNode* pfrom;  // referenced while the block is queued
+    bool fChecked; // passed CheckBlock()
+};
+
+class CBlockPipeline
+{
+private:
+    boost::mutex mutex;
+    boost::condition_variable condCheck;   // blocks waiting for the check stage
+    boost::condition_variable condConnect; // blocks waiting for the connect stage
+    std::deque<CPipelineBlock> queueCheck;
+    std::deque<CPipelineBlock> queueConnect;
+    unsigned int nInFlight; // blocks pushed and not yet connected or dropped
+    int nThreads;
+    bool fStopped;
+
+    // Free a block and the reference to the node it came from
+    static void Release(const CPipelineBlock& item)
+    {
+        delete item.pblock;
+        LOCK(cs_vNodes);
+        item.pfrom->Release();
+    }
+
+    void Start()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        nThreads++;
+    }
+
+    // A stage thread was interrupted: drop the blocks it holds and those
+    // queued, and take no more
+    void Stop(std::deque<CPipelineBlock>& queueHeld)
+    {
+        std::deque<CPipelineBlock> queueDrop;
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            nThreads--;
+            fStopped = true;
+            queueDrop.swap(queueHeld);
+            queueDrop.insert(queueDrop.end(), queueCheck.begin(), queueCheck.end());
+            queueDrop.insert(queueDrop.end(), queueConnect.begin(), queueConnect.end());
+            queueCheck.clear();
+            queueConnect.clear();
+            nInFlight -= queueDrop.size();
+        }
+        BOOST_FOREACH(const CPipelineBlock& item, queueDrop)
+            Release(item);
+    }
+
+public:
+    CBlockPipeline() : nInFlight(0), nThreads(0), fStopped(false) {}
+
+    // Whether both stage threads have started, and none has stopped
+    bool IsRunning()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nThreads == 2 && !fStopped;
+    }
+
+    bool IsFull()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        return nInFlight >= nBlockPipelineQueueSize;
+    }
+
+    // Stage 1: queue a block received from pfrom, taking ownership of it
+    void Push(CNode* pfrom, CBlock* pblock)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        if (fStopped)
+        {
+            delete pblock;
+            return;
+        }
+        {
+            LOCK(cs_vNodes);
+            pfrom->AddRef();
+        }
+        CPipelineBlock item;
+        item.pblock = pblock;
+        item.pfrom = pfrom;
+        item.fChecked = false;
+        queueCheck.push_back(item);
+        nInFlight++;
+        condCheck.notify_one();
+    }
+
+    // Stage 2
+    void ThreadCheck()
+    {
+        Start();
+        std::deque<CPipelineBlock> queueBatch;
+        try {
+            loop
+            {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (queueCheck.empty())
+                        condCheck.wait(lock);
+                    queueBatch.swap(queueCheck);
+                }
+
+                std::vector<const CBlock*> vpblock;
+                BOOST_FOREACH(const CPipelineBlock& item, queueBatch)
+                    vpblock.push_back(item.pblock);
+                PreCheckProofOfWork(vpblock);
+                // A block failing here is checked again by ProcessBlock(),
+                // which reports on it
+                BOOST_FOREACH(CPipelineBlock& item, queueBatch)
+                {
+                    CValidationState stateDummy;
+                    item.fChecked = item.pblock->CheckBlock(stateDummy);
+                }
+                // Warm the coins cache for the connect stage, orphans included
+                std::vector<const CBlock*> vpblockChecked;
+                BOOST_FOREACH(const CPipelineBlock& item, queueBatch)
+                    if (item.fChecked)
+                        vpblockChecked.push_back(item.pblock);
+                PrefetchCoins(vpblockChecked);
+
+                // The in-flight limit also bounds the connect queue
+                boost::unique_lock<boost::mutex> lock(mutex);
+                queueConnect.insert(queueConnect.end(), queueBatch.begin(), queueBatch.end());
+                queueBatch.clear();
+                condConnect.notify_one();
+            }
+        }
+        catch (boost::thread_interrupted)
+        {
+            Stop(queueBatch);
+            throw;
+        }
+    }
+
+    // Stage 3
+    void ThreadConnect()
+    {
+        Start();
+        std::deque<CPipelineBlock> queueHeld;
+        try {
+            loop
+            {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    while (queueConnect.empty())
+                        condConnect.wait(lock);
+                    queueHeld.push_back(queueConnect.front());
+                    queueConnect.pop_front();
+                }
+
+                const CPipelineBlock& item = queueHeld.front();
+                if (!fImporting && !fReindex)
+                {
+                    LOCK(cs_main);
+                    ProcessBlockMessage(item.pfrom, *item.pblock, item.fChecked);
+                }
+                Release(item);
+                queueHeld.clear();
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    nInFlight--;
+                }
+            }
+        }
+        catch (boost::thread_interrupted)
+        {
+            Stop(queueHeld);
+            throw;
+        }
+    }
+};
+
+static CBlockPipeline blockpipeline;
+
+void ThreadBlockCheck()
+{
+    RenameThread("primecoin-blkchk");
+    blockpipeline.ThreadCheck();
+}
+
+void ThreadBlockConnect()
+{
+    RenameThread("primecoin-blkcon");
+    blockpipeline.ThreadConnect();
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -3599,6 +4953,10 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // leave blocks waiting while the block pipeline is full
+        if (msg.hdr.GetCommand() == "block" && blockpipeline.IsRunning() && blockpipeline.IsFull())
+            break;
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -3637,7 +4995,23 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            // fImporting and fReindex are accessed out of cs_main here, as
+            // in StartSync; a stale value only costs a wasted check
+            if (strCommand == "block" && pfrom->nVersion != 0 && !fImporting && !fReindex && blockpipeline.IsRunning())
+            {
+                std::auto_ptr<CBlock> pblock(new CBlock());
+                vRecv >> *pblock;
+                printf("received block %s\n", pblock->GetHash().ToString().c_str());
+                pfrom->AddInventoryKnown(CInv(MSG_BLOCK, pblock->GetHash()));
+                blockpipeline.Push(pfrom, pblock.release());
+                fRet = true;
+            }
+            else
             {
+                if (strCommand == "block" && !msg.fPreChecked && !fImporting && !fReindex)
+                    PreCheckBlockMessages(pfrom, it - 1);
+                if (strCommand == "headers" && !msg.fPreChecked && fHeadersFirst && !fImporting && !fReindex)
+                    PreCheckHeadersMessage(msg);
                 LOCK(cs_main);
                 fRet = ProcessMessage(pfrom, strCommand, vRecv);
             }
@@ -3704,9 +5078,16 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         // Start block sync
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            pto->PushGetBlocks(pindexBest, uint256(0));
+            if (fHeadersFirst)
+                PushGetHeaders(pto);
+            else
+                pto->PushGetBlocks(pindexBest, uint256(0));
         }
 
+        // Headers-first sync: download blocks of the header chain
+        if (fHeadersFirst && !fImporting && !fReindex)
+            SendSyncGetData(pto);
+
         // Resend wallet transactions that haven't gotten in a block yet
         // Except during reindex, importing and IBD, when old wallet
         // transactions become unconfirmed and spams other nodes.
@@ -18,6 +18,7 @@
 
 class CWallet;
 class CBlock;
+class CBlockHeader;
 class CBlockIndex;
 class CKeyItem;
 class CReserveKey;
@@ -64,6 +65,22 @@ static const int COINBASE_MATURITY = 3000;
 static const unsigned int LOCKTIME_THRESHOLD = 500000000; // Tue Nov  5 00:53:20 1985 UTC
 /** Maximum number of script-checking threads allowed */
 static const int MAX_SCRIPTCHECK_THREADS = 16;
+/** Maximum number of threads reading coins ahead of ConnectBlock */
+static const int MAX_COINS_PREFETCH_THREADS = 16;
+/** The maximum number of headers in a 'headers' protocol message */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Headers-first sync: most headers kept ahead of the best block */
+static const unsigned int SYNC_HEADERS_MAX = 50000;
+/** Headers-first sync: most headers kept while looking for the -assumevalid block (about 160 MB) */
+static const unsigned int SYNC_HEADERS_ASSUMEVALID_MAX = 4000000;
+/** Headers-first sync: blocks past the best block that may be requested */
+static const unsigned int SYNC_BLOCK_WINDOW = 512;
+/** Headers-first sync: blocks requested from one peer at a time */
+static const unsigned int SYNC_BLOCKS_PER_PEER = 16;
+/** Headers-first sync: seconds before a requested block is asked from another peer */
+static const int64 SYNC_BLOCK_TIMEOUT = 30;
+/** Headers-first sync: seconds without a block of the header chain coming in before falling back to getblocks */
+static const int64 SYNC_HEADERS_STALL_TIMEOUT = 120;
 
 static const uint256 hashGenesisBlockOfficial("0x963d17ba4dc753138078a2f56afb3af9674e2546822badff26837db9a0152106");
 static const uint256 hashGenesisBlockTestNet("0x221156cf301bc3585e72de34fe1efdb6fbd703bc27cfc468faa1cdd889d0efa0");
@@ -74,6 +91,7 @@ extern CCriticalSection cs_main;
 extern std::map<uint256, CBlockIndex*> mapBlockIndex;
 extern std::set<CBlockIndex*, CBlockIndexWorkComparator> setBlockIndexValid;
 extern uint256 hashGenesisBlock;
+extern uint256 hashAssumeValid;
 extern CBlockIndex* pindexGenesisBlock;
 extern int nBestHeight;
 extern uint256 nBestChainWork;
@@ -95,7 +113,10 @@ extern unsigned char pchMessageStart[4];
 extern bool fImporting;
 extern bool fReindex;
 extern bool fBenchmark;
+extern bool fHeadersFirst;
+extern bool fParallelInputsCheck;
 extern int nScriptCheckThreads;
+extern int nCoinsPrefetchThreads;
 extern bool fTxIndex;
 extern unsigned int nCoinCacheSize;
 
@@ -116,6 +137,7 @@ class CCoinsView;
 class CCoinsViewCache;
 class CScriptCheck;
 class CValidationState;
+template <typename T> class CCheckQueueControl;
 
 struct CBlockTemplate;
 
@@ -126,7 +148,7 @@ void UnregisterWallet(CWallet* pwalletIn);
 /** Push an updated transaction to all registered wallets */
 void SyncWithWallets(const uint256 &hash, const CTransaction& tx, const CBlock* pblock = NULL, bool fUpdate = false);
 /** Process an incoming block */
-bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL);
+bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp = NULL, bool fChecked = false);
 /** Check whether enough disk space is available for an incoming block */
 bool CheckDiskSpace(uint64 nAdditionalBytes = 0);
 /** Open a block file (blk?????.dat) */
@@ -135,6 +157,8 @@ FILE* OpenBlockFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 FILE* OpenUndoFile(const CDiskBlockPos &pos, bool fReadOnly = false);
 /** Import blocks from an external file */
 bool LoadExternalBlockFile(FILE* fileIn, CDiskBlockPos *dbp = NULL);
+/** Find the -assumevalid block and its ancestors in the block files, before a -reindex connects them */
+void FindReindexAssumeValidChain();
 /** Initialize a new block tree database + block data on disk */
 bool InitBlockIndex();
 /** Load the block tree and coins database from disk */
@@ -143,18 +167,38 @@ bool LoadBlockIndex();
 void UnloadBlockIndex();
 /** Verify consistency of the block and coin databases */
 bool VerifyDB();
+/** Verify the proof-of-work of all block index entries, without reading block files */
+bool VerifyBlockIndexProofOfWork();
 /** Find a block by height in the currently-connected chain */
 CBlockIndex* FindBlockByHeight(int nHeight);
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
+/** Forget the sync state of a node before it is deleted (requires cs_main) */
+void FinalizeNode(CNode* pnode);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the proof-of-work checking thread */
+void ThreadPowCheck();
+/** Check the proof-of-work of blocks in parallel ahead of ProcessBlock, which then finds it verified */
+void PreCheckProofOfWork(const std::vector<const CBlock*>& vpblock);
+/** Run an instance of the transaction input checking thread */
+void ThreadInputsCheck();
+/** Run an instance of the coins prefetch thread */
+void ThreadCoinsPrefetch();
+/** Read the coins blocks spend from the coin database in parallel into pcoinsTip, with or without cs_main */
+void PrefetchCoins(const std::vector<const CBlock*>& vpblock);
+/** Run the check stage of the block message pipeline */
+void ThreadBlockCheck();
+/** Run the connect stage of the block message pipeline */
+void ThreadBlockConnect();
 /** Do mining precalculation */
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
-/** Check mined block */
-bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+/** Get the block reward (mint plus fees) for a block with target nBits */
+int64 GetBlockValue(int nBits, int64 nFees);
+/** Get the target required for the block following pindexLast */
+unsigned int GetNextWorkRequired(const CBlockIndex* pindexLast, const CBlockHeader *pblock);
 /** Check whether a block hash satisfies the proof-of-work requirement specified by nBits */
 bool CheckProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength);
 /** Calculate the minimum amount of work a received block needs, without knowing its direct parent */
@@ -447,6 +491,20 @@ public:
     }
 };
 
+/** An output spent by a transaction input, with the data of its transaction
+ *  the input checks need, as it was before the spend
+ */
+class CSpentOutput
+{
+public:
+    CTxOut txout;
+    bool fCoinBase;
+    int nHeight;
+
+    CSpentOutput() : txout(), fCoinBase(false), nHeight(0) {}
+    CSpentOutput(const CTxOut &txoutIn, bool fCoinBaseIn, int nHeightIn) : txout(txoutIn), fCoinBase(fCoinBaseIn), nHeight(nHeightIn) {}
+};
+
 
 
 enum GetMinFee_mode
@@ -581,6 +639,13 @@ public:
      */
     unsigned int GetP2SHSigOpCount(CCoinsViewCache& mapInputs) const;
 
+    /** Count ECDSA signature operations in pay-to-script-hash inputs.
+
+        @param[in] vSpent	Outputs spent by the inputs, from GetSpentOutputs()
+        @return maximum number of sigops required to validate this transaction's inputs
+     */
+    unsigned int GetP2SHSigOpCount(const std::vector<CSpentOutput>& vSpent) const;
+
     /** Amount of primecoins spent by this transaction.
         @return sum of all outputs (note: does not include fees)
      */
@@ -604,6 +669,7 @@ public:
         @return	Sum of value of all inputs (scriptSigs)
      */
     int64 GetValueIn(CCoinsViewCache& mapInputs) const;
+    int64 GetValueIn(const std::vector<CSpentOutput>& vSpent) const;
 
     static bool AllowFree(double dPriority)
     {
@@ -656,13 +722,27 @@ public:
     // Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
     // This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
     // instead of being performed inline.
+    // Without fScriptChecks, scripts and signatures are assumed valid and not checked.
     bool CheckInputs(
         CValidationState &state,
         CCoinsViewCache &view,
         unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_STRICTENC,
-        std::vector<CScriptCheck> *pvChecks = NULL
+        std::vector<CScriptCheck> *pvChecks = NULL,
+        bool fScriptChecks = true
     ) const;
 
+    // Copy the outputs spent by the inputs of this transaction from view, which must have them (see HaveInputs),
+    // for the parallel input checks of ConnectInputs, which run after the outputs are spent in view
+    void GetSpentOutputs(CCoinsViewCache &view, std::vector<CSpentOutput> &vSpent) const;
+
+    // The checks of CheckInputs on copies of the outputs spent, from GetSpentOutputs(), at height nSpendHeight:
+    // amounts, coinbase maturity and fee
+    bool CheckInputValues(CValidationState &state, const std::vector<CSpentOutput> &vSpent, int nSpendHeight) const;
+
+    // The script checks of CheckInputs on copies of the outputs spent, from GetSpentOutputs(). If pvChecks is
+    // not NULL, script checks are pushed onto it instead of being performed inline.
+    bool CheckInputScripts(CValidationState &state, const std::vector<CSpentOutput> &vSpent, unsigned int flags, std::vector<CScriptCheck> *pvChecks = NULL) const;
+
     // Apply the effects of this transaction on the UTXO set represented by view
     void UpdateCoins(CValidationState &state, CCoinsViewCache &view, CTxUndo &txundo, int nHeight, const uint256 &txhash) const;
 
@@ -1092,6 +1172,9 @@ public:
     CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
+    CScriptCheck(const CTxOut& txoutFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, int nHashTypeIn) :
+        scriptPubKey(txoutFromIn.scriptPubKey),
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), nHashType(nHashTypeIn) { }
 
     bool operator()() const;
 
@@ -1517,8 +1600,18 @@ public:
      *  of problems. Note that in any case, coins may be modified. */
     bool DisconnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool *pfClean = NULL);
 
-    // Apply the effects of this block (with given index) on the UTXO set represented by coins
-    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false);
+    // Check the inputs of the transactions of this block and spend them in view, adding their undo
+    // data to blockundo and their sigops, input and output values and fees to the totals. With
+    // fParallelInputs (-parallelinputs), the checks that need no coins view run on the input check
+    // threads, on copies of the outputs spent. Script checks are added to pcontrol, or run inline if
+    // it is NULL.
+    bool ConnectInputs(CValidationState &state, int nHeight, CCoinsViewCache &view, unsigned int flags, bool fScriptChecks, bool fParallelInputs,
+                       CCheckQueueControl<CScriptCheck> *pcontrol, CBlockUndo &blockundo,
+                       unsigned int &nSigOps, int64 &nValueIn, int64 &nValueOut, int64 &nFees) const;
+
+    // Apply the effects of this block (with given index) on the UTXO set represented by coins.
+    // The scripts of -assumevalid history are only checked with fJustCheck or fCheckAllScripts.
+    bool ConnectBlock(CValidationState &state, CBlockIndex *pindex, CCoinsViewCache &coins, bool fJustCheck=false, bool fCheckAllScripts=false);
 
     // Read a block from disk
     bool ReadFromDisk(const CBlockIndex* pindex);
@@ -1651,6 +1744,7 @@ public:
     unsigned int nPrimeChainType;   // primecoin: chain type
     unsigned int nPrimeChainLength; // primecoin: chain length
     int64 nMoneySupply;             // primecoin: money supply
+    CBigNum bnPrimeChainMultiplier; // primecoin: proof-of-work certificate, 0 if unknown
 
     // Number of transactions in this block.
     // Note: in a potential headers-first mode, this number cannot be relied upon
@@ -1684,6 +1778,7 @@ public:
         nPrimeChainType = 0;
         nPrimeChainLength = 0;
         nMoneySupply = 0;
+        bnPrimeChainMultiplier = 0;
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
@@ -1709,6 +1804,7 @@ public:
         nPrimeChainType = 0;
         nPrimeChainLength = 0;
         nMoneySupply = 0;
+        bnPrimeChainMultiplier = block.bnPrimeChainMultiplier;
         nTx = 0;
         nChainTx = 0;
         nStatus = 0;
@@ -1748,6 +1844,7 @@ public:
         block.nTime          = nTime;
         block.nBits          = nBits;
         block.nNonce         = nNonce;
+        block.bnPrimeChainMultiplier = bnPrimeChainMultiplier;
         return block;
     }
 
@@ -1882,6 +1979,11 @@ public:
         READWRITE(nBits);
         READWRITE(nNonce);
         READWRITE(hashBlock);
+
+        // primecoin: prime chain multiplier, absent from records written
+        // by older clients
+        if (nVersion >= BLOCK_INDEX_MULTIPLIER_VERSION)
+            READWRITE(bnPrimeChainMultiplier);
     )
 
     uint256 GetBlockHash() const
@@ -2012,6 +2114,12 @@ public:
         return vHave.empty();
     }
 
+    // Put a block the index does not have yet in front of the locator
+    void PushFront(uint256 hashBlock)
+    {
+        vHave.insert(vHave.begin(), hashBlock);
+    }
+
     void Set(const CBlockIndex* pindex)
     {
         vHave.clear();
@@ -2199,6 +2307,7 @@ class CCoinsViewCache : public CCoinsViewBacked
 protected:
     CBlockIndex *pindexTip;
     std::map<uint256,CCoins> cacheCoins;
+    volatile unsigned int nFlushes;
 
 public:
     CCoinsViewCache(CCoinsView &baseIn, bool fDummy = false);
@@ -2223,6 +2332,17 @@ public:
     // Calculate the size of the cache (in number of transactions)
     unsigned int GetCacheSize();
 
+    // Number of flushes so far; the base only changes with a flush
+    unsigned int GetFlushes() { return nFlushes; }
+
+    // Whether the cache holds the coins of txid, without fetching them
+    bool HaveCachedCoins(const uint256 &txid);
+
+    // Add coins read from the base ahead of their use. Coins already in the
+    // cache are newer and stay; if the cache was flushed since nFlushesRead,
+    // the base may have changed under the reads and nothing is added.
+    void AddPrefetchedCoins(std::map<uint256,CCoins> &mapCoins, unsigned int nFlushesRead);
+
 private:
     std::map<uint256,CCoins>::iterator FetchCoins(const uint256 &txid);
 };
@@ -2243,6 +2363,9 @@ public:
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the coin database under pcoinsTip (reads are thread-safe) */
+extern CCoinsView *pcoinsdbview;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
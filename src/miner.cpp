@@ -0,0 +1,813 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013 Primecoin developers
+// See COPYING for license.
+
+#include <algorithm>
+#include <list>
+
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/tuple/tuple.hpp>
+
+#include "fermat.h"
+#include "miner.h"
+#include "miningstats.h"
+#include "prime.h"
+#include "wallet.h"
+#include "workqueue.h"
+
+
+//////////////////////////////////////////////////////////////////////////////
+//
+// PrimecoinMiner
+//
+
+// Memory pool transaction waiting for the transactions it spends
+class COrphan
+{
+public:
+    CTransaction* ptx;
+    std::set<uint256> setDependsOn;
+    double dPriority;
+    double dFeePerKb;
+
+    COrphan(CTransaction* ptxIn)
+    {
+        ptx = ptxIn;
+        dPriority = dFeePerKb = 0;
+    }
+
+    void print() const
+    {
+        printf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
+               ptx->GetHash().ToString().c_str(), dPriority, dFeePerKb);
+        BOOST_FOREACH(uint256 hash, setDependsOn)
+            printf("   setDependsOn %s\n", hash.ToString().c_str());
+    }
+};
+
+// We want to sort transactions by priority and fee, so:
+typedef boost::tuple<double, double, CTransaction*> TxPriority;
+class TxPriorityCompare
+{
+    bool byFee;
+public:
+    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    bool operator()(const TxPriority& a, const TxPriority& b)
+    {
+        if (byFee)
+        {
+            if (a.get<1>() == b.get<1>())
+                return a.get<0>() < b.get<0>();
+            return a.get<1>() < b.get<1>();
+        }
+        else
+        {
+            if (a.get<0>() == b.get<0>())
+                return a.get<1>() < b.get<1>();
+            return a.get<0>() < b.get<0>();
+        }
+    }
+};
+
+CBlockTemplateBuilder::CBlockTemplateBuilder(CReserveKey& reservekeyIn) :
+    reservekey(reservekeyIn), pindexPrev(NULL), nTransactionsUpdatedLast(0),
+    nBlockSize(0), nBlockSigOps(0), nFees(0), nLastFailureLog(0)
+{
+    // Largest block you're willing to create:
+    nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    nBlockMinSize = GetArg("-blockminsize", 0);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+}
+
+bool CBlockTemplateBuilder::Fail(const char* pszReason)
+{
+    int64 nNow = GetTime();
+    if (nNow - nLastFailureLog >= 60)
+    {
+        nLastFailureLog = nNow;
+        printf("CBlockTemplateBuilder : %s\n", pszReason);
+    }
+    return false;
+}
+
+bool CBlockTemplateBuilder::Update()
+{
+    CPubKey pubkey;
+    if (!reservekey.GetReservedKey(pubkey))
+        return Fail("keypool ran out, please call keypoolrefill");
+
+    LOCK2(cs_main, mempool.cs);
+    if (pindexBest == NULL)
+        return false;
+    if (pindexPrev != pindexBest)
+        return Rebuild(pubkey);
+
+    CBlock& block = blocktemplate.block;
+    block.UpdateTime(pindexPrev);
+    if (nTransactionsUpdatedLast == nTransactionsUpdated)
+        return true;
+    nTransactionsUpdatedLast = nTransactionsUpdated;
+
+    // A transaction left the memory pool without a new block (conflict),
+    // anything after it in the template may depend on it
+    BOOST_FOREACH(const uint256& hash, setTxIncluded)
+        if (!mempool.exists(hash))
+            return Rebuild(pubkey);
+
+    std::vector<CTransaction*> vtxCandidates;
+    for (std::map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        if (!setTxIncluded.count(mi->first))
+            vtxCandidates.push_back(&mi->second);
+    unsigned int nTxBefore = block.vtx.size();
+    AddTransactions(vtxCandidates);
+    if (block.vtx.size() != nTxBefore)
+        UpdateCoinbase();
+    if (fDebug && GetBoolArg("-printpriority"))
+        printf("CBlockTemplateBuilder::Update() : added %u of %"PRIszu" new transactions\n", (unsigned int)(block.vtx.size() - nTxBefore), vtxCandidates.size());
+    return true;
+}
+
+bool CBlockTemplateBuilder::Rebuild(const CPubKey& pubkey)
+{
+    pindexPrev = NULL;
+    CBlock& block = blocktemplate.block;
+    block.SetNull();
+    blocktemplate.vTxFees.clear();
+    blocktemplate.vTxSigOps.clear();
+
+    // Create coinbase tx
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vin[0].scriptSig = CScript() << OP_0 << OP_0;
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey << pubkey << OP_CHECKSIG;
+
+    // Add our coinbase tx as first transaction
+    block.vtx.push_back(txNew);
+    blocktemplate.vTxFees.push_back(-1); // updated at end
+    blocktemplate.vTxSigOps.push_back(-1); // updated at end
+
+    // Fill in header
+    CBlockIndex* pindexTip = pindexBest;
+    block.hashPrevBlock = pindexTip->GetBlockHash();
+    block.UpdateTime(pindexTip);
+    block.nBits         = GetNextWorkRequired(pindexTip, &block);
+    block.nNonce        = 0;
+
+    // Collect memory pool transactions into the block
+    pview.reset(new CCoinsViewCache(*pcoinsTip, true));
+    setTxIncluded.clear();
+    nBlockSize = 1000;
+    nBlockSigOps = 100;
+    nFees = 0;
+    pindexPrev = pindexTip;
+    nTransactionsUpdatedLast = nTransactionsUpdated;
+
+    std::vector<CTransaction*> vtxCandidates;
+    for (std::map<uint256, CTransaction>::iterator mi = mempool.mapTx.begin(); mi != mempool.mapTx.end(); ++mi)
+        vtxCandidates.push_back(&mi->second);
+    AddTransactions(vtxCandidates);
+    UpdateCoinbase();
+
+    CBlockIndex indexDummy(block);
+    indexDummy.pprev = pindexPrev;
+    indexDummy.nHeight = pindexPrev->nHeight + 1;
+    CCoinsViewCache viewNew(*pcoinsTip, true);
+    CValidationState state;
+    if (!block.ConnectBlock(state, &indexDummy, viewNew, true))
+    {
+        pindexPrev = NULL;
+        return Fail("Rebuild() : ConnectBlock failed");
+    }
+    printf("CBlockTemplateBuilder::Rebuild() : total size %"PRI64u"\n", nBlockSize);
+    return true;
+}
+
+// Append the transactions that fit, by priority first and then by fee
+void CBlockTemplateBuilder::AddTransactions(const std::vector<CTransaction*>& vtxCandidates)
+{
+    CBlock& block = blocktemplate.block;
+    CCoinsViewCache& view = *pview;
+    bool fPrintPriority = GetBoolArg("-printpriority");
+
+    // Priority order to process transactions
+    std::list<COrphan> vOrphan; // list memory doesn't move
+    std::map<uint256, std::vector<COrphan*> > mapDependers;
+
+    // This vector will be sorted into a priority queue:
+    std::vector<TxPriority> vecPriority;
+    vecPriority.reserve(vtxCandidates.size());
+    BOOST_FOREACH(CTransaction* ptx, vtxCandidates)
+    {
+        CTransaction& tx = *ptx;
+        if (tx.IsCoinBase() || !tx.IsFinal())
+            continue;
+
+        COrphan* porphan = NULL;
+        double dPriority = 0;
+        int64 nTotalIn = 0;
+        bool fMissingInputs = false;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        {
+            // Read prev transaction
+            if (!view.HaveCoins(txin.prevout.hash))
+            {
+                // This should never happen; all transactions in the memory
+                // pool should connect to either transactions in the chain
+                // or other transactions in the memory pool.
+                if (!mempool.mapTx.count(txin.prevout.hash))
+                {
+                    printf("ERROR: mempool transaction missing input\n");
+                    if (fDebug) assert("mempool transaction missing input" == 0);
+                    fMissingInputs = true;
+                    if (porphan)
+                        vOrphan.pop_back();
+                    break;
+                }
+
+                // Has to wait for dependencies
+                if (!porphan)
+                {
+                    // Use list for automatic deletion
+                    vOrphan.push_back(COrphan(&tx));
+                    porphan = &vOrphan.back();
+                }
+                mapDependers[txin.prevout.hash].push_back(porphan);
+                porphan->setDependsOn.insert(txin.prevout.hash);
+                nTotalIn += mempool.mapTx[txin.prevout.hash].vout[txin.prevout.n].nValue;
+                continue;
+            }
+            const CCoins &coins = view.GetCoins(txin.prevout.hash);
+
+            int64 nValueIn = coins.vout[txin.prevout.n].nValue;
+            nTotalIn += nValueIn;
+
+            int nConf = pindexPrev->nHeight - coins.nHeight + 1;
+
+            dPriority += (double)nValueIn * nConf;
+        }
+        if (fMissingInputs) continue;
+
+        // Priority is sum(valuein * age) / txsize
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        dPriority /= nTxSize;
+
+        // This is a more accurate fee-per-kilobyte than is used by the client code, because the
+        // client code rounds up the size to the nearest 1K. That's good, because it gives an
+        // incentive to create smaller transactions.
+        double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
+
+        if (porphan)
+        {
+            porphan->dPriority = dPriority;
+            porphan->dFeePerKb = dFeePerKb;
+        }
+        else
+            vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &tx));
+    }
+
+    // Collect transactions into block
+    uint64 nBlockTx = 0;
+    bool fSortedByFee = (nBlockPrioritySize <= 0);
+
+    TxPriorityCompare comparer(fSortedByFee);
+    std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+
+    while (!vecPriority.empty())
+    {
+        // Take highest priority transaction off the priority queue:
+        double dPriority = vecPriority.front().get<0>();
+        double dFeePerKb = vecPriority.front().get<1>();
+        CTransaction& tx = *(vecPriority.front().get<2>());
+
+        std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        vecPriority.pop_back();
+
+        // Size limits
+        unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+        if (nBlockSize + nTxSize >= nBlockMaxSize)
+            continue;
+
+        // Legacy limits on sigOps:
+        unsigned int nTxSigOps = tx.GetLegacySigOpCount();
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        // Skip free transactions if we're past the minimum block size:
+        if (fSortedByFee && (dFeePerKb < CTransaction::nMinTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            continue;
+
+        // Prioritize by fee once past the priority size or we run out of high-priority
+        // transactions:
+        if (!fSortedByFee &&
+            ((nBlockSize + nTxSize >= nBlockPrioritySize) || !CTransaction::AllowFree(dPriority)))
+        {
+            fSortedByFee = true;
+            comparer = TxPriorityCompare(fSortedByFee);
+            std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        }
+
+        if (!tx.HaveInputs(view))
+            continue;
+
+        int64 nTxFees = tx.GetValueIn(view)-tx.GetValueOut();
+
+        nTxSigOps += tx.GetP2SHSigOpCount(view);
+        if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+            continue;
+
+        CValidationState state;
+        if (!tx.CheckInputs(state, view, SCRIPT_VERIFY_P2SH))
+            continue;
+
+        CTxUndo txundo;
+        uint256 hash = tx.GetHash();
+        tx.UpdateCoins(state, view, txundo, pindexPrev->nHeight+1, hash);
+
+        // Added
+        block.vtx.push_back(tx);
+        blocktemplate.vTxFees.push_back(nTxFees);
+        blocktemplate.vTxSigOps.push_back(nTxSigOps);
+        setTxIncluded.insert(hash);
+        nBlockSize += nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += nTxSigOps;
+        nFees += nTxFees;
+
+        if (fPrintPriority)
+        {
+            printf("priority %.1f feeperkb %.1f txid %s\n",
+                   dPriority, dFeePerKb, tx.GetHash().ToString().c_str());
+        }
+
+        // Add transactions that depend on this one to the priority queue
+        if (mapDependers.count(hash))
+        {
+            BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+            {
+                if (!porphan->setDependsOn.empty())
+                {
+                    porphan->setDependsOn.erase(hash);
+                    if (porphan->setDependsOn.empty())
+                    {
+                        vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
+                        std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                    }
+                }
+            }
+        }
+    }
+
+    nLastBlockTx = block.vtx.size() - 1;
+    nLastBlockSize = nBlockSize;
+}
+
+// Pay the block value and the collected fees to the coinbase
+void CBlockTemplateBuilder::UpdateCoinbase()
+{
+    CBlock& block = blocktemplate.block;
+    block.vtx[0].vout[0].nValue = GetBlockValue(block.nBits, nFees);
+    blocktemplate.vTxFees[0] = -nFees;
+    blocktemplate.vTxSigOps[0] = block.vtx[0].GetLegacySigOpCount();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+}
+
+CBlockTemplate* CreateNewBlock(CReserveKey& reservekey)
+{
+    CBlockTemplateBuilder builder(reservekey);
+    if (!builder.Update())
+        return NULL;
+    return new CBlockTemplate(builder.GetTemplate());
+}
+
+void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce)
+{
+    // Update nExtraNonce
+    static uint256 hashPrevBlock;
+    if (hashPrevBlock != pblock->hashPrevBlock)
+    {
+        nExtraNonce = 0;
+        hashPrevBlock = pblock->hashPrevBlock;
+    }
+    ++nExtraNonce;
+    unsigned int nHeight = pindexPrev->nHeight+1; // Height first in coinbase required for block.version=2
+    pblock->vtx[0].vin[0].scriptSig = (CScript() << nHeight << CBigNum(nExtraNonce)) + COINBASE_FLAGS;
+    assert(pblock->vtx[0].vin[0].scriptSig.size() <= 100);
+
+    pblock->hashMerkleRoot = pblock->BuildMerkleTree();
+}
+
+bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
+{
+    uint256 hashBlockHeader = pblock->GetHeaderHash();
+    uint256 hash = pblock->GetHash();
+
+    if (!CheckProofOfWork(hashBlockHeader, pblock->nBits, pblock->bnPrimeChainMultiplier, pblock->nPrimeChainType, pblock->nPrimeChainLength))
+        return error("PrimecoinMiner : failed proof-of-work check");
+
+    //// debug print
+    printf("PrimecoinMiner:\n");
+    printf("proof-of-work found  \n  block-hash: %s\n  target: %s\n  chain: %s\n", hash.GetHex().c_str(), TargetToString(pblock->nBits).c_str(), GetPrimeChainName(pblock->nPrimeChainType, pblock->nPrimeChainLength).c_str());
+    pblock->print();
+    printf("generated %s\n", FormatMoney(pblock->vtx[0].vout[0].nValue).c_str());
+
+    // Found a solution
+    {
+        LOCK(cs_main);
+        if (pblock->hashPrevBlock != hashBestChain)
+            return error("PrimecoinMiner : generated block is stale");
+
+        // Remove key from key pool
+        reservekey.KeepKey();
+
+        // Track how many getdata requests this block gets
+        {
+            LOCK(wallet.cs_wallet);
+            wallet.mapRequestCount[pblock->GetHash()] = 0;
+        }
+
+        // Process this block the same as if we had received it from another node
+        CValidationState state;
+        if (!ProcessBlock(state, NULL, pblock))
+            return error("PrimecoinMiner : ProcessBlock, block not accepted");
+    }
+
+    return true;
+}
+
+// Primorial factor the header hash is made divisible by
+static const unsigned int nPrimorialHashFactor = 7;
+// Number of sieve candidates handed out per chain test job, a multiple of
+// the Fermat test batch size
+static const unsigned int nCandidatesPerJob = 4 * nFermatBatchSize;
+
+/** A sieve round: a block header with a fixed hash mined with one fixed multiplier */
+struct CMiningRound
+{
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    unsigned int nGeneration; // miner pool generation the round belongs to
+    unsigned int nSieveSetting; // tuner setting the round is sieved with
+    CBigNum bnFixedMultiplier;
+    CBigNum bnFixedFactor; // header hash * fixed multiplier
+};
+
+/** A batch of sieve candidates of one round waiting for chain tests */
+class CPrimeTestJob
+{
+public:
+    boost::shared_ptr<CMiningRound> pround;
+    std::vector<std::pair<unsigned int, unsigned int> > vCandidates; // (variable multiplier, candidate type)
+
+    void swap(CPrimeTestJob &job)
+    {
+        pround.swap(job.pround);
+        vCandidates.swap(job.vCandidates);
+    }
+};
+
+/** Pool of prime chain miner threads
+  *
+  * All threads mine on one block template, brought up to date by each thread
+  * starting a new round. Each thread builds its own sieves and queues
+  * the sieve candidates as chain test jobs on its deque of a work-stealing
+  * queue. A thread whose deque runs dry takes over jobs from busy threads
+  * before starting a new sieve, so no core sits idle while candidates of a
+  * current round are still waiting to be tested.
+  *
+  * Sieving is pipelined with the chain tests: a thread builds the sieve of
+  * its next round once only a few jobs of its current sieve are left on its
+  * deque (-gensieveahead), rather than after the last one. Threads running
+  * dry meanwhile take those last jobs, and the new sieve is ready when the
+  * current one is drained. The threads thereby drift apart, so they do not
+  * all wait on the block template at once when a round ends together.
+  */
+class CPrimeMinerPool
+{
+private:
+    CWallet* pwallet;
+    CWorkStealingQueue<CPrimeTestJob> workqueue;
+    CSieveTuner tuner;
+    // Jobs left on a thread's own deque when it sieves its next round
+    unsigned int nSieveAheadJobs;
+    // Chain statistics ask for the full length of chains short of the target
+    bool fFullChainLengths;
+
+    // Shared block template
+    CCriticalSection cs;
+    CReserveKey reservekey;
+    CBlockTemplateBuilder templatebuilder;
+    unsigned int nExtraNonce;
+    // Bumped whenever a block is found, making all rounds before it stale
+    volatile unsigned int nGeneration;
+
+    bool GetWork(CMiningRound& round);
+    boost::shared_ptr<CMiningRound> NewRound();
+    void SieveRound(unsigned int nWorker, const boost::shared_ptr<CMiningRound>& pround);
+    bool SieveNewRound(unsigned int nWorker);
+    void TestCandidates(CPrimeTestJob& job);
+    void SubmitBlock(CBlock& block);
+
+    bool IsStale(const CMiningRound& round) const
+    {
+        return (round.pindexPrev != pindexBest || round.nGeneration != nGeneration);
+    }
+
+public:
+    CPrimeMinerPool(CWallet* pwalletIn, unsigned int nThreads) :
+        pwallet(pwalletIn), workqueue(nThreads), tuner(GetBoolArg("-gensievetune", true)),
+        nSieveAheadJobs((unsigned int)std::max(0, (int)GetArg("-gensieveahead", 1))),
+        fFullChainLengths(GetBoolArg("-genfulllengths", false)), reservekey(pwalletIn),
+        templatebuilder(reservekey), nExtraNonce(0), nGeneration(0) {}
+
+    void ThreadWorker(unsigned int nWorker);
+};
+
+// Copy the current block template for a new round, after bringing it up to
+// date with the chain tip and the memory pool
+bool CPrimeMinerPool::GetWork(CMiningRound& round)
+{
+    LOCK(cs);
+    if (!templatebuilder.Update())
+        return false;
+    round.block = templatebuilder.GetTemplate().block;
+    round.pindexPrev = templatebuilder.GetPrevIndex();
+    round.nGeneration = nGeneration;
+    IncrementExtraNonce(&round.block, round.pindexPrev, nExtraNonce);
+    return true;
+}
+
+// Remainder of a hash divided by a small number
+static unsigned int HashMod(const uint256& hash, unsigned int nDivisor)
+{
+    uint64 nRemainder = 0;
+    for (unsigned int i = hash.size(); i-- > 0; )
+        nRemainder = ((nRemainder << 8) | hash.begin()[i]) % nDivisor;
+    return (unsigned int)nRemainder;
+}
+
+// Search the nonces of a block from its current one on for a header hash
+// above the limit and divisible by nHashFactor, and with fV02Compatible
+// also probable prime as v0.2 clients require. Hashes from the midstate
+// and filters on the hash before any bignum work is done.
+static bool ScanHeaderNonce(CBlock& block, unsigned int nHashFactor, bool fV02Compatible, uint256& hashBlockHeader)
+{
+    assert(END(block.nNonce) - BEGIN(block.nVersion) == 80);
+    CHeaderHasher hasher(BEGIN(block.nVersion));
+    for (unsigned int nNonce = block.nNonce; nNonce < 0xffff0000; nNonce++)
+    {
+        uint256 hash = hasher.GetHash(nNonce);
+        if (hash < hashBlockHeaderLimit)
+            continue;
+        if (nHashFactor > 1 && HashMod(hash, nHashFactor) != 0)
+            continue;
+        if (fV02Compatible && (!(hash.begin()[0] & 1) || !CheckPrimeProofOfWorkV02Compatibility(hash)))
+            continue;
+        block.nNonce = nNonce;
+        hashBlockHeader = hash;
+        return true;
+    }
+    return false;
+}
+
+// Start a new round: search a nonce for a header hash above the limit and
+// divisible by the hash primorial, then derive the fixed multiplier
+boost::shared_ptr<CMiningRound> CPrimeMinerPool::NewRound()
+{
+    boost::shared_ptr<CMiningRound> pround(new CMiningRound());
+    if (!GetWork(*pround))
+        return boost::shared_ptr<CMiningRound>();
+    CBlock& block = pround->block;
+
+    // A v0.2 compatible header hash is prime, so the fixed multiplier
+    // has to carry the whole primorial
+    bool fV02Compatible = GetBoolArg("-v2compatible", false);
+    CBigNum bnHashFactor = 1;
+    if (!fV02Compatible)
+        Primorial(nPrimorialHashFactor, bnHashFactor);
+    uint256 hashBlockHeader;
+    if (!ScanHeaderNonce(block, bnHashFactor.getuint(), fV02Compatible, hashBlockHeader))
+        return boost::shared_ptr<CMiningRound>(); // nonce space exhausted, get new work
+
+    CSieveSetting setting;
+    pround->nSieveSetting = tuner.GetSetting(block.nBits, setting);
+    pminer->SetSieveSetting(pround->nSieveSetting, setting);
+    CBigNum bnPrimorial;
+    Primorial(pminer->nPrimorialMultiplier, bnPrimorial);
+    pround->bnFixedMultiplier = (bnPrimorial > bnHashFactor)? (bnPrimorial / bnHashFactor) : 1;
+    pround->bnFixedFactor = CBigNum(hashBlockHeader) * pround->bnFixedMultiplier;
+    return pround;
+}
+
+// Build the sieve for a round and queue its candidates on the worker's deque
+void CPrimeMinerPool::SieveRound(unsigned int nWorker, const boost::shared_ptr<CMiningRound>& pround)
+{
+    int64 nStart = GetTimeMicros();
+    boost::scoped_ptr<CSieveOfEratosthenes> psieveRound(MineBuildSieve(pround->block, pround->bnFixedMultiplier));
+    // Candidates by how far past the target their chains could go
+    unsigned int nChainLength = TargetGetLength(pround->block.nBits);
+    std::vector<std::vector<std::pair<unsigned int, unsigned int> > > vCandidatesByLength(1);
+    unsigned int nTriedMultiplier, nCandidateType;
+    while (psieveRound->GetNextCandidateMultiplier(nTriedMultiplier, nCandidateType))
+    {
+        unsigned int nExtension = psieveRound->GetCandidateMaxLength(nTriedMultiplier, nCandidateType) - nChainLength;
+        if (nExtension >= vCandidatesByLength.size())
+            vCandidatesByLength.resize(nExtension + 1);
+        vCandidatesByLength[nExtension].push_back(std::make_pair(nTriedMultiplier, nCandidateType));
+    }
+    // Most promising candidates first, each group in sieve order
+    std::vector<CPrimeTestJob> vJobs;
+    CPrimeTestJob job;
+    for (unsigned int nExtension = vCandidatesByLength.size(); nExtension-- > 0; )
+    {
+        for (unsigned int i = 0; i < vCandidatesByLength[nExtension].size(); i++)
+        {
+            job.vCandidates.push_back(vCandidatesByLength[nExtension][i]);
+            if (job.vCandidates.size() >= nCandidatesPerJob)
+            {
+                job.pround = pround;
+                vJobs.push_back(CPrimeTestJob());
+                vJobs.back().swap(job);
+            }
+        }
+    }
+    if (!job.vCandidates.empty())
+    {
+        job.pround = pround;
+        vJobs.push_back(CPrimeTestJob());
+        vJobs.back().swap(job);
+    }
+    // The owner pops from the back, so queue in reverse to test in this order
+    std::reverse(vJobs.begin(), vJobs.end());
+    workqueue.Push(nWorker, vJobs);
+    tuner.AddResults(pround->block.nBits, pround->nSieveSetting, GetTimeMicros() - nStart, std::vector<unsigned int>());
+}
+
+// Start a new round and queue its candidates, unless there is no work yet
+bool CPrimeMinerPool::SieveNewRound(unsigned int nWorker)
+{
+    if (vNodes.empty() && !fTestNet)
+        return false; // don't waste time mining on an obsolete chain
+    boost::shared_ptr<CMiningRound> pround = NewRound();
+    if (!pround)
+        return false;
+    SieveRound(nWorker, pround);
+    return true;
+}
+
+void CPrimeMinerPool::TestCandidates(CPrimeTestJob& job)
+{
+    const CMiningRound& round = *job.pround;
+    int64 nStart = GetTimeMicros();
+    std::vector<CBigNum> vChainOrigins;
+    std::vector<unsigned int> vCandidateTypes, vChainLength, vChainLengthTested;
+    for (unsigned int nFirst = 0; nFirst < job.vCandidates.size(); nFirst += nFermatBatchSize)
+    {
+        if (IsStale(round))
+            break;
+        unsigned int nEnd = std::min((unsigned int)job.vCandidates.size(), nFirst + nFermatBatchSize);
+        vChainOrigins.clear();
+        vCandidateTypes.clear();
+        for (unsigned int i = nFirst; i < nEnd; i++)
+        {
+            vChainOrigins.push_back(round.bnFixedFactor * job.vCandidates[i].first);
+            vCandidateTypes.push_back(job.vCandidates[i].second);
+        }
+        ProbablePrimeChainTestBatchForMiner(vChainOrigins, vCandidateTypes, round.block.nBits, !fFullChainLengths, vChainLength);
+        vChainLengthTested.insert(vChainLengthTested.end(), vChainLength.begin(), vChainLength.end());
+        for (unsigned int i = nFirst; i < nEnd; i++)
+        {
+            unsigned int nChainLength = vChainLength[i - nFirst];
+            if (nChainLength < round.block.nBits)
+                continue;
+            CBlock block = round.block;
+            block.bnPrimeChainMultiplier = round.bnFixedMultiplier * job.vCandidates[i].first;
+            printf("Probable prime chain found for block=%s!!\n  Target: %s\n  Chain: %s\n", block.GetHash().GetHex().c_str(),
+                TargetToString(block.nBits).c_str(), GetPrimeChainName(job.vCandidates[i].second, nChainLength).c_str());
+            SubmitBlock(block);
+            break;
+        }
+    }
+    int64 nTime = GetTimeMicros() - nStart;
+    tuner.AddResults(round.block.nBits, round.nSieveSetting, nTime, vChainLengthTested);
+    pminingcounters->AddChainTests(nTime, round.block.nBits, EstimateCandidatePrimeProbability(), vChainLengthTested);
+}
+
+void CPrimeMinerPool::SubmitBlock(CBlock& block)
+{
+    SetThreadPriority(THREAD_PRIORITY_NORMAL);
+    {
+        LOCK(cs);
+        CheckWork(&block, *pwallet, reservekey);
+        // The reserved key may have been used, start over with a new template
+        templatebuilder.Reset();
+        nGeneration++;
+    }
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+}
+
+void CPrimeMinerPool::ThreadWorker(unsigned int nWorker)
+{
+    printf("PrimecoinMiner started\n");
+    SetThreadPriority(THREAD_PRIORITY_LOWEST);
+    RenameThread("primecoin-miner");
+
+    // Each thread tunes its own sieve and keeps its own counters
+    pminer.reset(new CPrimeMiner());
+    miningstats.AddThread();
+
+    try {
+        bool fSieveDrained = true;
+        CPrimeTestJob job;
+        loop
+        {
+            boost::this_thread::interruption_point();
+            miningstats.LogRates();
+
+            // Sieve ahead while the last jobs of our sieve are still queued;
+            // the tests done so far are a fair sample for the test cost
+            if (nSieveAheadJobs > 0 && !fSieveDrained && workqueue.Size(nWorker) <= nSieveAheadJobs)
+            {
+                pminer->TimerSetPrimalityDone(GetTimeMicros());
+                if (SieveNewRound(nWorker))
+                    continue;
+                fSieveDrained = true;
+            }
+
+            // Test candidates of our own sieve first
+            if (workqueue.Pop(nWorker, job))
+            {
+                TestCandidates(job);
+                continue;
+            }
+            if (!fSieveDrained)
+            {
+                pminer->TimerSetPrimalityDone(GetTimeMicros());
+                fSieveDrained = true;
+            }
+            // Help out threads that still have candidates queued
+            if (workqueue.Steal(nWorker, job))
+            {
+                TestCandidates(job);
+                continue;
+            }
+
+            // Nothing left anywhere: sieve a new round
+            if (SieveNewRound(nWorker))
+            {
+                fSieveDrained = false;
+                continue;
+            }
+            // No round could be started: wait for the network to come online,
+            // the keypool to be refilled or the next block before trying again
+            MilliSleep(1000);
+        }
+    }
+    catch (boost::thread_interrupted)
+    {
+        printf("PrimecoinMiner terminated\n");
+        throw;
+    }
+}
+
+void GeneratePrimecoins(bool fGenerate, CWallet* pwallet)
+{
+    static boost::thread_group* minerThreads = NULL;
+    static CPrimeMinerPool* pminerpool = NULL;
+
+    int nThreads = GetArg("-genproclimit", -1);
+    if (nThreads < 0)
+        nThreads = boost::thread::hardware_concurrency();
+
+    if (minerThreads != NULL)
+    {
+        minerThreads->interrupt_all();
+        minerThreads->join_all();
+        delete minerThreads;
+        minerThreads = NULL;
+        delete pminerpool;
+        pminerpool = NULL;
+    }
+
+    if (nThreads == 0 || !fGenerate)
+        return;
+
+    miningstats.Reset();
+    pminerpool = new CPrimeMinerPool(pwallet, nThreads);
+    minerThreads = new boost::thread_group();
+    for (int i = 0; i < nThreads; i++)
+        minerThreads->create_thread(boost::bind(&CPrimeMinerPool::ThreadWorker, pminerpool, i));
+}
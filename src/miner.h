@@ -0,0 +1,67 @@
+// Copyright (c) 2009-2010 Satoshi Nakamoto
+// Copyright (c) 2009-2012 The Bitcoin developers
+// Copyright (c) 2013 Primecoin developers
+// See COPYING for license.
+
+#ifndef __MINER_H__
+#define __MINER_H__
+
+#include "main.h"
+
+#include <boost/scoped_ptr.hpp>
+
+class CWallet;
+class CReserveKey;
+
+/** Generate a new block, without valid proof-of-work */
+CBlockTemplate* CreateNewBlock(CReserveKey& reservekey);
+/** Modify the extranonce in a block */
+void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int& nExtraNonce);
+/** Check mined block */
+bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+/** Start or stop the prime chain miner threads */
+void GeneratePrimecoins(bool fGenerate, CWallet* pwallet);
+
+/** Block template kept up to date with the memory pool
+  *
+  * A new chain tip rebuilds the template from the whole memory pool, ordered
+  * by priority and then by fee. Transactions arriving while the tip stays the
+  * same are appended to the template, validated against the coins view the
+  * template has already built up, instead of starting over.
+  */
+class CBlockTemplateBuilder
+{
+private:
+    CReserveKey& reservekey;
+    unsigned int nBlockMaxSize;
+    unsigned int nBlockPrioritySize;
+    unsigned int nBlockMinSize;
+
+    CBlockTemplate blocktemplate;
+    CBlockIndex* pindexPrev; // tip the template builds on, NULL if it needs a rebuild
+    unsigned int nTransactionsUpdatedLast;
+    boost::scoped_ptr<CCoinsViewCache> pview; // coins with the template's transactions applied
+    std::set<uint256> setTxIncluded;
+    uint64 nBlockSize;
+    unsigned int nBlockSigOps;
+    int64 nFees;
+    int64 nLastFailureLog; // miners retry a failed update, so log failures at most once a minute
+
+    bool Fail(const char* pszReason);
+    bool Rebuild(const CPubKey& pubkey);
+    void AddTransactions(const std::vector<CTransaction*>& vtxCandidates);
+    void UpdateCoinbase();
+
+public:
+    CBlockTemplateBuilder(CReserveKey& reservekeyIn);
+
+    // Bring the template up to date with the chain tip and the memory pool
+    bool Update();
+    // Force a full rebuild on the next update, e.g. after the reserved key was used
+    void Reset() { pindexPrev = NULL; }
+
+    const CBlockTemplate& GetTemplate() const { return blocktemplate; }
+    CBlockIndex* GetPrevIndex() const { return pindexPrev; }
+};
+
+#endif // __MINER_H__
@@ -0,0 +1,193 @@
+// Copyright (c) 2013 Primecoin developers
+// See COPYING for license.
+
+#include <math.h>
+
+#include "main.h"
+#include "miningstats.h"
+#include "prime.h"
+
+CMiningStats miningstats;
+
+// The counters belong to miningstats, not to the thread
+static void KeepMiningCounters(CMiningCounters* pcounters)
+{
+}
+
+boost::thread_specific_ptr<CMiningCounters> pminingcounters(KeepMiningCounters);
+
+void CMiningCounters::SetNull()
+{
+    nSieves = 0;
+    nSieveTimeMicro = 0;
+    nWeaves = 0;
+    nCandidates = 0;
+    nTestTimeMicro = 0;
+    nChainTests = 0;
+    nFermatTests = 0;
+    nProbablePrimes = 0;
+    for (unsigned int i = 0; i < nMiningStatsChainLengths; i++)
+        vChainHits[i] = 0;
+    dChainsExpected = 0.0;
+    nBits = 0;
+}
+
+void CMiningCounters::AddSieve(int64 nTimeMicro, unsigned int nWeavesIn, unsigned int nCandidatesIn)
+{
+    nSieves++;
+    nSieveTimeMicro += nTimeMicro;
+    nWeaves += nWeavesIn;
+    nCandidates += nCandidatesIn;
+}
+
+void CMiningCounters::AddChainTests(int64 nTimeMicro, unsigned int nBitsIn, double dPrimeProbability, const std::vector<unsigned int>& vChainLength)
+{
+    nTestTimeMicro += nTimeMicro;
+    nChainTests += vChainLength.size();
+    BOOST_FOREACH(unsigned int nChainLength, vChainLength)
+        vChainHits[std::min(TargetGetLength(nChainLength), nMiningStatsChainLengths - 1)]++;
+    dChainsExpected += vChainLength.size() * pow(dPrimeProbability, (double) nBitsIn / (1 << nFractionalBits));
+    nBits = nBitsIn;
+}
+
+void CMiningSnapshot::SetNull()
+{
+    nTimeMicro = 0;
+    nThreads = 0;
+    nSieves = 0;
+    nSieveTimeMicro = 0;
+    nWeaves = 0;
+    nCandidates = 0;
+    nTestTimeMicro = 0;
+    nChainTests = 0;
+    nFermatTests = 0;
+    nProbablePrimes = 0;
+    for (unsigned int i = 0; i < nMiningStatsChainLengths; i++)
+        vChainHits[i] = 0;
+    dChainsExpected = 0.0;
+    nBits = 0;
+}
+
+double CMiningSnapshot::GetPrimesPerSec(const CMiningSnapshot& snapshotStart) const
+{
+    if (nTimeMicro <= snapshotStart.nTimeMicro)
+        return 0.0;
+    return 1000000.0 * (nProbablePrimes - snapshotStart.nProbablePrimes) / (nTimeMicro - snapshotStart.nTimeMicro);
+}
+
+double CMiningSnapshot::GetTestsPerSec(const CMiningSnapshot& snapshotStart) const
+{
+    if (nTimeMicro <= snapshotStart.nTimeMicro)
+        return 0.0;
+    return 1000000.0 * (nFermatTests - snapshotStart.nFermatTests) / (nTimeMicro - snapshotStart.nTimeMicro);
+}
+
+double CMiningSnapshot::GetChainsPerDay(const CMiningSnapshot& snapshotStart) const
+{
+    if (nTimeMicro <= snapshotStart.nTimeMicro)
+        return 0.0;
+    return 86400000000.0 * (dChainsExpected - snapshotStart.dChainsExpected) / (nTimeMicro - snapshotStart.nTimeMicro);
+}
+
+double CMiningSnapshot::GetExpectedTimeToBlock(const CMiningSnapshot& snapshotStart) const
+{
+    double dChainsPerDay = GetChainsPerDay(snapshotStart);
+    return (dChainsPerDay > 0.0)? (86400.0 / dChainsPerDay) : 0.0;
+}
+
+double CMiningSnapshot::GetSieveTimeShare(const CMiningSnapshot& snapshotStart) const
+{
+    int64 nSieveTime = nSieveTimeMicro - snapshotStart.nSieveTimeMicro;
+    int64 nTime = nSieveTime + (nTestTimeMicro - snapshotStart.nTestTimeMicro);
+    return (nTime > 0)? ((double) nSieveTime / nTime) : 0.0;
+}
+
+CMiningStats::CMiningStats()
+{
+    nTimeLogMicro = 0;
+}
+
+CMiningStats::~CMiningStats()
+{
+    BOOST_FOREACH(CMiningCounters* pcounters, vCounters)
+        delete pcounters;
+}
+
+void CMiningStats::Reset()
+{
+    LOCK(cs);
+    BOOST_FOREACH(CMiningCounters* pcounters, vCounters)
+        delete pcounters;
+    vCounters.clear();
+    snapshotStart.SetNull();
+    snapshotStart.nTimeMicro = GetTimeMicros();
+    snapshotLog = snapshotStart;
+    nTimeLogMicro = snapshotStart.nTimeMicro;
+    nHPSTimerStart = snapshotStart.nTimeMicro / 1000;
+    dPrimesPerSec = 0.0;
+    dChainsPerDay = 0.0;
+}
+
+CMiningCounters* CMiningStats::AddThread()
+{
+    LOCK(cs);
+    CMiningCounters* pcounters = new CMiningCounters();
+    vCounters.push_back(pcounters);
+    pminingcounters.reset(pcounters);
+    return pcounters;
+}
+
+void CMiningStats::GetSnapshot(CMiningSnapshot& snapshot)
+{
+    LOCK(cs);
+    snapshot.SetNull();
+    snapshot.nTimeMicro = GetTimeMicros();
+    snapshot.nThreads = vCounters.size();
+    BOOST_FOREACH(const CMiningCounters* pcounters, vCounters)
+    {
+        snapshot.nSieves += pcounters->nSieves;
+        snapshot.nSieveTimeMicro += pcounters->nSieveTimeMicro;
+        snapshot.nWeaves += pcounters->nWeaves;
+        snapshot.nCandidates += pcounters->nCandidates;
+        snapshot.nTestTimeMicro += pcounters->nTestTimeMicro;
+        snapshot.nChainTests += pcounters->nChainTests;
+        snapshot.nFermatTests += pcounters->nFermatTests;
+        snapshot.nProbablePrimes += pcounters->nProbablePrimes;
+        for (unsigned int i = 0; i < nMiningStatsChainLengths; i++)
+            snapshot.vChainHits[i] += pcounters->vChainHits[i];
+        snapshot.dChainsExpected += pcounters->dChainsExpected;
+        snapshot.nBits = std::max(snapshot.nBits, (unsigned int) pcounters->nBits);
+    }
+}
+
+void CMiningStats::GetSnapshotStart(CMiningSnapshot& snapshot)
+{
+    LOCK(cs);
+    snapshot = snapshotStart;
+}
+
+void CMiningStats::LogRates()
+{
+    if (GetTimeMicros() - nTimeLogMicro < 60 * 1000000)
+        return;
+    CMiningSnapshot snapshot;
+    GetSnapshot(snapshot);
+    LOCK(cs);
+    if (snapshot.nTimeMicro - nTimeLogMicro < 60 * 1000000)
+        return; // another thread got here first
+
+    dPrimesPerSec = snapshot.GetPrimesPerSec(snapshotLog);
+    dChainsPerDay = snapshot.GetChainsPerDay(snapshotLog);
+    std::string strChainHits;
+    for (unsigned int i = 1; i < nMiningStatsChainLengths; i++)
+    {
+        uint64 nChainHits = snapshot.vChainHits[i] - snapshotLog.vChainHits[i];
+        if (nChainHits > 0)
+            strChainHits += strprintf(" %u:%"PRI64u, i, nChainHits);
+    }
+    printf("primemeter %9.0f prime/s %9.0f test/s %8.3f chain/d %7.1f%% sieve, target %s, %u threads, chains%s\n",
+        dPrimesPerSec, snapshot.GetTestsPerSec(snapshotLog), dChainsPerDay, 100.0 * snapshot.GetSieveTimeShare(snapshotLog),
+        TargetToString(snapshot.nBits).c_str(), snapshot.nThreads, strChainHits.c_str());
+    snapshotLog = snapshot;
+    nTimeLogMicro = snapshot.nTimeMicro;
+}
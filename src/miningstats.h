@@ -0,0 +1,111 @@
+// Copyright (c) 2013 Primecoin developers
+// See COPYING for license.
+
+#ifndef __MININGSTATS_H__
+#define __MININGSTATS_H__
+
+#include "sync.h"
+#include "util.h"
+
+#include <boost/thread/tss.hpp>
+
+#include <vector>
+
+// Chain lengths counted apart; longer chains count with the longest
+static const unsigned int nMiningStatsChainLengths = 16;
+
+/** Mining counters of one miner thread
+  *
+  * Only the owning thread writes its counters, and it does so without any
+  * locking. Readers add them up from other threads at any time, so a
+  * snapshot may be a moment behind, or catch a 64-bit counter halfway
+  * through an update on a 32-bit machine; good enough for statistics.
+  */
+class CMiningCounters
+{
+public:
+    volatile uint64 nSieves;          // sieves built
+    volatile int64 nSieveTimeMicro;   // time spent building sieves
+    volatile uint64 nWeaves;          // primes woven into the sieves
+    volatile uint64 nCandidates;      // candidates the sieves left
+    volatile int64 nTestTimeMicro;    // time spent testing candidates
+    volatile uint64 nChainTests;      // candidates tested
+    volatile uint64 nFermatTests;     // primality tests run on chain numbers
+    volatile uint64 nProbablePrimes;  // chain numbers passing them
+    volatile uint64 vChainHits[nMiningStatsChainLengths]; // candidates by chain length
+    volatile double dChainsExpected;  // expected chains meeting the target
+    volatile unsigned int nBits;      // target of the last chain tests
+
+    CMiningCounters() { SetNull(); }
+    void SetNull();
+
+    void AddSieve(int64 nTimeMicro, unsigned int nWeavesIn, unsigned int nCandidatesIn);
+    // Chain tests of candidates against target nBitsIn, where each number
+    // of a candidate chain is prime with probability dPrimeProbability
+    void AddChainTests(int64 nTimeMicro, unsigned int nBitsIn, double dPrimeProbability, const std::vector<unsigned int>& vChainLength);
+};
+
+/** Mining counters of all miner threads added up at one point in time */
+class CMiningSnapshot
+{
+public:
+    int64 nTimeMicro;
+    unsigned int nThreads;
+    uint64 nSieves;
+    int64 nSieveTimeMicro;
+    uint64 nWeaves;
+    uint64 nCandidates;
+    int64 nTestTimeMicro;
+    uint64 nChainTests;
+    uint64 nFermatTests;
+    uint64 nProbablePrimes;
+    uint64 vChainHits[nMiningStatsChainLengths];
+    double dChainsExpected;
+    unsigned int nBits;
+
+    CMiningSnapshot() { SetNull(); }
+    void SetNull();
+
+    // Rates over the time since an earlier snapshot
+    double GetPrimesPerSec(const CMiningSnapshot& snapshotStart) const;
+    double GetTestsPerSec(const CMiningSnapshot& snapshotStart) const;
+    double GetChainsPerDay(const CMiningSnapshot& snapshotStart) const;
+    // Expected time to find a block, in seconds; 0 if nothing was expected yet
+    double GetExpectedTimeToBlock(const CMiningSnapshot& snapshotStart) const;
+    // Share of the thread time spent building sieves
+    double GetSieveTimeShare(const CMiningSnapshot& snapshotStart) const;
+};
+
+/** Registry of the mining counters of the miner threads */
+class CMiningStats
+{
+private:
+    CCriticalSection cs;
+    std::vector<CMiningCounters*> vCounters;
+    CMiningSnapshot snapshotStart;  // all zero, taken when mining started
+    CMiningSnapshot snapshotLog;    // taken at the last log line
+    volatile int64 nTimeLogMicro;
+
+public:
+    CMiningStats();
+    ~CMiningStats();
+
+    // Start over, with no miner threads running
+    void Reset();
+    // Counters for the calling thread, registered with pminingcounters
+    CMiningCounters* AddThread();
+
+    void GetSnapshot(CMiningSnapshot& snapshot);
+    // Rates since mining started
+    void GetSnapshotStart(CMiningSnapshot& snapshot);
+
+    // Log the rates since the last log line once a minute has passed, and
+    // update dPrimesPerSec and dChainsPerDay with them
+    void LogRates();
+};
+
+extern CMiningStats miningstats;
+// Counters of the calling miner thread, NULL on other threads
+extern boost::thread_specific_ptr<CMiningCounters> pminingcounters;
+
+#endif // __MININGSTATS_H__
@@ -649,7 +649,14 @@ void ThreadSocketHandler()
                             {
                                 TRY_LOCK(pnode->cs_inventory, lockInv);
                                 if (lockInv)
-                                    fDelete = true;
+                                {
+                                    TRY_LOCK(cs_main, lockMain);
+                                    if (lockMain)
+                                    {
+                                        FinalizeNode(pnode);
+                                        fDelete = true;
+                                    }
+                                }
                             }
                         }
                     }
@@ -112,11 +112,14 @@ public:
     CDataStream vRecv;              // received message data
     unsigned int nDataPos;
 
+    bool fPreChecked;               // proof-of-work of the block checked ahead
+
     CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
         hdrbuf.resize(24);
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        fPreChecked = false;
     }
 
     bool complete() const
@@ -202,6 +205,12 @@ public:
     uint256 hashLastGetBlocksEnd;
     int nStartingHeight;
     bool fStartSync;
+    // headers-first sync: blocks requested from this node, whether it has
+    // more headers for us once there is room for them, and whether our
+    // getheaders to it is unanswered
+    std::set<uint256> setBlocksInFlight;
+    bool fGetHeaders;
+    bool fGetHeadersPending;
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
@@ -245,6 +254,8 @@ public:
         hashLastGetBlocksEnd = 0;
         nStartingHeight = -1;
         fStartSync = false;
+        fGetHeaders = false;
+        fGetHeadersPending = false;
         fGetAddr = false;
         nMisbehavior = 0;
         hashCheckpointKnown = 0;
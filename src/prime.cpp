@@ -3,6 +3,8 @@
 // see the accompanying file COPYING
 
 #include "prime.h"
+#include "fermat.h"
+#include "miningstats.h"
 
 /**********************/
 /* PRIMECOIN PROTOCOL */
@@ -10,11 +12,17 @@
 
 // Prime Table
 std::vector<unsigned int> vPrimes;
+std::vector<unsigned int> vTwoInverses;
+std::vector<unsigned int> vTwoPow32Mods;
+std::vector<unsigned int> vTwoPow64Mods;
 static const unsigned int nPrimeTableLimit = nMaxSieveSize;
 
 void GeneratePrimeTable()
 {
     vPrimes.clear();
+    vTwoInverses.clear();
+    vTwoPow32Mods.clear();
+    vTwoPow64Mods.clear();
     // Generate prime table using sieve of Eratosthenes
     std::vector<bool> vfComposite (nPrimeTableLimit, false);
     for (unsigned int nFactor = 2; nFactor * nFactor < nPrimeTableLimit; nFactor++)
@@ -26,7 +34,13 @@ void GeneratePrimeTable()
     }
     for (unsigned int n = 2; n < nPrimeTableLimit; n++)
         if (!vfComposite[n])
+        {
             vPrimes.push_back(n);
+            vTwoInverses.push_back((n == 2)? 0 : (n + 1) / 2);
+            uint64 nTwoPow32Mod = (1llu << 32) % n;
+            vTwoPow32Mods.push_back((unsigned int)nTwoPow32Mod);
+            vTwoPow64Mods.push_back((unsigned int)((nTwoPow32Mod * nTwoPow32Mod) % n));
+        }
     printf("GeneratePrimeTable() : prime table [1, %u] generated with %u primes\n", nPrimeTableLimit, (unsigned int) vPrimes.size());
 }
 
@@ -62,27 +76,153 @@ bool PrimeTableGetPreviousPrime(unsigned int& p)
     return false;
 }
 
+void BigNumToLimbs(const CBigNum& bn, std::vector<uint64>& vLimbs)
+{
+    unsigned int nBytes = BN_num_bytes(&bn);
+    std::vector<unsigned char> vch(nBytes); // big endian
+    if (nBytes > 0)
+        BN_bn2bin(&bn, &vch[0]);
+    vLimbs.assign((nBytes + 7) / 8, 0);
+    for (unsigned int i = 0; i < nBytes; i++)
+        vLimbs[vLimbs.size() - 1 - i / 8] |= ((uint64)vch[nBytes - 1 - i]) << (8 * (i % 8));
+}
+
+// Fold one limb into a remainder modulo p:
+//   r * 2^64 + l = r * (2^64 mod p) + h * (2^32 mod p) + (l mod 2^32)  (mod p)
+// With p below 2^20 the sum stays below 2^53, so one 64-bit division does.
+static inline uint64 ReduceLimb(uint64 nRemainder, uint64 nLimb, uint64 nPrime, uint64 nTwoPow32Mod, uint64 nTwoPow64Mod)
+{
+    return (nRemainder * nTwoPow64Mod + (nLimb >> 32) * nTwoPow32Mod + (nLimb & 0xffffffffllu)) % nPrime;
+}
+
+void ReduceModPrimes(const std::vector<uint64>& vLimbs, unsigned int nPrimeSeqBegin, unsigned int nPrimeSeqEnd, unsigned int* pRemainders)
+{
+    assert(nPrimeTableLimit <= (1u << 20));
+    unsigned int nSeq = nPrimeSeqBegin;
+    // Four primes in lockstep, so their divisions overlap
+    for (; nSeq + 4 <= nPrimeSeqEnd; nSeq += 4)
+    {
+        uint64 nRemainder0 = 0, nRemainder1 = 0, nRemainder2 = 0, nRemainder3 = 0;
+        BOOST_FOREACH(uint64 nLimb, vLimbs)
+        {
+            nRemainder0 = ReduceLimb(nRemainder0, nLimb, vPrimes[nSeq], vTwoPow32Mods[nSeq], vTwoPow64Mods[nSeq]);
+            nRemainder1 = ReduceLimb(nRemainder1, nLimb, vPrimes[nSeq + 1], vTwoPow32Mods[nSeq + 1], vTwoPow64Mods[nSeq + 1]);
+            nRemainder2 = ReduceLimb(nRemainder2, nLimb, vPrimes[nSeq + 2], vTwoPow32Mods[nSeq + 2], vTwoPow64Mods[nSeq + 2]);
+            nRemainder3 = ReduceLimb(nRemainder3, nLimb, vPrimes[nSeq + 3], vTwoPow32Mods[nSeq + 3], vTwoPow64Mods[nSeq + 3]);
+        }
+        pRemainders[nSeq - nPrimeSeqBegin] = (unsigned int)nRemainder0;
+        pRemainders[nSeq + 1 - nPrimeSeqBegin] = (unsigned int)nRemainder1;
+        pRemainders[nSeq + 2 - nPrimeSeqBegin] = (unsigned int)nRemainder2;
+        pRemainders[nSeq + 3 - nPrimeSeqBegin] = (unsigned int)nRemainder3;
+    }
+    for (; nSeq < nPrimeSeqEnd; nSeq++)
+    {
+        uint64 nRemainder = 0;
+        BOOST_FOREACH(uint64 nLimb, vLimbs)
+            nRemainder = ReduceLimb(nRemainder, nLimb, vPrimes[nSeq], vTwoPow32Mods[nSeq], vTwoPow64Mods[nSeq]);
+        pRemainders[nSeq - nPrimeSeqBegin] = (unsigned int)nRemainder;
+    }
+}
+
+bool TrialDivisionTest(const CBigNum& bn, unsigned int nTrialDivisionLimit)
+{
+    // Primes are tried a batch at a time, most composites fail early
+    static const unsigned int nBatchSize = 64;
+    std::vector<uint64> vLimbs;
+    BigNumToLimbs(bn, vLimbs);
+    unsigned int vRemainders[nBatchSize];
+    for (unsigned int nSeq = 0; nSeq < vPrimes.size() && vPrimes[nSeq] < nTrialDivisionLimit; nSeq += nBatchSize)
+    {
+        unsigned int nSeqEnd = std::min(nSeq + nBatchSize, (unsigned int)vPrimes.size());
+        while (vPrimes[nSeqEnd - 1] >= nTrialDivisionLimit)
+            nSeqEnd--;
+        ReduceModPrimes(vLimbs, nSeq, nSeqEnd, vRemainders);
+        for (unsigned int i = 0; i < nSeqEnd - nSeq; i++)
+            if (vRemainders[i] == 0)
+                return false;
+    }
+    return true;
+}
+
+// Primorials of the primes up to 47, the last one to fit in 64 bits,
+// covering the primorials miners use
+static const unsigned int nSmallPrimorials = 15;
+static const unsigned int vSmallPrimorialPrimes[nSmallPrimorials] =
+    {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47};
+static const uint64 vSmallPrimorials[nSmallPrimorials] = {
+    2llu, 6llu, 30llu, 210llu, 2310llu, 30030llu, 510510llu, 9699690llu,
+    223092870llu, 6469693230llu, 200560490130llu, 7420738134810llu,
+    304250263527210llu, 13082761331670030llu, 614889782588491410llu};
+
+// Index in the small primorial table of the largest prime up to p, or
+// nSmallPrimorials if primes above 47 are needed
+static unsigned int SmallPrimorialIndex(unsigned int p)
+{
+    if (p > vSmallPrimorialPrimes[nSmallPrimorials - 1])
+        return nSmallPrimorials;
+    unsigned int i = 0;
+    while (i + 1 < nSmallPrimorials && vSmallPrimorialPrimes[i + 1] <= p)
+        i++;
+    return i;
+}
+
 // Compute Primorial number p#
 void Primorial(unsigned int p, CBigNum& bnPrimorial)
 {
-    bnPrimorial = 1;
-    BOOST_FOREACH(unsigned int nPrime, vPrimes)
+    if (p < 2)
     {
-        if (nPrime > p) break;
-        bnPrimorial *= nPrime;
+        bnPrimorial = 1;
+        return;
     }
+    unsigned int nIndex = SmallPrimorialIndex(p);
+    if (nIndex < nSmallPrimorials)
+    {
+        bnPrimorial = CBigNum(vSmallPrimorials[nIndex]);
+        return;
+    }
+    bnPrimorial = CBigNum(vSmallPrimorials[nSmallPrimorials - 1]);
+    for (unsigned int nSeq = nSmallPrimorials; nSeq < vPrimes.size() && vPrimes[nSeq] <= p; nSeq++)
+        bnPrimorial *= vPrimes[nSeq];
 }
 
 // Compute first primorial number greater than or equal to pn
 void PrimorialAt(CBigNum& bn, CBigNum& bnPrimorial)
 {
-    bnPrimorial = 1;
-    BOOST_FOREACH(unsigned int nPrime, vPrimes)
+    for (unsigned int i = 0; i < nSmallPrimorials; i++)
     {
-        bnPrimorial *= nPrime;
+        bnPrimorial = CBigNum(vSmallPrimorials[i]);
         if (bnPrimorial >= bn)
             return;
     }
+    for (unsigned int nSeq = nSmallPrimorials; nSeq < vPrimes.size(); nSeq++)
+    {
+        bnPrimorial *= vPrimes[nSeq];
+        if (bnPrimorial >= bn)
+            return;
+    }
+}
+
+// Count a primality test in the mining statistics of a miner thread
+static void CountPrimalityTest(bool fProbablePrime)
+{
+    CMiningCounters* pcounters = pminingcounters.get();
+    if (pcounters == NULL)
+        return;
+    pcounters->nFermatTests++;
+    if (fProbablePrime)
+        pcounters->nProbablePrimes++;
+}
+
+// Fermat test of the modulus held by engine
+static bool FermatProbablePrimalityTest(CFermatEngine& engine, unsigned int& nLength)
+{
+    unsigned int nFractionalLength = 0;
+    bool fProbablePrime = engine.FermatTest(nFractionalLength);
+    CountPrimalityTest(fProbablePrime);
+    if (fProbablePrime)
+        return true;
+    nLength = (nLength & TARGET_LENGTH_MASK) | nFractionalLength;
+    return false;
 }
 
 // Check Fermat probable primality test (2-PRP): 2 ** (n-1) = 1 (mod n)
@@ -90,11 +230,17 @@ void PrimorialAt(CBigNum& bn, CBigNum& bnPrimorial)
 // false: n is composite; set fractional length in the nLength output
 static bool FermatProbablePrimalityTest(const CBigNum& n, unsigned int& nLength)
 {
+    CFermatEngine engine;
+    if (engine.SetModulus(n))
+        return FermatProbablePrimalityTest(engine, nLength);
+
+    // Even or oversized n, beyond the fixed-width engine
     CAutoBN_CTX pctx;
     CBigNum a = 2; // base; Fermat witness
     CBigNum e = n - 1;
     CBigNum r;
     BN_mod_exp(&r, &a, &e, &n, pctx);
+    CountPrimalityTest(r == 1);
     if (r == 1)
         return true;
     // Failed Fermat test, calculate fractional length
@@ -105,6 +251,41 @@ static bool FermatProbablePrimalityTest(const CBigNum& n, unsigned int& nLength)
     return false;
 }
 
+// Residue of 2 ** ((n-1)/2) mod n a probable prime n = 2p +/- 1 must give,
+// by Euler and Lagrange or by Lifchitz
+// Return value: false if n % 8 does not fit the kind of chain
+static bool EulerLagrangeLifchitzExpectMinusOne(unsigned int nMod8, bool fSophieGermain, bool& fExpectMinusOne)
+{
+    if (fSophieGermain && (nMod8 == 7)) // Euler & Lagrange
+        fExpectMinusOne = false;
+    else if (fSophieGermain && (nMod8 == 3)) // Lifchitz
+        fExpectMinusOne = true;
+    else if ((!fSophieGermain) && (nMod8 == 5)) // Lifchitz
+        fExpectMinusOne = true;
+    else if ((!fSophieGermain) && (nMod8 == 1)) // LifChitz
+        fExpectMinusOne = false;
+    else
+        return false;
+    return true;
+}
+
+// Euler-Lagrange-Lifchitz test of the modulus held by engine
+static bool EulerLagrangeLifchitzPrimalityTest(CFermatEngine& engine, bool fSophieGermain, unsigned int& nLength)
+{
+    unsigned int nMod8 = engine.GetModulusMod8();
+    bool fExpectMinusOne;
+    if (!EulerLagrangeLifchitzExpectMinusOne(nMod8, fSophieGermain, fExpectMinusOne))
+        return error("EulerLagrangeLifchitzPrimalityTest() : invalid n %% 8 = %u, %s", nMod8, (fSophieGermain? "first kind" : "second kind"));
+
+    unsigned int nFractionalLength = 0;
+    bool fProbablePrime = engine.EulerCriterionTest(fExpectMinusOne, nFractionalLength);
+    CountPrimalityTest(fProbablePrime);
+    if (fProbablePrime)
+        return true;
+    nLength = (nLength & TARGET_LENGTH_MASK) | nFractionalLength;
+    return false;
+}
+
 // Test probable primality of n = 2p +/- 1 based on Euler, Lagrange and Lifchitz
 // fSophieGermain:
 //   true:  n = 2p+1, p prime, aka Cunningham Chain of first kind
@@ -114,6 +295,11 @@ static bool FermatProbablePrimalityTest(const CBigNum& n, unsigned int& nLength)
 //   false: n is composite; set fractional length in the nLength output
 static bool EulerLagrangeLifchitzPrimalityTest(const CBigNum& n, bool fSophieGermain, unsigned int& nLength)
 {
+    CFermatEngine engine;
+    if (engine.SetModulus(n))
+        return EulerLagrangeLifchitzPrimalityTest(engine, fSophieGermain, nLength);
+
+    // Oversized n, beyond the fixed-width engine
     CAutoBN_CTX pctx;
     CBigNum a = 2;
     CBigNum e = (n - 1) >> 1;
@@ -132,6 +318,7 @@ static bool EulerLagrangeLifchitzPrimalityTest(const CBigNum& n, bool fSophieGer
     else
         return error("EulerLagrangeLifchitzPrimalityTest() : invalid n %% 8 = %d, %s", nMod8.getint(), (fSophieGermain? "first kind" : "second kind"));
 
+    CountPrimalityTest(fPassedTest);
     if (fPassedTest)
         return true;
     // Failed test, calculate fractional length
@@ -294,42 +481,104 @@ std::string GetPrimeOriginPrimorialForm(CBigNum& bnPrimeChainOrigin)
     return strprintf("%s*%u#", bnNonPrimorialFactor.ToString().c_str(), (nPrimeSeq > 0)? vPrimes[nPrimeSeq-1] : 0);
 }
 
-// Test Probable Cunningham Chain for: n
+// Continue a probable Cunningham Chain whose first number n passed the Fermat test
+// pengine: NULL, or an engine holding n as its modulus; the following numbers
+//   are then derived in place in the engine, so the whole chain shares one
+//   set of buffers and reduction constants
+// nMaxLength: 0, or stop once the chain is known to reach this length
+//   (miner, when a longer chain would not make a difference)
 // fSophieGermain:
 //   true - Test for Cunningham Chain of first kind (n, 2n+1, 4n+3, ...)
 //   false - Test for Cunningham Chain of second kind (n, 2n-1, 4n-3, ...)
 // Return value:
 //   true - Probable Cunningham Chain found (length at least 2)
 //   false - Not Cunningham Chain
-static bool ProbableCunninghamChainTest(const CBigNum& n, bool fSophieGermain, bool fFermatTest, unsigned int& nProbableChainLength)
+static bool ProbableCunninghamChainExtend(const CBigNum& n, CFermatEngine* pengine, bool fSophieGermain, bool fFermatTest, unsigned int nMaxLength, unsigned int& nProbableChainLength)
 {
-    nProbableChainLength = 0;
-    CBigNum N = n;
-
-    // Fermat test for n first
-    if (!FermatProbablePrimalityTest(N, nProbableChainLength))
-        return false;
+    CBigNum N;
+    if (!pengine)
+        N = n;
 
     // Euler-Lagrange-Lifchitz test for the following numbers in chain
     while (true)
     {
         TargetIncrementLength(nProbableChainLength);
-        N = N + N + (fSophieGermain? 1 : (-1));
-        if (fFermatTest)
+        if (nMaxLength > 0 && TargetGetLength(nProbableChainLength) >= nMaxLength)
+            break;
+        if (pengine && !pengine->SetChainNext(fSophieGermain))
         {
-            if (!FermatProbablePrimalityTest(N, nProbableChainLength))
-                break;
+            // The chain outgrew the engine, carry on with bignums
+            pengine->GetModulus(N);
+            pengine = NULL;
         }
+        bool fProbablePrime;
+        if (pengine)
+            fProbablePrime = (fFermatTest? FermatProbablePrimalityTest(*pengine, nProbableChainLength) :
+                EulerLagrangeLifchitzPrimalityTest(*pengine, fSophieGermain, nProbableChainLength));
         else
         {
-            if (!EulerLagrangeLifchitzPrimalityTest(N, fSophieGermain, nProbableChainLength))
-                break;
+            N = N + N + (fSophieGermain? 1 : (-1));
+            fProbablePrime = (fFermatTest? FermatProbablePrimalityTest(N, nProbableChainLength) :
+                EulerLagrangeLifchitzPrimalityTest(N, fSophieGermain, nProbableChainLength));
         }
+        if (!fProbablePrime)
+            break;
     }
 
     return (TargetGetLength(nProbableChainLength) >= 2);
 }
 
+// Test Probable Cunningham Chain for: n
+// nMaxLength: 0, or stop once the chain is known to reach this length
+// fSophieGermain:
+//   true - Test for Cunningham Chain of first kind (n, 2n+1, 4n+3, ...)
+//   false - Test for Cunningham Chain of second kind (n, 2n-1, 4n-3, ...)
+// Return value:
+//   true - Probable Cunningham Chain found (length at least 2)
+//   false - Not Cunningham Chain
+static bool ProbableCunninghamChainTest(const CBigNum& n, bool fSophieGermain, bool fFermatTest, unsigned int nMaxLength, unsigned int& nProbableChainLength)
+{
+    nProbableChainLength = 0;
+
+    // Fermat test for n first
+    CFermatEngine engine;
+    if (engine.SetModulus(n))
+    {
+        if (!FermatProbablePrimalityTest(engine, nProbableChainLength))
+            return false;
+        return ProbableCunninghamChainExtend(n, &engine, fSophieGermain, fFermatTest, nMaxLength, nProbableChainLength);
+    }
+    if (!FermatProbablePrimalityTest(n, nProbableChainLength))
+        return false;
+    return ProbableCunninghamChainExtend(n, NULL, fSophieGermain, fFermatTest, nMaxLength, nProbableChainLength);
+}
+
+// BiTwin Chain length from the lengths of its Cunningham Chains
+// BiTwin Chain allows a single prime at the end for odd length chain
+static unsigned int BiTwinChainLength(unsigned int nChainLengthCunningham1, unsigned int nChainLengthCunningham2)
+{
+    return (TargetGetLength(nChainLengthCunningham1) > TargetGetLength(nChainLengthCunningham2))?
+        (nChainLengthCunningham2 + TargetFromInt(TargetGetLength(nChainLengthCunningham2)+1)) :
+        (nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)));
+}
+
+// Second half of a bi-twin test for the miner, given the first kind chain
+// The bi-twin length is fixed by the first kind chain once the second kind
+// chain is at least as long, so the second kind chain is followed no further
+// than the length of the first kind chain.
+// fAbortShort: when even that misses nBits, test no more than the first
+//   number of the second kind chain; the length reported is then a lower
+//   bound, though still tells length 1 and length 2 bi-twin chains apart
+static void BiTwinChainTestForMiner(const CBigNum& bnPrimeChainOrigin, unsigned int nBits, bool fAbortShort, unsigned int nChainLengthCunningham1, unsigned int& nChainLength)
+{
+    unsigned int nChainLengthCunningham2 = 0;
+    unsigned int nMaxLength = TargetGetLength(nChainLengthCunningham1);
+    if (fAbortShort && nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)) < nBits)
+        nMaxLength = 1;
+    ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, nMaxLength, nChainLengthCunningham2);
+    nChainLength = BiTwinChainLength(nChainLengthCunningham1, nChainLengthCunningham2);
+}
+
 // Test probable prime chain for: nOrigin
 // Return value:
 //   true - Probable prime chain found (one of nChainLength meeting target)
@@ -341,19 +590,108 @@ bool ProbablePrimeChainTest(const CBigNum& bnPrimeChainOrigin, unsigned int nBit
     nChainLengthBiTwin = 0;
 
     // Test for Cunningham Chain of first kind
-    ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, fFermatTest, nChainLengthCunningham1);
+    ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, fFermatTest, 0, nChainLengthCunningham1);
     // Test for Cunningham Chain of second kind
-    ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, fFermatTest, nChainLengthCunningham2);
+    ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, fFermatTest, 0, nChainLengthCunningham2);
     // Figure out BiTwin Chain length
-    // BiTwin Chain allows a single prime at the end for odd length chain
-    nChainLengthBiTwin =
-        (TargetGetLength(nChainLengthCunningham1) > TargetGetLength(nChainLengthCunningham2))?
-            (nChainLengthCunningham2 + TargetFromInt(TargetGetLength(nChainLengthCunningham2)+1)) :
-            (nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)));
+    nChainLengthBiTwin = BiTwinChainLength(nChainLengthCunningham1, nChainLengthCunningham2);
 
     return (nChainLengthCunningham1 >= nBits || nChainLengthCunningham2 >= nBits || nChainLengthBiTwin >= nBits);
 }
 
+// Cunningham Chain verification for: n
+// Measures the chain as ProbableCunninghamChainTest() does with
+// Euler-Lagrange-Lifchitz tests, and checks it against the chain Fermat
+// tests alone would find, from one exponentiation per number: the Euler
+// residue r decides the former and r ** 2, the Fermat remainder, the latter.
+// fFirstEulerPassed and nFirstEulerLength receive how the first number
+// fares in an Euler-Lagrange-Lifchitz test, for chains extended down from n.
+// Return value:
+//   false - Fermat tests find a different chain
+static bool VerifyCunninghamChain(const CBigNum& n, bool fSophieGermain, unsigned int& nChainLength, bool& fFirstEulerPassed, unsigned int& nFirstEulerLength)
+{
+    nChainLength = 0;
+    fFirstEulerPassed = false;
+    nFirstEulerLength = 0;
+
+    CFermatEngine engine;
+    if (!engine.SetModulus(n))
+    {
+        // Even n fails both tests; an Euler-Lagrange-Lifchitz test of it
+        // fails without a fractional length
+        unsigned int nChainLengthFermat = 0;
+        ProbableCunninghamChainTest(n, fSophieGermain, false, 0, nChainLength);
+        ProbableCunninghamChainTest(n, fSophieGermain, true, 0, nChainLengthFermat);
+        return (nChainLength == nChainLengthFermat);
+    }
+
+    // The Fermat test decides on the first number
+    unsigned int nFractionalLength = 0;
+    bool fExpectMinusOne;
+    bool fProbablePrime;
+    if (EulerLagrangeLifchitzExpectMinusOne(engine.GetModulusMod8(), fSophieGermain, fExpectMinusOne))
+    {
+        fProbablePrime = engine.EulerFermatTest(fExpectMinusOne, fFirstEulerPassed, nFractionalLength);
+        if (!fFirstEulerPassed)
+            nFirstEulerLength = nFractionalLength;
+    }
+    else
+        fProbablePrime = engine.FermatTest(nFractionalLength);
+    CountPrimalityTest(fProbablePrime);
+    if (!fProbablePrime)
+    {
+        nChainLength = nFractionalLength;
+        return true;
+    }
+
+    while (true)
+    {
+        if (!engine.SetChainNext(fSophieGermain))
+        {
+            // The chain outgrew the engine, finish both chains with bignums
+            CBigNum N;
+            engine.GetModulus(N);
+            unsigned int nChainLengthFermat = nChainLength;
+            ProbableCunninghamChainExtend(N, NULL, fSophieGermain, false, 0, nChainLength);
+            ProbableCunninghamChainExtend(N, NULL, fSophieGermain, true, 0, nChainLengthFermat);
+            return (nChainLength == nChainLengthFermat);
+        }
+        TargetIncrementLength(nChainLength);
+
+        unsigned int nMod8 = engine.GetModulusMod8();
+        if (!EulerLagrangeLifchitzExpectMinusOne(nMod8, fSophieGermain, fExpectMinusOne))
+        {
+            // The Euler-Lagrange-Lifchitz test fails without a fractional length
+            error("VerifyCunninghamChain() : invalid n %% 8 = %u, %s", nMod8, (fSophieGermain? "first kind" : "second kind"));
+            fProbablePrime = engine.FermatTest(nFractionalLength);
+            CountPrimalityTest(fProbablePrime);
+            return (!fProbablePrime && nFractionalLength == 0);
+        }
+        bool fEulerPassed;
+        fProbablePrime = engine.EulerFermatTest(fExpectMinusOne, fEulerPassed, nFractionalLength);
+        CountPrimalityTest(fEulerPassed);
+        if (fEulerPassed)
+            continue;
+        if (fProbablePrime)
+            return false; // Fermat tests go on where the chain ends
+        nChainLength = (nChainLength & TARGET_LENGTH_MASK) | nFractionalLength;
+        return true;
+    }
+}
+
+// Length of the Cunningham Chain extended down by the number n, given the
+// verified chain that starts at 2n +/- 1, as ProbableCunninghamChainTest()
+// with Euler-Lagrange-Lifchitz tests would find it
+static unsigned int ExtendCunninghamChainDown(const CBigNum& n, unsigned int nChainLength, bool fFirstEulerPassed, unsigned int nFirstEulerLength)
+{
+    unsigned int nChainLengthExtended = 0;
+    if (!FermatProbablePrimalityTest(n, nChainLengthExtended))
+        return nChainLengthExtended;
+    if (!fFirstEulerPassed)
+        return (TargetFromInt(1) | nFirstEulerLength);
+    return (nChainLength + TargetFromInt(1));
+}
+
 // Check prime proof-of-work
 bool CheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength)
 {
@@ -373,31 +711,23 @@ bool CheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CB
         return error("CheckPrimeProofOfWork() : prime too big");
 
     // Check prime chain
+    // One pass measures the chains with Euler-Lagrange-Lifchitz tests and
+    // double checks them with Fermat tests only
     unsigned int nChainLengthCunningham1 = 0;
     unsigned int nChainLengthCunningham2 = 0;
     unsigned int nChainLengthBiTwin = 0;
-    if (!ProbablePrimeChainTest(bnPrimeChainOrigin, nBits, false, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin))
+    bool fFirstEulerPassed1, fFirstEulerPassed2;
+    unsigned int nFirstEulerLength1, nFirstEulerLength2;
+    bool fFermatTestAgrees = VerifyCunninghamChain(bnPrimeChainOrigin-1, true, nChainLengthCunningham1, fFirstEulerPassed1, nFirstEulerLength1);
+    fFermatTestAgrees = VerifyCunninghamChain(bnPrimeChainOrigin+1, false, nChainLengthCunningham2, fFirstEulerPassed2, nFirstEulerLength2) && fFermatTestAgrees;
+    nChainLengthBiTwin = BiTwinChainLength(nChainLengthCunningham1, nChainLengthCunningham2);
+    if (nChainLengthCunningham1 < nBits && nChainLengthCunningham2 < nBits && nChainLengthBiTwin < nBits)
         return error("CheckPrimeProofOfWork() : failed prime chain test target=%s length=(%s %s %s)", TargetToString(nBits).c_str(),
             TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str());
-    if (nChainLengthCunningham1 < nBits && nChainLengthCunningham2 < nBits && nChainLengthBiTwin < nBits)
-        return error("CheckPrimeProofOfWork() : prime chain length assert target=%s length=(%s %s %s)", TargetToString(nBits).c_str(),
+    if (!fFermatTestAgrees)
+        return error("CheckPrimeProofOfWork() : failed Fermat-only double check target=%s length=(%s %s %s)", TargetToString(nBits).c_str(),
             TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str());
 
-    // Double check prime chain with Fermat tests only
-    unsigned int nChainLengthCunningham1FermatTest = 0;
-    unsigned int nChainLengthCunningham2FermatTest = 0;
-    unsigned int nChainLengthBiTwinFermatTest = 0;
-    if (!ProbablePrimeChainTest(bnPrimeChainOrigin, nBits, true, nChainLengthCunningham1FermatTest, nChainLengthCunningham2FermatTest, nChainLengthBiTwinFermatTest))
-        return error("CheckPrimeProofOfWork() : failed Fermat test target=%s length=(%s %s %s) lengthFermat=(%s %s %s)", TargetToString(nBits).c_str(),
-            TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str(),
-            TargetToString(nChainLengthCunningham1FermatTest).c_str(), TargetToString(nChainLengthCunningham2FermatTest).c_str(), TargetToString(nChainLengthBiTwinFermatTest).c_str());
-    if (nChainLengthCunningham1 != nChainLengthCunningham1FermatTest ||
-        nChainLengthCunningham2 != nChainLengthCunningham2FermatTest ||
-        nChainLengthBiTwin != nChainLengthBiTwinFermatTest)
-        return error("CheckPrimeProofOfWork() : failed Fermat-only double check target=%s length=(%s %s %s) lengthFermat=(%s %s %s)", TargetToString(nBits).c_str(), 
-            TargetToString(nChainLengthCunningham1).c_str(), TargetToString(nChainLengthCunningham2).c_str(), TargetToString(nChainLengthBiTwin).c_str(),
-            TargetToString(nChainLengthCunningham1FermatTest).c_str(), TargetToString(nChainLengthCunningham2FermatTest).c_str(), TargetToString(nChainLengthBiTwinFermatTest).c_str());
-
     // Select the longest primechain from the three chain types
     nChainLength = nChainLengthCunningham1;
     nChainType = PRIME_CHAIN_CUNNINGHAM1;
@@ -413,12 +743,15 @@ bool CheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CB
     }
 
     // Check that the certificate (bnPrimeChainMultiplier) is normalized
+    // The chains of the halved origin are the chains verified above, each
+    // extended down by one number
     if (bnPrimeChainMultiplier % 2 == 0 && bnPrimeChainOrigin % 4 == 0)
     {
-        unsigned int nChainLengthCunningham1Extended = 0;
-        unsigned int nChainLengthCunningham2Extended = 0;
-        unsigned int nChainLengthBiTwinExtended = 0;
-        if (ProbablePrimeChainTest(bnPrimeChainOrigin / 2, nBits, false, nChainLengthCunningham1Extended, nChainLengthCunningham2Extended, nChainLengthBiTwinExtended))
+        CBigNum bnPrimeChainOriginHalf = bnPrimeChainOrigin / 2;
+        unsigned int nChainLengthCunningham1Extended = ExtendCunninghamChainDown(bnPrimeChainOriginHalf-1, nChainLengthCunningham1, fFirstEulerPassed1, nFirstEulerLength1);
+        unsigned int nChainLengthCunningham2Extended = ExtendCunninghamChainDown(bnPrimeChainOriginHalf+1, nChainLengthCunningham2, fFirstEulerPassed2, nFirstEulerLength2);
+        unsigned int nChainLengthBiTwinExtended = BiTwinChainLength(nChainLengthCunningham1Extended, nChainLengthCunningham2Extended);
+        if (nChainLengthCunningham1Extended >= nBits || nChainLengthCunningham2Extended >= nBits || nChainLengthBiTwinExtended >= nBits)
         { // try extending down the primechain with a halved multiplier
             if (nChainLengthCunningham1Extended > nChainLength || nChainLengthCunningham2Extended > nChainLength || nChainLengthBiTwinExtended > nChainLength)
                 return error("CheckPrimeProofOfWork() : prime certificate not normalzied target=%s length=(%s %s %s) extend=(%s %s %s)",
@@ -437,6 +770,58 @@ bool CheckPrimeProofOfWorkV02Compatibility(uint256 hashBlockHeader)
     return (FermatProbablePrimalityTest(CBigNum(hashBlockHeader), nLength));
 }
 
+CPrimeProofOfWorkCache::CPrimeProofOfWorkCache()
+{
+    // DoS prevention: limit cache size to a few MB
+    // (~100 bytes per cache entry times 100,000 entries)
+    nMaxCacheSize = GetArg("-maxpowcachesize", 100000);
+}
+
+uint256 CPrimeProofOfWorkCache::GetKey(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier)
+{
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << hashBlockHeader << nBits << bnPrimeChainMultiplier;
+    return ss.GetHash();
+}
+
+bool CPrimeProofOfWorkCache::Get(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength)
+{
+    uint256 hashKey = GetKey(hashBlockHeader, nBits, bnPrimeChainMultiplier);
+    boost::shared_lock<boost::shared_mutex> lock(cs_powcache);
+
+    std::map<uint256, std::pair<unsigned int, unsigned int> >::const_iterator mi = mapValid.find(hashKey);
+    if (mi == mapValid.end())
+        return false;
+    nChainType = mi->second.first;
+    nChainLength = mi->second.second;
+    return true;
+}
+
+void CPrimeProofOfWorkCache::Set(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int nChainType, unsigned int nChainLength)
+{
+    if (nMaxCacheSize <= 0) return;
+
+    uint256 hashKey = GetKey(hashBlockHeader, nBits, bnPrimeChainMultiplier);
+    boost::unique_lock<boost::shared_mutex> lock(cs_powcache);
+
+    while (static_cast<int64>(mapValid.size()) >= nMaxCacheSize)
+    {
+        // Evict a random entry, as the signature cache does
+        std::map<uint256, std::pair<unsigned int, unsigned int> >::iterator it = mapValid.lower_bound(GetRandHash());
+        if (it == mapValid.end())
+            it = mapValid.begin();
+        mapValid.erase(it);
+    }
+
+    mapValid[hashKey] = std::make_pair(nChainType, nChainLength);
+}
+
+unsigned int CPrimeProofOfWorkCache::size()
+{
+    boost::shared_lock<boost::shared_mutex> lock(cs_powcache);
+    return mapValid.size();
+}
+
 // prime target difficulty value for visualization
 double GetPrimeDifficulty(unsigned int nBits)
 {
@@ -470,35 +855,86 @@ unsigned int EstimateWorkTransition(unsigned int nPrevWorkTransition, unsigned i
 // Return value:
 //   true - Probable prime chain found (nChainLength meeting target)
 //   false - prime chain too short (nChainLength not meeting target)
-static bool ProbablePrimeChainTestForMiner(const CBigNum& bnPrimeChainOrigin, unsigned int nBits, unsigned nCandidateType, unsigned int& nChainLength)
+bool ProbablePrimeChainTestForMiner(const CBigNum& bnPrimeChainOrigin, unsigned int nBits, unsigned nCandidateType, bool fAbortShort, unsigned int& nChainLength)
 {
     nChainLength = 0;
 
     // Test for Cunningham Chain of first kind
     if (nCandidateType == PRIME_CHAIN_CUNNINGHAM1)
-        ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, nChainLength);
+        ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, 0, nChainLength);
     // Test for Cunningham Chain of second kind
     else if (nCandidateType == PRIME_CHAIN_CUNNINGHAM2)
-        ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, nChainLength);
+        ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, 0, nChainLength);
     else
     {
         unsigned int nChainLengthCunningham1 = 0;
-        unsigned int nChainLengthCunningham2 = 0;
-        if (ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, nChainLengthCunningham1))
-        {
-            ProbableCunninghamChainTest(bnPrimeChainOrigin+1, false, false, nChainLengthCunningham2);
-            // Figure out BiTwin Chain length
-            // BiTwin Chain allows a single prime at the end for odd length chain
-            nChainLength =
-                (TargetGetLength(nChainLengthCunningham1) > TargetGetLength(nChainLengthCunningham2))?
-                    (nChainLengthCunningham2 + TargetFromInt(TargetGetLength(nChainLengthCunningham2)+1)) :
-                    (nChainLengthCunningham1 + TargetFromInt(TargetGetLength(nChainLengthCunningham1)));
-        }
+        if (ProbableCunninghamChainTest(bnPrimeChainOrigin-1, true, false, 0, nChainLengthCunningham1))
+            BiTwinChainTestForMiner(bnPrimeChainOrigin, nBits, fAbortShort, nChainLengthCunningham1, nChainLength);
     }
 
     return (nChainLength >= nBits);
 }
 
+// Test probable prime chains for a batch of sieve candidates (miner version)
+// The first numbers of the chains are Fermat tested nFermatBatchSize at a
+// time in lockstep; only the chains they start are followed up one by one.
+// vChainLength receives what ProbablePrimeChainTestForMiner() reports for
+// each candidate.
+void ProbablePrimeChainTestBatchForMiner(const std::vector<CBigNum>& vPrimeChainOrigins, const std::vector<unsigned int>& vCandidateTypes, unsigned int nBits, bool fAbortShort, std::vector<unsigned int>& vChainLength)
+{
+    unsigned int nCount = vPrimeChainOrigins.size();
+    vChainLength.assign(nCount, 0);
+
+    CFermatEngine vEngines[nFermatBatchSize];
+    unsigned int vCandidate[nFermatBatchSize];
+    CBigNum vbnFirst[nFermatBatchSize];
+    bool vfProbablePrime[nFermatBatchSize];
+    unsigned int vnFractionalLength[nFermatBatchSize];
+    unsigned int i = 0;
+    while (i < nCount)
+    {
+        // Fill a batch with the first numbers of the chains to test
+        unsigned int nLanes = 0;
+        for (; i < nCount && nLanes < nFermatBatchSize; i++)
+        {
+            bool fSophieGermain = (vCandidateTypes[i] != PRIME_CHAIN_CUNNINGHAM2);
+            vbnFirst[nLanes] = vPrimeChainOrigins[i] + (fSophieGermain? (-1) : 1);
+            if (!vEngines[nLanes].SetModulus(vbnFirst[nLanes]))
+            {
+                ProbablePrimeChainTestForMiner(vPrimeChainOrigins[i], nBits, vCandidateTypes[i], fAbortShort, vChainLength[i]);
+                continue;
+            }
+            vCandidate[nLanes++] = i;
+        }
+        CFermatEngine::FermatTestBatch(vEngines, nLanes, vfProbablePrime, vnFractionalLength);
+
+        for (unsigned int k = 0; k < nLanes; k++)
+        {
+            CountPrimalityTest(vfProbablePrime[k]);
+            unsigned int nCandidate = vCandidate[k];
+            unsigned int nCandidateType = vCandidateTypes[nCandidate];
+            unsigned int& nChainLength = vChainLength[nCandidate];
+            if (!vfProbablePrime[k])
+            {
+                // A failed bi-twin chain reports no fractional length
+                if (nCandidateType != PRIME_CHAIN_BI_TWIN)
+                    nChainLength = vnFractionalLength[k];
+                continue;
+            }
+            if (nCandidateType == PRIME_CHAIN_CUNNINGHAM1)
+                ProbableCunninghamChainExtend(vbnFirst[k], &vEngines[k], true, false, 0, nChainLength);
+            else if (nCandidateType == PRIME_CHAIN_CUNNINGHAM2)
+                ProbableCunninghamChainExtend(vbnFirst[k], &vEngines[k], false, false, 0, nChainLength);
+            else
+            {
+                unsigned int nChainLengthCunningham1 = 0;
+                if (ProbableCunninghamChainExtend(vbnFirst[k], &vEngines[k], true, false, 0, nChainLengthCunningham1))
+                    BiTwinChainTestForMiner(vPrimeChainOrigins[nCandidate], nBits, fAbortShort, nChainLengthCunningham1, nChainLength);
+            }
+        }
+    }
+}
+
 // Perform Fermat test with trial division
 // Return values:
 //   true  - passes trial division test and Fermat test; probable prime
@@ -506,13 +942,8 @@ static bool ProbablePrimeChainTestForMiner(const CBigNum& bnPrimeChainOrigin, un
 bool ProbablePrimalityTestWithTrialDivision(const CBigNum& bnCandidate, unsigned int nTrialDivisionLimit)
 {
     // Trial division
-    BOOST_FOREACH(unsigned int nPrime, vPrimes)
-    {
-        if (nPrime >= nTrialDivisionLimit)
-            break;
-        if (bnCandidate % nPrime == 0)
-            return false; // failed trial division test
-    }
+    if (!TrialDivisionTest(bnCandidate, nTrialDivisionLimit))
+        return false; // failed trial division test
     unsigned int nLength = 0;
     return (FermatProbablePrimalityTest(bnCandidate, nLength));
 }
@@ -521,6 +952,58 @@ bool ProbablePrimalityTestWithTrialDivision(const CBigNum& bnCandidate, unsigned
 boost::thread_specific_ptr<CSieveOfEratosthenes> psieve;
 boost::thread_specific_ptr<CPrimeMiner> pminer;
 
+// Primes weaved segment by segment between checks for a new block and the
+// round time limit
+static const unsigned int nSieveWeaveBatch = 2000;
+
+// Build the sieve for mining block with the fixed multiplier
+// The sieve is weaved up to the optimal depth tuned by the calling thread's
+// pminer, which must be set up
+CSieveOfEratosthenes* MineBuildSieve(const CBlock& block, CBigNum& bnFixedMultiplier)
+{
+    int64 nStart, nCurrent; // microsecond timer
+    CBlockIndex* pindexPrev = pindexBest;
+    unsigned int nSieveExtensions = (unsigned int)std::max(0, std::min((int)nSieveExtensionsMax, (int)GetArg("-gensieveextensions", 0)));
+    CSieveOfEratosthenes* psieveNew = new CSieveOfEratosthenes(pminer->nSieveSize, block.nBits, block.GetHeaderHash(), bnFixedMultiplier, nSieveExtensions);
+    int64 nSieveRoundLimit = (int)GetArg("-gensieveroundlimitms", 1000);
+    nStart = GetTimeMicros();
+    unsigned int nWeaveTimes = 0;
+    unsigned int nSieveSegmentSize = (unsigned int)GetArg("-gensievesegmentkb", 16) * 1024 * 8 / (4 + 2 * nSieveExtensions); // four bitmap layers and the extensions
+    if (nSieveSegmentSize > 0)
+    {
+        // Weave a batch of primes at a time, to give up on a stale or slow
+        // sieve between batches as Weave() does between primes
+        while (nWeaveTimes < pminer->nSieveWeaveOptimal && pindexPrev == pindexBest && (GetTimeMicros() - nStart < 1000 * nSieveRoundLimit))
+        {
+            unsigned int nWeaved = psieveNew->WeaveSegmented(std::min(nSieveWeaveBatch, pminer->nSieveWeaveOptimal - nWeaveTimes), nSieveSegmentSize);
+            if (nWeaved == 0)
+                break; // sieve has been completed
+            nWeaveTimes += nWeaved;
+        }
+    }
+    else
+        while (psieveNew->Weave() && pindexPrev == pindexBest && (GetTimeMicros() - nStart < 1000 * nSieveRoundLimit) && (++nWeaveTimes < pminer->nSieveWeaveOptimal));
+    nCurrent = GetTimeMicros();
+    int64 nSieveWeaveCost = (nCurrent - nStart) / std::max(nWeaveTimes, 1u); // average weave cost in us
+    unsigned int nCandidateCount = psieveNew->GetCandidateCount();
+    psieveNew->Weave(); // weave once more to find out about weave efficiency
+    unsigned int nSieveWeaveComposites = nCandidateCount;
+    nCandidateCount = psieveNew->GetCandidateCount();
+    nSieveWeaveComposites = nCandidateCount - nSieveWeaveComposites; // number of composite chains found in last weave
+    if (fDebug && GetBoolArg("-printmining"))
+        printf("MineBuildSieve() : new sieve (%u/%u@%u/%u) ready in %uus test cost=%uus\n",
+            nCandidateCount, pminer->nSieveSize,
+            (nWeaveTimes < vPrimes.size())? vPrimes[nWeaveTimes] : nPrimeTableLimit, pminer->GetSieveWeaveOptimalPrime(),
+            (unsigned int) (nCurrent - nStart), (unsigned int)pminer->GetPrimalityTestCost());
+    if (pminingcounters.get())
+        pminingcounters->AddSieve(nCurrent - nStart, nWeaveTimes, nCandidateCount);
+    pminer->TimerSetSieveReady(nCandidateCount, nCurrent);
+    pminer->SetSieveWeaveCount(nWeaveTimes);
+    pminer->SetSieveWeaveCost(nSieveWeaveCost, nSieveWeaveComposites);
+    pminer->AdjustSieveWeaveOptimal();
+    return psieveNew;
+}
+
 // Mine probable prime chain of form: n = h * p# +/- 1
 bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNewBlock, unsigned int& nTriedMultiplier, unsigned int& nProbableChainLength, unsigned int& nTests, unsigned int& nPrimesHit)
 {
@@ -538,41 +1021,50 @@ bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNe
     int64 nStart, nCurrent; // microsecond timer
     CBlockIndex* pindexPrev = pindexBest;
     if (psieve.get() == NULL)
-    {
-        // Build sieve
-        psieve.reset(new CSieveOfEratosthenes(nMaxSieveSize, block.nBits, block.GetHeaderHash(), bnFixedMultiplier));
-        int64 nSieveRoundLimit = (int)GetArg("-gensieveroundlimitms", 1000);
-        nStart = GetTimeMicros();
-        unsigned int nWeaveTimes = 0;
-        while (psieve->Weave() && pindexPrev == pindexBest && (GetTimeMicros() - nStart < 1000 * nSieveRoundLimit) && (++nWeaveTimes < pminer->nSieveWeaveOptimal));
-        nCurrent = GetTimeMicros();
-        int64 nSieveWeaveCost = (nCurrent - nStart) / std::max(nWeaveTimes, 1u); // average weave cost in us
-        unsigned int nCandidateCount = psieve->GetCandidateCount();
-        psieve->Weave(); // weave once more to find out about weave efficiency
-        unsigned int nSieveWeaveComposites = nCandidateCount;
-        nCandidateCount = psieve->GetCandidateCount();
-        nSieveWeaveComposites = nCandidateCount - nSieveWeaveComposites; // number of composite chains found in last weave
-        if (fDebug && GetBoolArg("-printmining"))
-            printf("MineProbablePrimeChain() : new sieve (%u/%u@%u/%u) ready in %uus test cost=%uus\n",
-                nCandidateCount, nMaxSieveSize,
-                (nWeaveTimes < vPrimes.size())? vPrimes[nWeaveTimes] : nPrimeTableLimit, pminer->GetSieveWeaveOptimalPrime(),
-                (unsigned int) (nCurrent - nStart), (unsigned int)pminer->GetPrimalityTestCost());
-        pminer->TimerSetSieveReady(nCandidateCount, nCurrent);
-        pminer->SetSieveWeaveCount(nWeaveTimes);
-        pminer->SetSieveWeaveCost(nSieveWeaveCost, nSieveWeaveComposites);
-        pminer->AdjustSieveWeaveOptimal();
-    }
-
-    CBigNum bnChainOrigin;
+        psieve.reset(MineBuildSieve(block, bnFixedMultiplier));
+
+    CBigNum bnFixedFactor = CBigNum(block.GetHeaderHash()) * bnFixedMultiplier;
+    std::vector<CBigNum> vChainOrigins;
+    std::vector<unsigned int> vTriedMultipliers, vCandidateTypes, vChainLength;
 
     nStart = GetTimeMicros();
     nCurrent = nStart;
 
     while (nCurrent - nStart < 10000 && nCurrent >= nStart && pindexPrev == pindexBest)
     {
-        nTests++;
+        // Take a batch of candidates off the sieve
+        vChainOrigins.clear();
+        vTriedMultipliers.clear();
+        vCandidateTypes.clear();
         unsigned int nCandidateType;
-        if (!psieve->GetNextCandidateMultiplier(nTriedMultiplier, nCandidateType))
+        while (vChainOrigins.size() < nFermatBatchSize && psieve->GetNextCandidateMultiplier(nTriedMultiplier, nCandidateType))
+        {
+            vChainOrigins.push_back(bnFixedFactor * nTriedMultiplier);
+            vTriedMultipliers.push_back(nTriedMultiplier);
+            vCandidateTypes.push_back(nCandidateType);
+        }
+
+        int64 nTestStart = GetTimeMicros();
+        ProbablePrimeChainTestBatchForMiner(vChainOrigins, vCandidateTypes, block.nBits, true, vChainLength);
+        if (pminingcounters.get())
+            pminingcounters->AddChainTests(GetTimeMicros() - nTestStart, block.nBits, EstimateCandidatePrimeProbability(), vChainLength);
+        for (unsigned int i = 0; i < vChainOrigins.size(); i++)
+        {
+            nTests++;
+            nTriedMultiplier = vTriedMultipliers[i];
+            nProbableChainLength = vChainLength[i];
+            if (nProbableChainLength >= block.nBits)
+            {
+                block.bnPrimeChainMultiplier = bnFixedMultiplier * nTriedMultiplier;
+                printf("Probable prime chain found for block=%s!!\n  Target: %s\n  Chain: %s\n", block.GetHash().GetHex().c_str(),
+                    TargetToString(block.nBits).c_str(), GetPrimeChainName(vCandidateTypes[i], nProbableChainLength).c_str());
+                return true;
+            }
+            if(TargetGetLength(nProbableChainLength) >= 1)
+                nPrimesHit++;
+        }
+
+        if (vChainOrigins.size() < nFermatBatchSize)
         {
             // power tests completed for the sieve
             pminer->TimerSetPrimalityDone(nCurrent);
@@ -580,25 +1072,133 @@ bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNe
             fNewBlock = true; // notify caller to change nonce
             return false;
         }
-        bnChainOrigin = CBigNum(block.GetHeaderHash()) * bnFixedMultiplier * nTriedMultiplier;
-        unsigned int nChainLength = 0;
-        if (ProbablePrimeChainTestForMiner(bnChainOrigin, block.nBits, nCandidateType, nChainLength))
-        {
-            block.bnPrimeChainMultiplier = bnFixedMultiplier * nTriedMultiplier;
-            printf("Probable prime chain found for block=%s!!\n  Target: %s\n  Chain: %s\n", block.GetHash().GetHex().c_str(),
-                TargetToString(block.nBits).c_str(), GetPrimeChainName(nCandidateType, nChainLength).c_str());
-            nProbableChainLength = nChainLength;
-            return true;
-        }
-        nProbableChainLength = nChainLength;
-        if(TargetGetLength(nProbableChainLength) >= 1)
-            nPrimesHit++;
 
         nCurrent = GetTimeMicros();
     }
     return false; // stop as timed out
 }
 
+// Scan for the next candidate multiplier (variable part)
+// Return values:
+//   True - found next candidate; nVariableMultiplier has the candidate
+//   False - scan complete, no more candidate and reset scan
+bool CSieveOfEratosthenes::GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType)
+{
+    nCandidateMultiplier++;
+    unsigned int nWord = nCandidateMultiplier >> 6;
+    uint64 nCandidates = 0;
+    if (nCandidateMultiplier < nSieveSize)
+        nCandidates = GetCandidateWord(nWord) & (~0llu << (nCandidateMultiplier & 63));
+    while (nCandidates == 0)
+    {
+        if (++nWord >= nWords)
+        {
+            nCandidateMultiplier = 0;
+            return false;
+        }
+        nCandidates = GetCandidateWord(nWord);
+    }
+    nCandidateMultiplier = (nWord << 6) + __builtin_ctzll(nCandidates);
+    nVariableMultiplier = nCandidateMultiplier;
+
+    // Bi-twin takes precedence, then Cunningham chain of first kind
+    uint64 nBit = (1llu << (nCandidateMultiplier & 63));
+    if (!((vfCompositeCunningham1Head[nWord] | vfCompositeCunningham2Head[nWord]) & nBit))
+        nCandidateType = PRIME_CHAIN_BI_TWIN;
+    else if (!((vfCompositeCunningham1Head[nWord] | vfCompositeCunningham1Tail[nWord]) & nBit))
+        nCandidateType = PRIME_CHAIN_CUNNINGHAM1;
+    else
+        nCandidateType = PRIME_CHAIN_CUNNINGHAM2;
+    return true;
+}
+
+unsigned int CSieveOfEratosthenes::GetCandidateMaxLength(unsigned int nVariableMultiplier, unsigned int nCandidateType)
+{
+    unsigned int nChainLength = TargetGetLength(nBits);
+    unsigned int nMaxLength = nChainLength;
+    // Next chain number in the interleaved chain: the next one for a bi-twin
+    // chain, every other one for a Cunningham chain
+    unsigned int nBiTwinSeq = 2 * nChainLength;
+    unsigned int nStep = 2;
+    if (nCandidateType == PRIME_CHAIN_BI_TWIN)
+    {
+        nBiTwinSeq = nChainLength;
+        nStep = 1;
+    }
+    else if (nCandidateType == PRIME_CHAIN_CUNNINGHAM2)
+        nBiTwinSeq++;
+    uint64 nBit = (1llu << (nVariableMultiplier & 63));
+    while (nMaxLength < nChainLength + nExtensions && !(GetCompositeLayer(nBiTwinSeq)[nVariableMultiplier >> 6] & nBit))
+    {
+        nMaxLength++;
+        nBiTwinSeq += nStep;
+    }
+    return nMaxLength;
+}
+
+// Reduce the fixed factor modulo the primes in table up to nPrimeSeqEnd
+// Each remainder costs one 64-bit division per limb of the fixed factor
+// instead of a bignum division.
+void CSieveOfEratosthenes::ReduceFixedFactor(unsigned int nPrimeSeqEnd)
+{
+    nPrimeSeqEnd = std::min(nPrimeSeqEnd, (unsigned int)vPrimes.size());
+    unsigned int nPrimeSeqBegin = vFixedFactorMod.size();
+    if (nPrimeSeqEnd <= nPrimeSeqBegin)
+        return;
+    vFixedFactorMod.resize(nPrimeSeqEnd);
+    ReduceModPrimes(vFixedFactorLimbs, nPrimeSeqBegin, nPrimeSeqEnd, &vFixedFactorMod[nPrimeSeqBegin]);
+}
+
+// Modular inverse of a (0 < a < p) for prime p via extended Euclid
+static unsigned int ModularInverse(unsigned int a, unsigned int p)
+{
+    int64 t = 0, tNext = 1;
+    int64 r = p, rNext = a;
+    while (rNext != 0)
+    {
+        int64 q = r / rNext;
+        int64 tTemp = t - q * tNext; t = tNext; tNext = tTemp;
+        int64 rTemp = r - q * rNext; r = rNext; rNext = rTemp;
+    }
+    if (r != 1)
+        return 0; // not invertible
+    return (unsigned int)((t < 0)? t + p : t);
+}
+
+// Find the first multiplier of each number in the chain divisible by a prime
+// Return values:
+//   True  - vSolvedMultiplier has 2 * chain length multipliers in bi-twin
+//           order; empty if nothing in the sieve is divisible by the prime
+//   False - modular inverse failed
+bool CSieveOfEratosthenes::SolveMultipliers(unsigned int nPrimeSeq, std::vector<unsigned int>& vSolvedMultiplier)
+{
+    vSolvedMultiplier.clear();
+    if (nPrimeSeq >= vFixedFactorMod.size())
+        ReduceFixedFactor(nPrimeSeq + 1024);
+    uint64 nPrime = vPrimes[nPrimeSeq];
+    unsigned int nFixedFactorMod = vFixedFactorMod[nPrimeSeq];
+    if (nFixedFactorMod == 0)
+        return true; // nothing in the sieve is divisible by this prime
+    // Find the modulo inverse of fixed factor
+    uint64 nFixedInverse = ModularInverse(nFixedFactorMod, nPrime);
+    if (nFixedInverse == 0)
+        return error("CSieveOfEratosthenes::SolveMultipliers(): modular inverse of fixed factor failed for prime #%u=%u", nPrimeSeq, vPrimes[nPrimeSeq]);
+    uint64 nTwoInverse = vTwoInverses[nPrimeSeq];
+    if (nTwoInverse == 0)
+        return error("CSieveOfEratosthenes::SolveMultipliers(): modular inverse of 2 failed for prime #%u=%u", nPrimeSeq, vPrimes[nPrimeSeq]);
+
+    unsigned int nChainLength = TargetGetLength(nBits) + nExtensions;
+    for (unsigned int nChainSeq = 0; nChainSeq < nChainLength; nChainSeq++)
+    {
+        // Number in chain of first kind is divisible at fixed inverse,
+        // number in chain of second kind at its negation
+        vSolvedMultiplier.push_back((unsigned int)nFixedInverse);
+        vSolvedMultiplier.push_back((unsigned int)(nPrime - nFixedInverse));
+        nFixedInverse = (nFixedInverse * nTwoInverse) % nPrime; // for next number in chain
+    }
+    return true;
+}
+
 // Weave sieve for the next prime in table
 // Return values:
 //   True  - weaved another prime
@@ -607,48 +1207,81 @@ bool CSieveOfEratosthenes::Weave()
 {
     if (nPrimeSeq >= vPrimes.size() || vPrimes[nPrimeSeq] >= nSieveSize)
         return false;  // sieve has been completed
-    CBigNum p = vPrimes[nPrimeSeq];
-    if (bnFixedFactor % p == 0)
-    {
-        // Nothing in the sieve is divisible by this prime
-        nPrimeSeq++;
-        return true;
-    }
-    // Find the modulo inverse of fixed factor
-    CAutoBN_CTX pctx;
-    CBigNum bnFixedInverse;
-    if (!BN_mod_inverse(&bnFixedInverse, &bnFixedFactor, &p, pctx))
-        return error("CSieveOfEratosthenes::Weave(): BN_mod_inverse of fixed factor failed for prime #%u=%u", nPrimeSeq, vPrimes[nPrimeSeq]);
-    CBigNum bnTwo = 2;
-    CBigNum bnTwoInverse;
-    if (!BN_mod_inverse(&bnTwoInverse, &bnTwo, &p, pctx))
-        return error("CSieveOfEratosthenes::Weave(): BN_mod_inverse of 2 failed for prime #%u=%u", nPrimeSeq, vPrimes[nPrimeSeq]);
+    std::vector<unsigned int> vSolvedMultiplier;
+    if (!SolveMultipliers(nPrimeSeq, vSolvedMultiplier))
+        return false;
 
     // Weave the sieve for the prime
-    unsigned int nChainLength = TargetGetLength(nBits);
-    for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < 2 * nChainLength; nBiTwinSeq++)
+    unsigned int nPrime = vPrimes[nPrimeSeq];
+    for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < vSolvedMultiplier.size(); nBiTwinSeq++)
     {
-        // Find the first number that's divisible by this prime
-        int nDelta = ((nBiTwinSeq % 2 == 0)? (-1) : 1);
-        unsigned int nSolvedMultiplier = ((bnFixedInverse * (p - nDelta)) % p).getuint();
-        if (nBiTwinSeq % 2 == 1)
-            bnFixedInverse *= bnTwoInverse; // for next number in chain
-
-        unsigned int nPrime = vPrimes[nPrimeSeq];
-        if (nBiTwinSeq < nChainLength)
-            for (unsigned int nVariableMultiplier = nSolvedMultiplier; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
-                vfCompositeBiTwin[nVariableMultiplier] = true;
-        if (((nBiTwinSeq & 1u) == 0))
-            for (unsigned int nVariableMultiplier = nSolvedMultiplier; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
-                vfCompositeCunningham1[nVariableMultiplier] = true;
-        if (((nBiTwinSeq & 1u) == 1u))
-            for (unsigned int nVariableMultiplier = nSolvedMultiplier; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
-                vfCompositeCunningham2[nVariableMultiplier] = true;
+        std::vector<uint64>& vfComposite = GetCompositeLayer(nBiTwinSeq);
+        for (unsigned int nVariableMultiplier = vSolvedMultiplier[nBiTwinSeq]; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
+            vfComposite[nVariableMultiplier >> 6] |= (1llu << (nVariableMultiplier & 63));
     }
     nPrimeSeq++;
     return true;
 }
 
+// Weave the sieve for the next nWeavePrimes primes in table, segment by segment
+// Primes below the segment size are weaved through every segment while it is
+// in cache, keeping the next multiplier of each chain number between segments.
+// Larger primes hit a segment at most once per chain number and are weaved
+// directly. The resulting bitmaps are identical to calling Weave() as often.
+// Return value: number of primes weaved
+unsigned int CSieveOfEratosthenes::WeaveSegmented(unsigned int nWeavePrimes, unsigned int nSegmentSize)
+{
+    nSegmentSize = std::max(64u, nSegmentSize & ~63u); // whole words per segment
+    std::vector<unsigned int> vSegmentPrime; // primes weaved segment by segment
+    std::vector<unsigned int> vNextMultiplier; // next multiplier per prime and chain number
+    std::vector<unsigned int> vSolvedMultiplier;
+    unsigned int nLayers = GetLayerCount();
+    unsigned int nWeaved = 0;
+    ReduceFixedFactor(nPrimeSeq + nWeavePrimes);
+    for (; nWeaved < nWeavePrimes; nWeaved++)
+    {
+        if (nPrimeSeq >= vPrimes.size() || vPrimes[nPrimeSeq] >= nSieveSize)
+            break;  // sieve has been completed
+        if (!SolveMultipliers(nPrimeSeq, vSolvedMultiplier))
+            break;
+        unsigned int nPrime = vPrimes[nPrimeSeq];
+        if (!vSolvedMultiplier.empty() && nPrime < nSegmentSize)
+        {
+            vSegmentPrime.push_back(nPrime);
+            vNextMultiplier.insert(vNextMultiplier.end(), vSolvedMultiplier.begin(), vSolvedMultiplier.end());
+        }
+        else
+        {
+            for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < vSolvedMultiplier.size(); nBiTwinSeq++)
+            {
+                std::vector<uint64>& vfComposite = GetCompositeLayer(nBiTwinSeq);
+                for (unsigned int nVariableMultiplier = vSolvedMultiplier[nBiTwinSeq]; nVariableMultiplier < nSieveSize; nVariableMultiplier += nPrime)
+                    vfComposite[nVariableMultiplier >> 6] |= (1llu << (nVariableMultiplier & 63));
+            }
+        }
+        nPrimeSeq++;
+    }
+
+    for (unsigned int nSegmentStart = 0; nSegmentStart < nSieveSize; nSegmentStart += nSegmentSize)
+    {
+        unsigned int nSegmentEnd = std::min(nSegmentStart + nSegmentSize, nSieveSize);
+        for (unsigned int nBiTwinSeq = 0; nBiTwinSeq < nLayers; nBiTwinSeq++)
+        {
+            std::vector<uint64>& vfComposite = GetCompositeLayer(nBiTwinSeq);
+            for (unsigned int i = 0; i < vSegmentPrime.size(); i++)
+            {
+                unsigned int nPrime = vSegmentPrime[i];
+                unsigned int& nNextMultiplier = vNextMultiplier[i * nLayers + nBiTwinSeq];
+                unsigned int nVariableMultiplier = nNextMultiplier;
+                for (; nVariableMultiplier < nSegmentEnd; nVariableMultiplier += nPrime)
+                    vfComposite[nVariableMultiplier >> 6] |= (1llu << (nVariableMultiplier & 63));
+                nNextMultiplier = nVariableMultiplier;
+            }
+        }
+    }
+    return nWeaved;
+}
+
 // Estimate the probability of primality for a number in a candidate chain
 double EstimateCandidatePrimeProbability()
 {
@@ -668,11 +1301,15 @@ double EstimateCandidatePrimeProbability()
     // true, but nontheless it's a reasonable model of the chances of finding
     // prime chains.
     unsigned int nSieveWeaveOptimalPrime = pminer->GetSieveWeaveOptimalPrime();
-    unsigned int nAverageCandidateMultiplier = nMaxSieveSize / 2;
+    unsigned int nAverageCandidateMultiplier = pminer->nSieveSize / 2;
     unsigned int nPrimorialMultiplier = pminer->nPrimorialMultiplier;
     double dFixedMultiplier = 1.0;
-    for (unsigned int i = 0; vPrimes[i] <= nPrimorialMultiplier; i++)
-        dFixedMultiplier *= vPrimes[i];
+    unsigned int nIndex = SmallPrimorialIndex(nPrimorialMultiplier);
+    if (nIndex < nSmallPrimorials)
+        dFixedMultiplier = (double)vSmallPrimorials[nIndex];
+    else
+        for (unsigned int i = 0; vPrimes[i] <= nPrimorialMultiplier; i++)
+            dFixedMultiplier *= vPrimes[i];
     return (1.781072 * log((double)std::max(1u, nSieveWeaveOptimalPrime)) / (255.0 * log(2.0) + log(1.5) + log(dFixedMultiplier) + log(nAverageCandidateMultiplier)));
 }
 
@@ -695,3 +1332,188 @@ void CPrimeMiner::AdjustSieveWeaveOptimal()
         nSieveWeaveOptimal = std::min(nSieveWeaveOptimal * 100 / 95, (unsigned int) vPrimes.size());
 }
 
+void CPrimeMiner::SetSieveSetting(unsigned int nSieveSettingNew, const CSieveSetting& setting)
+{
+    if (nSieveSettingNew == nSieveSetting)
+        return;
+    mapSieveWeaveOptimal[nSieveSetting] = nSieveWeaveOptimal;
+    nSieveSetting = nSieveSettingNew;
+    nSieveSize = setting.nSieveSize;
+    nPrimorialMultiplier = setting.nPrimorialMultiplier;
+    std::map<unsigned int, unsigned int>::const_iterator it = mapSieveWeaveOptimal.find(nSieveSetting);
+    nSieveWeaveOptimal = (it != mapSieveWeaveOptimal.end())? it->second : nSieveWeaveInitial;
+}
+
+// A measurement is complete once it has seen enough chains of length 2 for
+// their share to be meaningful, and has run long enough to even out rounds
+static const uint64 nTunerMinChainsTwo = 200;
+static const int64 nTunerMinTimeMicro = 30 * 1000000;
+// Most measurements of the best setting between trials once it settled
+static const unsigned int nTunerMaxExploit = 16;
+
+bool CSieveTuner::CTrial::IsComplete() const
+{
+    return (nChainsTwo >= nTunerMinChainsTwo && nTimeMicro >= nTunerMinTimeMicro);
+}
+
+// Estimated chains meeting target nBits per day of thread time
+double CSieveTuner::CTrial::GetChainsPerDay(unsigned int nBits) const
+{
+    if (nTimeMicro <= 0 || nChains == 0)
+        return 0.0;
+    double dTargetLength = (double) nBits / (1 << nFractionalBits);
+    double dChainsPerDay = (double) nChains * 86400000000.0 / nTimeMicro;
+    return dChainsPerDay * pow((double) nChainsTwo / nChains, dTargetLength - 1.0);
+}
+
+CSieveTuner::CSieveTuner(bool fEnabledIn)
+{
+    fEnabled = fEnabledIn;
+    // Setting 0 is the untuned default: largest sieve, smallest primorial
+    BOOST_FOREACH(unsigned int nPrimorialMultiplier, vPrimes)
+    {
+        if (nPrimorialMultiplier < nPrimorialMultiplierMin)
+            continue;
+        if (nPrimorialMultiplier > nPrimorialMultiplierMax)
+            break;
+        for (unsigned int nStep = nSieveSizeSteps; nStep > 0; nStep--)
+        {
+            CSieveSetting setting;
+            setting.nSieveSize = nMaxSieveSize / nSieveSizeSteps * nStep;
+            setting.nPrimorialMultiplier = nPrimorialMultiplier;
+            vSettings.push_back(setting);
+        }
+    }
+}
+
+// Neighbour of a setting on the grid
+// nDirection: 0 - smaller sieve, 1 - larger primorial, 2 - larger sieve, 3 - smaller primorial
+bool CSieveTuner::GetNeighbour(unsigned int nSetting, unsigned int nDirection, unsigned int& nNeighbour) const
+{
+    unsigned int nStep = nSetting % nSieveSizeSteps;
+    unsigned int nPrimorialSeq = nSetting / nSieveSizeSteps;
+    if (nDirection == 0 && nStep + 1 < nSieveSizeSteps)
+        nStep++;
+    else if (nDirection == 1 && nSetting + nSieveSizeSteps < vSettings.size())
+        nPrimorialSeq++;
+    else if (nDirection == 2 && nStep > 0)
+        nStep--;
+    else if (nDirection == 3 && nPrimorialSeq > 0)
+        nPrimorialSeq--;
+    else
+        return false;
+    nNeighbour = nPrimorialSeq * nSieveSizeSteps + nStep;
+    return true;
+}
+
+// Measure the next neighbour of the best setting
+void CSieveTuner::NextTrial(unsigned int nBits, CTuning& tuning)
+{
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        unsigned int nDirection = tuning.nDirection;
+        tuning.nDirection = (tuning.nDirection + 1) % 4;
+        if (GetNeighbour(tuning.nBest, nDirection, tuning.nTrial))
+        {
+            tuning.vTrials[tuning.nTrial].SetNull();
+            return;
+        }
+        tuning.nFailures++;
+    }
+    tuning.nTrial = tuning.nBest;
+}
+
+unsigned int CSieveTuner::GetSetting(unsigned int nBits, CSieveSetting& setting)
+{
+    LOCK(cs);
+    unsigned int nSetting = 0;
+    if (fEnabled)
+    {
+        std::map<unsigned int, CTuning>::iterator it = mapTuning.find(TargetGetLength(nBits));
+        if (it == mapTuning.end())
+        {
+            CTuning tuning;
+            tuning.nBest = tuning.nTrial = 0;
+            tuning.nDirection = tuning.nFailures = 0;
+            tuning.nExploit = tuning.nExploitLeft = 0;
+            tuning.dBestChainsPerDay = 0.0;
+            tuning.vTrials.resize(vSettings.size());
+            it = mapTuning.insert(std::make_pair(TargetGetLength(nBits), tuning)).first;
+        }
+        nSetting = it->second.nTrial;
+    }
+    setting = vSettings[nSetting];
+    return nSetting;
+}
+
+void CSieveTuner::AddResults(unsigned int nBits, unsigned int nSetting, int64 nTimeMicro, const std::vector<unsigned int>& vChainLength)
+{
+    if (!fEnabled)
+        return;
+    LOCK(cs);
+    std::map<unsigned int, CTuning>::iterator it = mapTuning.find(TargetGetLength(nBits));
+    if (it == mapTuning.end())
+        return;
+    CTuning& tuning = it->second;
+    CTrial& trial = tuning.vTrials[nSetting];
+    trial.nTimeMicro += nTimeMicro;
+    BOOST_FOREACH(unsigned int nChainLength, vChainLength)
+    {
+        if (TargetGetLength(nChainLength) >= 1)
+            trial.nChains++;
+        if (TargetGetLength(nChainLength) >= 2)
+            trial.nChainsTwo++;
+        if (nChainLength >= nBits)
+            trial.nChainsTarget++;
+    }
+
+    // Results of rounds handed out before the last decision only add up
+    if (nSetting != tuning.nTrial || !trial.IsComplete())
+        return;
+    double dChainsPerDay = trial.GetChainsPerDay(nBits);
+    if (fDebug && GetBoolArg("-printmining"))
+        printf("CSieveTuner : target %s sieve size %u primorial %u# chains %"PRI64u"/%"PRI64u"/%"PRI64u" in %ds, %g chains/day\n",
+            TargetToString(nBits).c_str(), vSettings[nSetting].nSieveSize, vSettings[nSetting].nPrimorialMultiplier,
+            trial.nChains, trial.nChainsTwo, trial.nChainsTarget, (int) (trial.nTimeMicro / 1000000), dChainsPerDay);
+
+    if (tuning.nTrial == tuning.nBest)
+    {
+        // Fresh measurement of the best setting to hold trials against
+        tuning.dBestChainsPerDay = dChainsPerDay;
+        if (tuning.nExploitLeft > 0)
+        {
+            tuning.nExploitLeft--;
+            trial.SetNull();
+        }
+        else
+            NextTrial(nBits, tuning);
+        return;
+    }
+
+    if (dChainsPerDay > tuning.dBestChainsPerDay)
+    {
+        // Move over, and keep going in the same direction
+        tuning.nBest = tuning.nTrial;
+        tuning.dBestChainsPerDay = dChainsPerDay;
+        tuning.nDirection = (tuning.nDirection + 3) % 4;
+        tuning.nFailures = 0;
+        tuning.nExploit = 0;
+        printf("CSieveTuner : target %s now sieving %u with primorial %u#, %g chains/day\n",
+            TargetToString(nBits).c_str(), vSettings[tuning.nBest].nSieveSize, vSettings[tuning.nBest].nPrimorialMultiplier, dChainsPerDay);
+        NextTrial(nBits, tuning);
+        return;
+    }
+
+    // Back to the best setting; once no neighbour beats it, try them less often
+    if (++tuning.nFailures >= 4)
+    {
+        if (tuning.nExploit == 0)
+            printf("CSieveTuner : target %s settled on sieve size %u with primorial %u#, %g chains/day\n",
+                TargetToString(nBits).c_str(), vSettings[tuning.nBest].nSieveSize, vSettings[tuning.nBest].nPrimorialMultiplier, tuning.dBestChainsPerDay);
+        tuning.nFailures = 0;
+        tuning.nExploit = std::min(std::max(2 * tuning.nExploit, 1u), nTunerMaxExploit);
+    }
+    tuning.nExploitLeft = tuning.nExploit;
+    tuning.nTrial = tuning.nBest;
+    tuning.vTrials[tuning.nBest].SetNull();
+}
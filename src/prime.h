@@ -20,6 +20,14 @@ static const CBigNum bnPrimeMin = (bnOne << 255);
 extern unsigned int nTargetInitialLength;
 extern unsigned int nTargetMinLength;
 
+// Small prime table
+extern std::vector<unsigned int> vPrimes;
+// Inverse of 2 modulo each prime in table (0 for 2)
+extern std::vector<unsigned int> vTwoInverses;
+// 2^32 and 2^64 modulo each prime in table
+extern std::vector<unsigned int> vTwoPow32Mods;
+extern std::vector<unsigned int> vTwoPow64Mods;
+
 // Generate small prime table
 void GeneratePrimeTable();
 // Get next prime number of p
@@ -27,6 +35,15 @@ bool PrimeTableGetNextPrime(unsigned int& p);
 // Get previous prime number of p
 bool PrimeTableGetPreviousPrime(unsigned int& p);
 
+// Split a non-negative number into 64-bit limbs, most significant first
+void BigNumToLimbs(const CBigNum& bn, std::vector<uint64>& vLimbs);
+// Reduce a number given in 64-bit limbs, most significant first, modulo the
+// primes in table from nPrimeSeqBegin up to nPrimeSeqEnd; remainder of prime
+// #i goes to pRemainders[i - nPrimeSeqBegin]
+void ReduceModPrimes(const std::vector<uint64>& vLimbs, unsigned int nPrimeSeqBegin, unsigned int nPrimeSeqEnd, unsigned int* pRemainders);
+// Whether no prime in table below nTrialDivisionLimit divides bn
+bool TrialDivisionTest(const CBigNum& bn, unsigned int nTrialDivisionLimit);
+
 // Compute primorial number p#
 void Primorial(unsigned int p, CBigNum& bnPrimorial);
 // Compute the first primorial number greater than or equal to bn
@@ -70,6 +87,28 @@ enum // prime chain type
 bool CheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength);
 bool CheckPrimeProofOfWorkV02Compatibility(uint256 hashBlockHeader);
 
+// Valid prime proof-of-work cache, to avoid running the chain tests again
+// for a block seen before (resubmitted, downloaded from another peer,
+// reread by -reindex or checked again by -checklevel)
+class CPrimeProofOfWorkCache
+{
+private:
+    // Key is the hash of (header hash, target, multiplier); value is
+    // (chain type, chain length)
+    std::map<uint256, std::pair<unsigned int, unsigned int> > mapValid;
+    boost::shared_mutex cs_powcache;
+    int64 nMaxCacheSize; // -maxpowcachesize when the cache was created
+
+    static uint256 GetKey(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier);
+
+public:
+    CPrimeProofOfWorkCache();
+
+    bool Get(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength);
+    void Set(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int nChainType, unsigned int nChainLength);
+    unsigned int size();
+};
+
 // prime target difficulty value for visualization
 double GetPrimeDifficulty(unsigned int nBits);
 // Estimate work transition target to longer prime chain
@@ -84,6 +123,26 @@ std::string GetPrimeOriginPrimorialForm(CBigNum& bnPrimeChainOrigin);
 /* PRIMECOIN MINING */
 /********************/
 
+class CSieveOfEratosthenes;
+
+// Build and weave the sieve for mining block with the fixed multiplier
+// With -gensieveextensions=<n> the sieve goes on n chain numbers past the target
+CSieveOfEratosthenes* MineBuildSieve(const CBlock& block, CBigNum& bnFixedMultiplier);
+
+// Test probable prime chain for a sieve candidate of the given chain type
+// fAbortShort:
+//   true - the miner: a bi-twin chain is tested no further than it takes to
+//          decide against nBits, so below the target its length may be
+//          reported short of its actual length, if no shorter than 2
+//   false - report the full length, as ProbablePrimeChainTest() finds it
+// Return value:
+//   true - Probable prime chain found (nChainLength meeting target)
+//   false - prime chain too short (nChainLength not meeting target)
+bool ProbablePrimeChainTestForMiner(const CBigNum& bnPrimeChainOrigin, unsigned int nBits, unsigned nCandidateType, bool fAbortShort, unsigned int& nChainLength);
+// Test probable prime chains for a batch of sieve candidates of the given chain types
+// The chain lengths are set as ProbablePrimeChainTestForMiner() sets them
+void ProbablePrimeChainTestBatchForMiner(const std::vector<CBigNum>& vPrimeChainOrigins, const std::vector<unsigned int>& vCandidateTypes, unsigned int nBits, bool fAbortShort, std::vector<unsigned int>& vChainLength);
+
 // Mine probable prime chain of form: n = h * p# +/- 1
 bool MineProbablePrimeChain(CBlock& block, CBigNum& bnFixedMultiplier, bool& fNewBlock, unsigned int& nTriedMultiplier, unsigned int& nProbableChainLength, unsigned int& nTests, unsigned int& nPrimesHit);
 
@@ -97,46 +156,106 @@ bool ProbablePrimalityTestWithTrialDivision(const CBigNum& bnCandidate, unsigned
 double EstimateCandidatePrimeProbability();
 
 // Sieve of Eratosthenes for proof-of-work mining
+//
+// The composite bitmaps are packed 64 multipliers to a word. Each chain kind
+// is kept as two layers split at the bi-twin boundary: the head layer covers
+// the chain positions shared with the bi-twin chain, the tail layer the rest.
+// The Cunningham and bi-twin bitmaps are then derived a word at a time:
+//   Cunningham1 = Cunningham1Head | Cunningham1Tail
+//   Cunningham2 = Cunningham2Head | Cunningham2Tail
+//   BiTwin      = Cunningham1Head | Cunningham2Head
+// so the bi-twin chain costs no extra weaving.
+//
+// Optionally the sieve goes on for a few chain numbers past the target
+// length, one extension layer per chain number, interleaved as in the
+// bi-twin chain. These layers do not rule out candidates; they tell how far
+// past the target a candidate's chain is free of small factors, to test the
+// most promising candidates first.
 class CSieveOfEratosthenes
 {
     unsigned int nSieveSize; // size of the sieve
     unsigned int nBits; // target of the prime chain to search for
+    unsigned int nExtensions; // chain numbers sieved past the target length
     uint256 hashBlockHeader; // block header hash
     CBigNum bnFixedFactor; // fixed factor to derive the chain
+    std::vector<uint64> vFixedFactorLimbs; // fixed factor in 64-bit limbs, most significant first
+    std::vector<unsigned int> vFixedFactorMod; // fixed factor modulo each prime in table reduced so far
 
-    // bitmaps of the sieve, index represents the variable part of multiplier
-    std::vector<bool> vfCompositeCunningham1;
-    std::vector<bool> vfCompositeCunningham2;
-    std::vector<bool> vfCompositeBiTwin;
+    // packed bitmaps of the sieve, bit index represents the variable part of multiplier
+    unsigned int nWords; // number of 64-bit words in each layer
+    std::vector<uint64> vfCompositeCunningham1Head;
+    std::vector<uint64> vfCompositeCunningham1Tail;
+    std::vector<uint64> vfCompositeCunningham2Head;
+    std::vector<uint64> vfCompositeCunningham2Tail;
+    std::vector<std::vector<uint64> > vfCompositeExtension; // 2 * nExtensions layers
 
     unsigned int nPrimeSeq; // prime sequence number currently being processed
     unsigned int nCandidateMultiplier; // current candidate for power test
 
+    // Composite bitmap for the number at nBiTwinSeq of the interleaved chain
+    // (even: Cunningham chain of first kind, odd: second kind)
+    std::vector<uint64>& GetCompositeLayer(unsigned int nBiTwinSeq)
+    {
+        unsigned int nChainLength = TargetGetLength(nBits);
+        if (nBiTwinSeq >= 2 * nChainLength)
+            return vfCompositeExtension[nBiTwinSeq - 2 * nChainLength];
+        if (nBiTwinSeq & 1u)
+            return (nBiTwinSeq < nChainLength)? vfCompositeCunningham2Head : vfCompositeCunningham2Tail;
+        return (nBiTwinSeq < nChainLength)? vfCompositeCunningham1Head : vfCompositeCunningham1Tail;
+    }
+
+    // Number of composite bitmaps weaved, extension layers included
+    unsigned int GetLayerCount() const
+    {
+        return 2 * (TargetGetLength(nBits) + nExtensions);
+    }
+
+    void ReduceFixedFactor(unsigned int nPrimeSeqEnd);
+    bool SolveMultipliers(unsigned int nPrimeSeq, std::vector<unsigned int>& vSolvedMultiplier);
+
+    // Mask of the multipliers in word nWord that are inside the sieve
+    uint64 GetWordMask(unsigned int nWord) const
+    {
+        unsigned int nRemainder = nSieveSize - nWord * 64;
+        return (nRemainder >= 64)? ~0llu : ((1llu << nRemainder) - 1);
+    }
+
+    // Bitmap word of multipliers not yet known to be composite for all three chain kinds
+    uint64 GetCandidateWord(unsigned int nWord) const
+    {
+        uint64 nCunningham1Head = vfCompositeCunningham1Head[nWord];
+        uint64 nCunningham2Head = vfCompositeCunningham2Head[nWord];
+        uint64 nComposite = (nCunningham1Head | vfCompositeCunningham1Tail[nWord]) &
+                            (nCunningham2Head | vfCompositeCunningham2Tail[nWord]) &
+                            (nCunningham1Head | nCunningham2Head);
+        return (~nComposite & GetWordMask(nWord));
+    }
+
 public:
-    CSieveOfEratosthenes(unsigned int nSieveSize, unsigned int nBits, uint256 hashBlockHeader, CBigNum& bnFixedMultiplier)
+    CSieveOfEratosthenes(unsigned int nSieveSize, unsigned int nBits, uint256 hashBlockHeader, CBigNum& bnFixedMultiplier, unsigned int nExtensions = 0)
     {
         this->nSieveSize = nSieveSize;
         this->nBits = nBits;
+        this->nExtensions = nExtensions;
         this->hashBlockHeader = hashBlockHeader;
         this->bnFixedFactor = bnFixedMultiplier * CBigNum(hashBlockHeader);
+        BigNumToLimbs(bnFixedFactor, vFixedFactorLimbs);
         nPrimeSeq = 0;
-        vfCompositeCunningham1 = std::vector<bool> (nMaxSieveSize, false);
-        vfCompositeCunningham2 = std::vector<bool> (nMaxSieveSize, false);
-        vfCompositeBiTwin = std::vector<bool> (nMaxSieveSize, false);
+        nWords = (nSieveSize + 63) / 64;
+        vfCompositeCunningham1Head = std::vector<uint64> (nWords, 0);
+        vfCompositeCunningham1Tail = std::vector<uint64> (nWords, 0);
+        vfCompositeCunningham2Head = std::vector<uint64> (nWords, 0);
+        vfCompositeCunningham2Tail = std::vector<uint64> (nWords, 0);
+        vfCompositeExtension = std::vector<std::vector<uint64> > (2 * nExtensions, std::vector<uint64> (nWords, 0));
         nCandidateMultiplier = 0;
     }
 
     // Get total number of candidates for power test
-    unsigned int GetCandidateCount()
+    unsigned int GetCandidateCount() const
     {
         unsigned int nCandidates = 0;
-        for (unsigned int nMultiplier = 0; nMultiplier < nSieveSize; nMultiplier++)
-        {
-            if (!vfCompositeCunningham1[nMultiplier] ||
-                !vfCompositeCunningham2[nMultiplier] ||
-                !vfCompositeBiTwin[nMultiplier])
-                nCandidates++;
-        }
+        for (unsigned int nWord = 0; nWord < nWords; nWord++)
+            nCandidates += __builtin_popcountll(GetCandidateWord(nWord));
         return nCandidates;
     }
 
@@ -144,46 +263,36 @@ public:
     // Return values:
     //   True - found next candidate; nVariableMultiplier has the candidate
     //   False - scan complete, no more candidate and reset scan
-    bool GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType)
-    {
-        loop
-        {
-            nCandidateMultiplier++;
-            if (nCandidateMultiplier >= nSieveSize)
-            {
-                nCandidateMultiplier = 0;
-                return false;
-            }
-            if (!vfCompositeBiTwin[nCandidateMultiplier])
-            {
-                nVariableMultiplier = nCandidateMultiplier;
-                nCandidateType = PRIME_CHAIN_BI_TWIN;
-                return true;
-            }
-            if (!vfCompositeCunningham1[nCandidateMultiplier])
-            {
-                nVariableMultiplier = nCandidateMultiplier;
-                nCandidateType = PRIME_CHAIN_CUNNINGHAM1;
-                return true;
-            }
-            if (!vfCompositeCunningham2[nCandidateMultiplier])
-            {
-                nVariableMultiplier = nCandidateMultiplier;
-                nCandidateType = PRIME_CHAIN_CUNNINGHAM2;
-                return true;
-            }
-        }
-    }
+    bool GetNextCandidateMultiplier(unsigned int& nVariableMultiplier, unsigned int& nCandidateType);
+
+    // Chain length of the candidate's type the sieve vouches for: the target
+    // length plus the following chain numbers known to have no factor among
+    // the primes weaved, up to the extensions sieved. The tail layers only
+    // vouch for a bi-twin chain number if they are clear as a whole.
+    unsigned int GetCandidateMaxLength(unsigned int nVariableMultiplier, unsigned int nCandidateType);
 
     // Weave the sieve for the next prime in table
     // Return values:
     //   True  - weaved another prime
     //   False - sieve already completed
     bool Weave();
+
+    // Weave the sieve for the next nWeavePrimes primes in table, processing
+    // the sieve in segments of nSegmentSize multipliers to stay in cache
+    // Return value: number of primes weaved
+    unsigned int WeaveSegmented(unsigned int nWeavePrimes, unsigned int nSegmentSize);
 };
 
 static const unsigned int nPrimorialMultiplierMin = 7;
 static const unsigned int nSieveWeaveInitial = 1000;
+static const unsigned int nSieveExtensionsMax = 8;
+
+// Sieve parameters of a mining round
+struct CSieveSetting
+{
+    unsigned int nSieveSize;
+    unsigned int nPrimorialMultiplier;
+};
 
 class CPrimeMiner
 {
@@ -191,9 +300,14 @@ class CPrimeMiner
     unsigned int nSieveCandidateCount;
     int64 nTimeSieveReady; // sieve ready timestamp in microsecond
     int64 nPrimalityTestCost; // power test time cost in microsecond
+    unsigned int nSieveSetting; // index of the sieve setting in use
+    std::map<unsigned int, unsigned int> mapSieveWeaveOptimal; // weave times tuned for other settings
 
  public:
 
+    // Sieve size
+    unsigned int nSieveSize;
+
     // Primorial multiplier
     unsigned int nPrimorialMultiplier;
 
@@ -206,10 +320,15 @@ class CPrimeMiner
         nSieveCandidateCount = 0;
         nTimeSieveReady = 0;
         nPrimalityTestCost = 0;
+        nSieveSetting = 0;
+        nSieveSize = nMaxSieveSize;
         nPrimorialMultiplier = nPrimorialMultiplierMin;
         nSieveWeaveOptimal = nSieveWeaveInitial;
     }
 
+    // Switch to another sieve setting, keeping the weave times tuned for each
+    void SetSieveSetting(unsigned int nSieveSettingNew, const CSieveSetting& setting);
+
     unsigned int GetSieveWeaveOptimalPrime();
 
     void SetSieveWeaveCost(int64 nSieveWeaveCost, unsigned int nSieveWeaveComposites)
@@ -239,6 +358,73 @@ class CPrimeMiner
     }
 };
 
+// Sieve size steps and largest primorial multiplier the tuner tries
+static const unsigned int nSieveSizeSteps = 4;
+static const unsigned int nPrimorialMultiplierMax = 31;
+
+/** Online tuner of the sieve size and primorial multiplier of the miner
+  *
+  * The settings form a grid of sieve sizes, in steps of a fraction of
+  * nMaxSieveSize, and primorial multipliers. The miner threads sieve each
+  * round with the setting the tuner hands out and report back the time the
+  * round took them along with the chain lengths it turned up. Chains of the
+  * target length are far too rare to compare settings by, so a setting is
+  * scored by the rate of length 1 chains times the share of length 2 among
+  * them raised to the target length less one. The tuner measures the setting
+  * it holds as best against one of its neighbours on the grid at a time and
+  * moves over when the neighbour scores higher, so it keeps following the
+  * machine and its load. Each target length is tuned on its own. The weave
+  * depth is left to the threads' CPrimeMiner, which tunes it per setting.
+  */
+class CSieveTuner
+{
+private:
+    // Measurement of a setting
+    struct CTrial
+    {
+        int64 nTimeMicro;    // thread time spent with the setting
+        uint64 nChains;      // chains of length 1 or more
+        uint64 nChainsTwo;   // chains of length 2 or more
+        uint64 nChainsTarget; // chains meeting the target
+
+        CTrial() { SetNull(); }
+        void SetNull() { nTimeMicro = 0; nChains = nChainsTwo = nChainsTarget = 0; }
+        bool IsComplete() const;
+        double GetChainsPerDay(unsigned int nBits) const;
+    };
+
+    // Tuning for one target length
+    struct CTuning
+    {
+        unsigned int nBest;       // setting held as best
+        unsigned int nTrial;      // setting under measurement
+        unsigned int nDirection;  // next neighbour of the best to try
+        unsigned int nFailures;   // neighbours in a row that scored lower
+        unsigned int nExploit;    // measurements of the best between trials
+        unsigned int nExploitLeft;
+        double dBestChainsPerDay;
+        std::vector<CTrial> vTrials;
+    };
+
+    CCriticalSection cs;
+    bool fEnabled;
+    std::vector<CSieveSetting> vSettings;
+    std::map<unsigned int, CTuning> mapTuning; // by target length
+
+    bool GetNeighbour(unsigned int nSetting, unsigned int nDirection, unsigned int& nNeighbour) const;
+    void NextTrial(unsigned int nBits, CTuning& tuning);
+
+public:
+    // fEnabledIn false: always hand out the initial setting
+    CSieveTuner(bool fEnabledIn);
+
+    // Setting for a new round at target nBits
+    // Return value: index of the setting, to report the results with
+    unsigned int GetSetting(unsigned int nBits, CSieveSetting& setting);
+    // Results of a round, or part of it, sieved with setting nSetting
+    void AddResults(unsigned int nBits, unsigned int nSetting, int64 nTimeMicro, const std::vector<unsigned int>& vChainLength);
+};
+
 extern boost::thread_specific_ptr<CPrimeMiner> pminer;
 
 #endif
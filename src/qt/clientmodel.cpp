@@ -7,6 +7,7 @@
 #include "addresstablemodel.h"
 #include "guiconstants.h"
 #include "main.h"
+#include "miningstats.h"
 #include "transactiontablemodel.h"
 #include "ui_interface.h"
 
@@ -119,6 +120,30 @@ QString ClientModel::getStatusBarWarnings() const
     return QString::fromStdString(GetWarnings("statusbar"));
 }
 
+double ClientModel::getPrimesPerSec() const
+{
+    CMiningSnapshot snapshot, snapshotStart;
+    miningstats.GetSnapshot(snapshot);
+    miningstats.GetSnapshotStart(snapshotStart);
+    return snapshot.GetPrimesPerSec(snapshotStart);
+}
+
+double ClientModel::getChainsPerDay() const
+{
+    CMiningSnapshot snapshot, snapshotStart;
+    miningstats.GetSnapshot(snapshot);
+    miningstats.GetSnapshotStart(snapshotStart);
+    return snapshot.GetChainsPerDay(snapshotStart);
+}
+
+double ClientModel::getExpectedTimeToBlock() const
+{
+    CMiningSnapshot snapshot, snapshotStart;
+    miningstats.GetSnapshot(snapshot);
+    miningstats.GetSnapshotStart(snapshotStart);
+    return snapshot.GetExpectedTimeToBlock(snapshotStart);
+}
+
 QString ClientModel::formatFullVersion() const
 {
     return QString::fromStdString(FormatVersion(PRIMECOIN_VERSION));
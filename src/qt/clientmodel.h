@@ -48,6 +48,12 @@ public:
     //! Return warnings to be displayed in status bar
     QString getStatusBarWarnings() const;
 
+    //! Return mining rates since mining started
+    double getPrimesPerSec() const;
+    double getChainsPerDay() const;
+    //! Return expected seconds to find a block, or 0 if unknown
+    double getExpectedTimeToBlock() const;
+
     QString formatFullVersion() const;
     QString clientName() const;
     QString formatClientStartupTime() const;
@@ -0,0 +1,269 @@
+//
+// Unit tests for the input checks of ConnectBlock(): the checks run in
+// parallel must accept and reject the same blocks as the ones run in block
+// order, with the same totals.
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "script.h"
+#include "test_primecoin.h"
+
+BOOST_AUTO_TEST_SUITE(connectinputs_tests)
+
+static const int nSpendHeight = 5000;
+
+namespace {
+
+struct CConnectResult
+{
+    bool fValid;
+    int nDoS;
+    unsigned int nSigOps;
+    int64 nValueIn;
+    int64 nValueOut;
+    int64 nFees;
+    unsigned int nTxUndo;
+};
+
+// Outputs the test blocks spend, present before the block
+class CFunding
+{
+public:
+    std::vector<std::pair<uint256, CCoins> > vCoins;
+
+    // Add a transaction with one output of nValue paying to scriptPubKey
+    // at height nHeight, and return its outpoint
+    COutPoint Add(int64 nValue, const CScript& scriptPubKey, int nHeight, bool fCoinBase = false)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        if (!fCoinBase)
+            tx.vin[0].prevout = COutPoint(uint256(vCoins.size() + 1), 0);
+        tx.vin[0].scriptSig = CScript() << (int)vCoins.size();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = nValue;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        vCoins.push_back(std::make_pair(tx.GetHash(), CCoins(tx, nHeight)));
+        return COutPoint(tx.GetHash(), 0);
+    }
+};
+
+}
+
+static CBlock MakeBlock(const std::vector<CTransaction>& vtx)
+{
+    CBlock block;
+    CTransaction txCoinBase;
+    txCoinBase.vin.resize(1);
+    txCoinBase.vin[0].prevout.SetNull();
+    txCoinBase.vin[0].scriptSig = CScript() << nSpendHeight << OP_0;
+    txCoinBase.vout.resize(1);
+    txCoinBase.vout[0].nValue = 50 * COIN;
+    txCoinBase.vout[0].scriptPubKey = ScriptTrue();
+    block.vtx.push_back(txCoinBase);
+    block.vtx.insert(block.vtx.end(), vtx.begin(), vtx.end());
+    block.BuildMerkleTree();
+    return block;
+}
+
+static CConnectResult Connect(const CBlock& block, const CFunding& funding, bool fParallelInputs)
+{
+    CCoinsView coinsDummy;
+    CCoinsViewCache view(coinsDummy);
+    for (unsigned int i = 0; i < funding.vCoins.size(); i++)
+        view.SetCoins(funding.vCoins[i].first, funding.vCoins[i].second);
+    CBlockIndex indexPrev;
+    indexPrev.nHeight = nSpendHeight - 1;
+    view.SetBestBlock(&indexPrev);
+
+    CConnectResult result;
+    result.nSigOps = 0;
+    result.nValueIn = 0;
+    result.nValueOut = 0;
+    result.nFees = 0;
+    result.nDoS = 0;
+    CValidationState state;
+    CBlockUndo blockundo;
+    result.fValid = block.ConnectInputs(state, nSpendHeight, view, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_NOCACHE, true, fParallelInputs, NULL,
+                                        blockundo, result.nSigOps, result.nValueIn, result.nValueOut, result.nFees);
+    state.IsInvalid(result.nDoS);
+    result.nTxUndo = blockundo.vtxundo.size();
+    return result;
+}
+
+// Connect the block both ways and check that the outcomes agree; return whether it is valid
+static bool CheckBothPaths(const CBlock& block, const CFunding& funding)
+{
+    CConnectResult serial = Connect(block, funding, false);
+    CConnectResult parallel = Connect(block, funding, true);
+    BOOST_CHECK_EQUAL(serial.fValid, parallel.fValid);
+    BOOST_CHECK_EQUAL(serial.nDoS, parallel.nDoS);
+    if (serial.fValid && parallel.fValid)
+    {
+        BOOST_CHECK_EQUAL(serial.nSigOps, parallel.nSigOps);
+        BOOST_CHECK_EQUAL(serial.nValueIn, parallel.nValueIn);
+        BOOST_CHECK_EQUAL(serial.nValueOut, parallel.nValueOut);
+        BOOST_CHECK_EQUAL(serial.nFees, parallel.nFees);
+        BOOST_CHECK_EQUAL(serial.nTxUndo, parallel.nTxUndo);
+    }
+    return serial.fValid;
+}
+
+BOOST_AUTO_TEST_CASE(connectinputs_valid_block)
+{
+    CFunding funding;
+    std::vector<CTransaction> vtx;
+    int64 nFees = 0;
+
+    // Independent spends of outputs from before the block
+    for (int i = 0; i < 10; i++)
+    {
+        vtx.push_back(Spend(funding.Add(COIN + i, ScriptTrue(), 100), COIN + i - CENT));
+        nFees += CENT;
+    }
+    // A chain of spends of outputs created earlier in the same block
+    vtx.push_back(Spend(funding.Add(10 * COIN, ScriptTrue(), 100), 10 * COIN - CENT));
+    nFees += CENT;
+    for (int i = 0; i < 10; i++)
+    {
+        CTransaction txPrev = vtx.back();
+        vtx.push_back(Spend(COutPoint(txPrev.GetHash(), 0), txPrev.vout[0].nValue - 2 * CENT));
+        nFees += 2 * CENT;
+    }
+    // A mature coinbase
+    vtx.push_back(Spend(funding.Add(50 * COIN, ScriptTrue(), nSpendHeight - COINBASE_MATURITY, true), 50 * COIN - CENT));
+    nFees += CENT;
+    // Pay-to-script-hash spends with sigops
+    CScript redeemScript = RedeemScriptWithSigOps(10);
+    for (int i = 0; i < 3; i++)
+    {
+        vtx.push_back(Spend(funding.Add(COIN, PayToScriptHash(redeemScript), 100), COIN - CENT,
+            CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end())));
+        nFees += CENT;
+    }
+    CBlock block = MakeBlock(vtx);
+
+    BOOST_CHECK(CheckBothPaths(block, funding));
+    CConnectResult result = Connect(block, funding, true);
+    BOOST_CHECK_EQUAL(result.nFees, nFees);
+    BOOST_CHECK_EQUAL(result.nSigOps, 3 * redeemScript.GetSigOpCount(true));
+    BOOST_CHECK_EQUAL(result.nTxUndo, vtx.size());
+}
+
+BOOST_AUTO_TEST_CASE(connectinputs_immature_coinbase)
+{
+    std::vector<CTransaction> vtx;
+    CFunding funding;
+    for (int i = 0; i < 10; i++)
+        vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+    vtx.push_back(Spend(funding.Add(50 * COIN, ScriptTrue(), nSpendHeight - COINBASE_MATURITY + 1, true), 50 * COIN - CENT));
+    for (int i = 0; i < 10; i++)
+        vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+    BOOST_CHECK(!CheckBothPaths(MakeBlock(vtx), funding));
+}
+
+BOOST_AUTO_TEST_CASE(connectinputs_first_fault_reported)
+{
+    // An immature coinbase spend is not punished; a later transaction with
+    // missing inputs, or taking the block over the sigop limit, must not
+    // change that
+    for (int nFault = 0; nFault < 2; nFault++)
+    {
+        std::vector<CTransaction> vtx;
+        CFunding funding;
+        for (int i = 0; i < 3; i++)
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+        vtx.push_back(Spend(funding.Add(50 * COIN, ScriptTrue(), nSpendHeight - COINBASE_MATURITY + 1, true), 50 * COIN - CENT));
+        for (int i = 0; i < 5; i++)
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+        if (nFault == 0)
+            vtx.push_back(Spend(COutPoint(uint256(12345), 0), COIN - CENT));
+        else
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT, CScript(), MAX_BLOCK_SIGOPS + 1));
+        for (int i = 0; i < 5; i++)
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+
+        BOOST_CHECK(!CheckBothPaths(MakeBlock(vtx), funding));
+        CConnectResult result = Connect(MakeBlock(vtx), funding, true);
+        BOOST_CHECK_EQUAL(result.nDoS, 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(connectinputs_values_out_of_range)
+{
+    int64 vValues[] = { -1, MAX_MONEY + 1, -MAX_MONEY };
+    for (unsigned int n = 0; n < sizeof(vValues) / sizeof(vValues[0]); n++)
+    {
+        std::vector<CTransaction> vtx;
+        CFunding funding;
+        for (int i = 0; i < 5; i++)
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+        vtx.push_back(Spend(funding.Add(vValues[n], ScriptTrue(), 100), 0));
+        for (int i = 0; i < 5; i++)
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+        BOOST_CHECK(!CheckBothPaths(MakeBlock(vtx), funding));
+    }
+
+    // Two inputs in range whose sum is not
+    std::vector<CTransaction> vtx;
+    CFunding funding;
+    CTransaction tx = Spend(funding.Add(MAX_MONEY, ScriptTrue(), 100), COIN);
+    tx.vin.push_back(CTxIn(funding.Add(MAX_MONEY, ScriptTrue(), 100)));
+    vtx.push_back(tx);
+    BOOST_CHECK(!CheckBothPaths(MakeBlock(vtx), funding));
+
+    // Paying out more than comes in, or less than the fee
+    CFunding fundingFee;
+    std::vector<CTransaction> vtxOverspend(1, Spend(fundingFee.Add(COIN, ScriptTrue(), 100), COIN + 1));
+    BOOST_CHECK(!CheckBothPaths(MakeBlock(vtxOverspend), fundingFee));
+    std::vector<CTransaction> vtxNoFee(1, Spend(fundingFee.Add(COIN, ScriptTrue(), 100), COIN));
+    BOOST_CHECK(!CheckBothPaths(MakeBlock(vtxNoFee), fundingFee));
+}
+
+BOOST_AUTO_TEST_CASE(connectinputs_p2sh_sigops)
+{
+    // Each spend counts 3800 sigops, staying within the opcode limit of the
+    // redeem script: five fit in a block, six do not
+    CScript redeemScript = RedeemScriptWithSigOps(190);
+    BOOST_CHECK_EQUAL(redeemScript.GetSigOpCount(true), 3800U);
+    for (int nSpends = 5; nSpends <= 6; nSpends++)
+    {
+        std::vector<CTransaction> vtx;
+        CFunding funding;
+        for (int i = 0; i < nSpends; i++)
+        {
+            vtx.push_back(Spend(funding.Add(COIN, PayToScriptHash(redeemScript), 100), COIN - CENT,
+                CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end())));
+            vtx.push_back(Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT));
+        }
+        BOOST_CHECK_EQUAL(CheckBothPaths(MakeBlock(vtx), funding), nSpends == 5);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(connectinputs_spends_within_block)
+{
+    CFunding funding;
+    CTransaction txFirst = Spend(funding.Add(COIN, ScriptTrue(), 100), COIN - CENT);
+    CTransaction txSecond = Spend(COutPoint(txFirst.GetHash(), 0), COIN - 2 * CENT);
+
+    // In block order the output exists when it is spent
+    std::vector<CTransaction> vtx;
+    vtx.push_back(txFirst);
+    vtx.push_back(txSecond);
+    BOOST_CHECK(CheckBothPaths(MakeBlock(vtx), funding));
+
+    // Spent before it is created
+    std::vector<CTransaction> vtxReversed;
+    vtxReversed.push_back(txSecond);
+    vtxReversed.push_back(txFirst);
+    BOOST_CHECK(!CheckBothPaths(MakeBlock(vtxReversed), funding));
+
+    // Spent twice in the block
+    std::vector<CTransaction> vtxDouble = vtx;
+    CTransaction txThird = Spend(COutPoint(txFirst.GetHash(), 0), COIN - 3 * CENT);
+    vtxDouble.push_back(txThird);
+    BOOST_CHECK(!CheckBothPaths(MakeBlock(vtxDouble), funding));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,183 @@
+//
+// Unit tests for the fixed-width Fermat test engine
+//
+#include <boost/test/unit_test.hpp>
+
+#include "fermat.h"
+#include "prime.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(fermat_tests)
+
+// Fermat remainder and fractional length the OpenSSL way
+static void ReferenceFermatTest(const CBigNum& n, CBigNum& r, unsigned int& nFractionalLength)
+{
+    CAutoBN_CTX pctx;
+    CBigNum a = 2;
+    CBigNum e = n - 1;
+    BN_mod_exp(&r, &a, &e, &n, pctx);
+    nFractionalLength = (((n-r) << nFractionalBits) / n).getuint();
+}
+
+static void CheckAgainstReference(const CBigNum& n)
+{
+    CBigNum bnRemainder;
+    unsigned int nFractionalLengthExpected = 0;
+    ReferenceFermatTest(n, bnRemainder, nFractionalLengthExpected);
+    bool fPrimeExpected = (bnRemainder == 1);
+
+    CFermatEngine engine;
+    BOOST_REQUIRE(engine.SetModulus(n));
+    unsigned int nFractionalLength = 0;
+    BOOST_CHECK_EQUAL(engine.FermatTest(nFractionalLength), fPrimeExpected);
+    CBigNum bnEngineRemainder;
+    engine.GetRemainder(bnEngineRemainder);
+    BOOST_CHECK(bnEngineRemainder == bnRemainder);
+    if (!fPrimeExpected)
+        BOOST_CHECK_EQUAL(nFractionalLength, nFractionalLengthExpected);
+
+    // 2 ** ((n-1)/2) is +/-1 for a probable prime, its square is the Fermat remainder
+    CAutoBN_CTX pctx;
+    CBigNum a = 2;
+    CBigNum e = (n - 1) >> 1;
+    CBigNum bnHalf;
+    BN_mod_exp(&bnHalf, &a, &e, &n, pctx);
+    for (int i = 0; i < 2; i++)
+    {
+        bool fExpectMinusOne = (i == 1);
+        bool fPassedExpected = (fExpectMinusOne? (bnHalf + 1 == n) : (bnHalf == 1));
+        nFractionalLength = 0;
+        BOOST_CHECK_EQUAL(engine.EulerCriterionTest(fExpectMinusOne, nFractionalLength), fPassedExpected);
+        engine.GetRemainder(bnEngineRemainder);
+        BOOST_CHECK(bnEngineRemainder == bnRemainder);
+        if (!fPassedExpected && !fPrimeExpected)
+            BOOST_CHECK_EQUAL(nFractionalLength, nFractionalLengthExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(fermat_matches_bn_mod_exp)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    // Small primes and composites
+    for (unsigned int n = 3; n < 2000; n += 2)
+        CheckAgainstReference(CBigNum(n));
+
+    // Mersenne primes across limb boundaries
+    const unsigned int nMersenneExponents[] = {31, 61, 89, 107, 127, 521, 607, 1279};
+    for (unsigned int i = 0; i < sizeof(nMersenneExponents) / sizeof(nMersenneExponents[0]); i++)
+        CheckAgainstReference((bnOne << nMersenneExponents[i]) - 1);
+
+    // Chain numbers of the size miners work with, and of the largest allowed origins
+    uint256 hash = Hash(BEGIN(nFractionalBits), END(nFractionalBits)) | (uint256(1) << 255);
+    CBigNum bnPrimorial;
+    Primorial(47, bnPrimorial);
+    for (unsigned int nMultiplier = 1; nMultiplier < 2000; nMultiplier++)
+    {
+        CBigNum bnOrigin = CBigNum(hash) * bnPrimorial * nMultiplier;
+        CheckAgainstReference(bnOrigin - 1);
+        CheckAgainstReference(bnOrigin + 1);
+        if (nMultiplier % 100 == 0)
+        {
+            CBigNum bnLarge = (bnPrimeMax / bnOrigin) * bnOrigin;
+            CheckAgainstReference(bnLarge + 1);
+            CheckAgainstReference((bnLarge << 64) - 1);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(fermat_batch_matches_single)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    // Mixed magnitudes, so some batches run in lockstep and some do not;
+    // the count leaves a short batch at the end
+    uint256 hash = Hash(BEGIN(nFermatBatchSize), END(nFermatBatchSize)) | (uint256(1) << 255);
+    CBigNum bnPrimorial;
+    Primorial(31, bnPrimorial);
+    std::vector<CBigNum> vbn;
+    for (unsigned int nMultiplier = 1; nMultiplier < 1000; nMultiplier++)
+    {
+        CBigNum bnOrigin = CBigNum(hash) * bnPrimorial * nMultiplier;
+        vbn.push_back(bnOrigin + ((nMultiplier & 1)? 1 : -1));
+        if (nMultiplier % 7 == 0)
+            vbn.push_back((bnOrigin << (nMultiplier % 160)) + 1);
+    }
+    BOOST_REQUIRE(vbn.size() % nFermatBatchSize != 0);
+
+    std::vector<CFermatEngine> vEngines(vbn.size());
+    std::vector<unsigned int> vFractionalLength(vbn.size(), 0);
+    bool* pfProbablePrime = new bool[vbn.size()];
+    for (unsigned int i = 0; i < vbn.size(); i++)
+        BOOST_REQUIRE(vEngines[i].SetModulus(vbn[i]));
+    CFermatEngine::FermatTestBatch(&vEngines[0], vbn.size(), pfProbablePrime, &vFractionalLength[0]);
+
+    unsigned int nProbablePrimes = 0;
+    for (unsigned int i = 0; i < vbn.size(); i++)
+    {
+        CFermatEngine engine;
+        engine.SetModulus(vbn[i]);
+        unsigned int nFractionalLength = 0;
+        bool fProbablePrime = engine.FermatTest(nFractionalLength);
+        BOOST_CHECK_EQUAL(pfProbablePrime[i], fProbablePrime);
+        if (!fProbablePrime)
+            BOOST_CHECK_EQUAL(vFractionalLength[i], nFractionalLength);
+        nProbablePrimes += (fProbablePrime? 1 : 0);
+    }
+    BOOST_CHECK(nProbablePrimes > 0);
+    delete[] pfProbablePrime;
+}
+
+BOOST_AUTO_TEST_CASE(fermat_chain_next_matches_set_modulus)
+{
+    // Both kinds of chain, growing across limb boundaries up to the capacity
+    const unsigned int nStartBits[] = {2, 2100};
+    for (unsigned int i = 0; i < sizeof(nStartBits) / sizeof(nStartBits[0]); i++)
+    {
+        for (int nKind = 0; nKind < 2; nKind++)
+        {
+            bool fSophieGermain = (nKind == 0);
+            CBigNum n = (bnOne << nStartBits[i]) + 3;
+            CFermatEngine engine;
+            BOOST_REQUIRE(engine.SetModulus(n));
+            for (unsigned int nStep = 0; engine.SetChainNext(fSophieGermain); nStep++)
+            {
+                n = n + n + (fSophieGermain? 1 : (-1));
+                CBigNum bnModulus;
+                engine.GetModulus(bnModulus);
+                BOOST_CHECK(bnModulus == n);
+                BOOST_CHECK_EQUAL(engine.GetModulusMod8(), (unsigned int) (n % 8).getuint());
+                if (nStep % 97 > 3)
+                    continue;
+
+                // Reduction constants follow the modulus
+                CFermatEngine engineExpected;
+                BOOST_REQUIRE(engineExpected.SetModulus(n));
+                unsigned int nFractionalLength = 0;
+                unsigned int nFractionalLengthExpected = 0;
+                BOOST_CHECK_EQUAL(engine.FermatTest(nFractionalLength), engineExpected.FermatTest(nFractionalLengthExpected));
+                BOOST_CHECK_EQUAL(nFractionalLength, nFractionalLengthExpected);
+            }
+            // Refused at the capacity, and left as it was
+            BOOST_CHECK_EQUAL(BN_num_bits(&n), 2176);
+            CBigNum bnModulus;
+            engine.GetModulus(bnModulus);
+            BOOST_CHECK(bnModulus == n);
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(fermat_rejects_modulus)
+{
+    CFermatEngine engine;
+    BOOST_CHECK(!engine.SetModulus(CBigNum(0)));
+    BOOST_CHECK(!engine.SetModulus(CBigNum(1)));
+    BOOST_CHECK(!engine.SetModulus(CBigNum(1000)));
+    BOOST_CHECK(!engine.SetModulus(CBigNum(-7)));
+    BOOST_CHECK(!engine.SetModulus((bnOne << 2176) + 1));
+    BOOST_CHECK(engine.SetModulus((bnOne << 2176) - 1));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,27 @@
+//
+// Unit tests for the block header hasher
+//
+#include <boost/test/unit_test.hpp>
+
+#include "hash.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(hash_tests)
+
+BOOST_AUTO_TEST_CASE(header_hasher_matches_hash)
+{
+    // 80 bytes of header with the nonce last
+    std::vector<unsigned char> vHeader(80);
+    for (unsigned int i = 0; i < vHeader.size(); i++)
+        vHeader[i] = (unsigned char)(i * 37 + 11);
+    CHeaderHasher hasher((const char*)&vHeader[0]);
+
+    unsigned int vNonce[] = { 0, 1, 2, 0x12345678, 0xfffeffff };
+    for (unsigned int i = 0; i < sizeof(vNonce) / sizeof(vNonce[0]); i++)
+    {
+        memcpy(&vHeader[76], &vNonce[i], sizeof(vNonce[i]));
+        BOOST_CHECK(hasher.GetHash(vNonce[i]) == Hash(vHeader.begin(), vHeader.end()));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,144 @@
+//
+// Unit tests for the block template builder: a template brought up to date
+// with the memory pool one update at a time must hold the same transactions,
+// in the same order and with the same fees and sigops, as a template built
+// from the whole memory pool at once.
+//
+#include <boost/test/unit_test.hpp>
+
+#include "main.h"
+#include "miner.h"
+#include "script.h"
+#include "wallet.h"
+#include "test_primecoin.h"
+
+extern CWallet* pwalletMain;
+
+BOOST_AUTO_TEST_SUITE(miner_tests)
+
+namespace {
+
+// Outputs in the coins of the chain tip for the memory pool to spend
+class CTipFunding
+{
+public:
+    std::vector<uint256> vTxid;
+
+    // Add a transaction with one output of nValue paying to scriptPubKey,
+    // confirmed in the tip block, and return its outpoint
+    COutPoint Add(int64 nValue, const CScript& scriptPubKey)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(uint256(vTxid.size() + 1), 0);
+        tx.vin[0].scriptSig = CScript() << OP_1 << (int)vTxid.size();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = nValue;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        pcoinsTip->SetCoins(tx.GetHash(), CCoins(tx, pindexBest->nHeight));
+        vTxid.push_back(tx.GetHash());
+        return COutPoint(tx.GetHash(), 0);
+    }
+
+    ~CTipFunding()
+    {
+        BOOST_FOREACH(const uint256& hash, vTxid)
+            pcoinsTip->SetCoins(hash, CCoins());
+    }
+};
+
+}
+
+static void AddToMemoryPool(const CTransaction& tx)
+{
+    LOCK(mempool.cs);
+    mempool.addUnchecked(tx.GetHash(), tx);
+}
+
+// Check the template of the builder against one built from scratch
+static void CheckTemplate(const CBlockTemplateBuilder& builder, CReserveKey& reservekey, int64 nFeesExpected)
+{
+    const CBlockTemplate& blocktemplate = builder.GetTemplate();
+    std::auto_ptr<CBlockTemplate> pblocktemplateNew(CreateNewBlock(reservekey));
+    BOOST_REQUIRE(pblocktemplateNew.get() != NULL);
+
+    const CBlock& block = blocktemplate.block;
+    const CBlock& blockNew = pblocktemplateNew->block;
+    BOOST_REQUIRE_EQUAL(block.vtx.size(), blockNew.vtx.size());
+    BOOST_CHECK_EQUAL(block.vtx[0].vout[0].nValue, blockNew.vtx[0].vout[0].nValue);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        BOOST_CHECK(block.vtx[i].GetHash() == blockNew.vtx[i].GetHash());
+    BOOST_CHECK(block.hashMerkleRoot == blockNew.hashMerkleRoot);
+    BOOST_CHECK(blocktemplate.vTxFees == pblocktemplateNew->vTxFees);
+    BOOST_CHECK(blocktemplate.vTxSigOps == pblocktemplateNew->vTxSigOps);
+    BOOST_CHECK_EQUAL(-blocktemplate.vTxFees[0], nFeesExpected);
+}
+
+BOOST_AUTO_TEST_CASE(template_update_matches_rebuild)
+{
+    CReserveKey reservekey(pwalletMain);
+    CBlockTemplateBuilder builder(reservekey);
+    CTipFunding funding;
+    int64 nFees = 0;
+    mempool.clear();
+
+    // Start with an empty memory pool
+    BOOST_REQUIRE(builder.Update());
+    BOOST_CHECK_EQUAL(builder.GetTemplate().block.vtx.size(), 1U);
+    CheckTemplate(builder, reservekey, nFees);
+
+    // High priority transactions, some with legacy sigops
+    std::vector<CTransaction> vtxFirst;
+    for (int i = 0; i < 5; i++)
+    {
+        vtxFirst.push_back(Spend(funding.Add((1000 + 10 * i) * COIN, ScriptTrue()), (1000 + 10 * i) * COIN - CENT, CScript(), i));
+        AddToMemoryPool(vtxFirst.back());
+        nFees += CENT;
+    }
+    BOOST_REQUIRE(builder.Update());
+    BOOST_CHECK_EQUAL(builder.GetTemplate().block.vtx.size(), 6U);
+    CheckTemplate(builder, reservekey, nFees);
+
+    // Lower priority transactions arriving later go after them: plain ones,
+    // pay-to-script-hash spends with sigops, and a transaction spending one
+    // of them
+    std::vector<CTransaction> vtxSecond;
+    for (int i = 0; i < 3; i++)
+    {
+        vtxSecond.push_back(Spend(funding.Add((500 + 10 * i) * COIN, ScriptTrue()), (500 + 10 * i) * COIN - 2 * CENT));
+        AddToMemoryPool(vtxSecond.back());
+        nFees += 2 * CENT;
+    }
+    CScript redeemScript = RedeemScriptWithSigOps(2);
+    for (int i = 0; i < 2; i++)
+    {
+        vtxSecond.push_back(Spend(funding.Add((400 + 10 * i) * COIN, PayToScriptHash(redeemScript)), (400 + 10 * i) * COIN - CENT,
+            CScript() << std::vector<unsigned char>(redeemScript.begin(), redeemScript.end())));
+        AddToMemoryPool(vtxSecond.back());
+        nFees += CENT;
+    }
+    CTransaction txChild = Spend(COutPoint(vtxSecond[0].GetHash(), 0), vtxSecond[0].vout[0].nValue - 3 * CENT, CScript(), 1);
+    AddToMemoryPool(txChild);
+    nFees += 3 * CENT;
+    BOOST_REQUIRE(builder.Update());
+    BOOST_CHECK_EQUAL(builder.GetTemplate().block.vtx.size(), 12U);
+    BOOST_CHECK(builder.GetTemplate().block.vtx.back().GetHash() == txChild.GetHash());
+    CheckTemplate(builder, reservekey, nFees);
+
+    // A transaction leaving the memory pool, and another one arriving
+    {
+        LOCK(mempool.cs);
+        mempool.remove(vtxFirst[2]);
+    }
+    nFees -= CENT;
+    CTransaction txLast = Spend(funding.Add(300 * COIN, ScriptTrue()), 300 * COIN - CENT, CScript(), 3);
+    AddToMemoryPool(txLast);
+    nFees += CENT;
+    BOOST_REQUIRE(builder.Update());
+    BOOST_CHECK_EQUAL(builder.GetTemplate().block.vtx.size(), 12U);
+    CheckTemplate(builder, reservekey, nFees);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
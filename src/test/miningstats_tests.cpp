@@ -0,0 +1,76 @@
+//
+// Unit tests for the mining statistics
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+#include "miningstats.h"
+#include "prime.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(miningstats_tests)
+
+static void MineSomething(unsigned int nBits)
+{
+    CMiningCounters* pcounters = miningstats.AddThread();
+    BOOST_CHECK(pminingcounters.get() == pcounters);
+    pcounters->AddSieve(3000, 100, 500);
+    std::vector<unsigned int> vChainLength;
+    vChainLength.push_back(0x00800000);            // no prime at all
+    vChainLength.push_back(TargetFromInt(1));
+    vChainLength.push_back(TargetFromInt(2) + 5);
+    vChainLength.push_back(TargetFromInt(40));     // longer than counted apart
+    pcounters->AddChainTests(1000, nBits, 0.5, vChainLength);
+    pcounters->nFermatTests += 10;
+    pcounters->nProbablePrimes += 4;
+}
+
+BOOST_AUTO_TEST_CASE(miningstats_snapshot)
+{
+    unsigned int nBits = TargetFromInt(2);
+    miningstats.Reset();
+    CMiningSnapshot snapshotStart;
+    miningstats.GetSnapshotStart(snapshotStart);
+
+    // Counters of this thread and of two more
+    MineSomething(nBits);
+    boost::thread thread1(MineSomething, nBits);
+    boost::thread thread2(MineSomething, nBits);
+    thread1.join();
+    thread2.join();
+
+    CMiningSnapshot snapshot;
+    miningstats.GetSnapshot(snapshot);
+    BOOST_CHECK_EQUAL(snapshot.nThreads, 3u);
+    BOOST_CHECK_EQUAL(snapshot.nSieves, 3u);
+    BOOST_CHECK_EQUAL(snapshot.nSieveTimeMicro, 9000);
+    BOOST_CHECK_EQUAL(snapshot.nWeaves, 300u);
+    BOOST_CHECK_EQUAL(snapshot.nCandidates, 1500u);
+    BOOST_CHECK_EQUAL(snapshot.nTestTimeMicro, 3000);
+    BOOST_CHECK_EQUAL(snapshot.nChainTests, 12u);
+    BOOST_CHECK_EQUAL(snapshot.nFermatTests, 30u);
+    BOOST_CHECK_EQUAL(snapshot.nProbablePrimes, 12u);
+    BOOST_CHECK_EQUAL(snapshot.vChainHits[0], 3u);
+    BOOST_CHECK_EQUAL(snapshot.vChainHits[1], 3u);
+    BOOST_CHECK_EQUAL(snapshot.vChainHits[2], 3u);
+    BOOST_CHECK_EQUAL(snapshot.vChainHits[nMiningStatsChainLengths - 1], 3u);
+    BOOST_CHECK_EQUAL(snapshot.nBits, nBits);
+    // 12 candidates with both numbers of a length 2 chain prime at 1/2
+    BOOST_CHECK_CLOSE(snapshot.dChainsExpected, 3.0, 1e-9);
+
+    // Rates over the time since mining started
+    BOOST_CHECK(snapshot.GetPrimesPerSec(snapshotStart) > 0.0);
+    BOOST_CHECK(snapshot.GetChainsPerDay(snapshotStart) > 0.0);
+    BOOST_CHECK_CLOSE(snapshot.GetExpectedTimeToBlock(snapshotStart), 86400.0 / snapshot.GetChainsPerDay(snapshotStart), 1e-9);
+    BOOST_CHECK_CLOSE(snapshot.GetSieveTimeShare(snapshotStart), 0.75, 1e-9);
+    BOOST_CHECK_EQUAL(snapshot.GetPrimesPerSec(snapshot), 0.0);
+
+    // Counters go with the registry, not with this thread
+    pminingcounters.release();
+    miningstats.Reset();
+    miningstats.GetSnapshot(snapshot);
+    BOOST_CHECK_EQUAL(snapshot.nThreads, 0u);
+    BOOST_CHECK_EQUAL(snapshot.nSieves, 0u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
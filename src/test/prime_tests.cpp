@@ -0,0 +1,525 @@
+//
+// Unit tests for the prime chain sieve
+//
+#include <boost/test/unit_test.hpp>
+#include <boost/foreach.hpp>
+
+#include "prime.h"
+#include "util.h"
+
+BOOST_AUTO_TEST_SUITE(prime_tests)
+
+// Reference sieve: for every multiplier decide directly whether some woven
+// prime divides one of the chain numbers h * m * 2^k -/+ 1
+static unsigned int ReferenceCandidateType(const std::vector<unsigned int>& vFixedFactorMod, unsigned int nWeavePrimes, unsigned int nChainLength, unsigned int nMultiplier)
+{
+    bool fBiTwin = true, fCunningham1 = true, fCunningham2 = true;
+    for (unsigned int nPrimeSeq = 0; nPrimeSeq < nWeavePrimes; nPrimeSeq++)
+    {
+        uint64 nPrime = vPrimes[nPrimeSeq];
+        if (vFixedFactorMod[nPrimeSeq] == 0)
+            continue;
+        uint64 nOrigin = (vFixedFactorMod[nPrimeSeq] * (uint64)nMultiplier) % nPrime;
+        for (unsigned int nPosition = 0; nPosition < nChainLength; nPosition++)
+        {
+            if (nOrigin == 1) // divides origin * 2^k - 1
+            {
+                fCunningham1 = false;
+                if (nPosition < (nChainLength + 1) / 2)
+                    fBiTwin = false;
+            }
+            if (nOrigin == nPrime - 1) // divides origin * 2^k + 1
+            {
+                fCunningham2 = false;
+                if (nPosition < nChainLength / 2)
+                    fBiTwin = false;
+            }
+            nOrigin = (nOrigin * 2) % nPrime;
+        }
+    }
+    if (fBiTwin)
+        return PRIME_CHAIN_BI_TWIN;
+    if (fCunningham1)
+        return PRIME_CHAIN_CUNNINGHAM1;
+    if (fCunningham2)
+        return PRIME_CHAIN_CUNNINGHAM2;
+    return 0;
+}
+
+BOOST_AUTO_TEST_CASE(reduce_mod_primes_matches_bignum)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    // Numbers of 0 to 2000 bits, with all-ones and single limbs among them
+    std::vector<CBigNum> vNumbers;
+    vNumbers.push_back(CBigNum(0));
+    vNumbers.push_back(CBigNum(vPrimes.back()));
+    vNumbers.push_back((CBigNum(1) << 64) - 1);
+    vNumbers.push_back((CBigNum(1) << 2000) - 1);
+    for (unsigned int nBits = 1; nBits <= 2000; nBits += 97)
+        vNumbers.push_back(CBigNum(GetRandHash()) * CBigNum(GetRandHash()) * CBigNum(GetRandHash()) * CBigNum(GetRandHash()) *
+                           CBigNum(GetRandHash()) * CBigNum(GetRandHash()) * CBigNum(GetRandHash()) * CBigNum(GetRandHash()) >> (2048 - nBits));
+
+    unsigned int nPrimes = vPrimes.size();
+    std::vector<unsigned int> vRemainders(nPrimes);
+    BOOST_FOREACH(const CBigNum& bn, vNumbers)
+    {
+        std::vector<uint64> vLimbs;
+        BigNumToLimbs(bn, vLimbs);
+        BOOST_CHECK_EQUAL(vLimbs.size(), (BN_num_bits(&bn) + 63) / 64);
+        // Odd begin and end, to cover the lockstep and the leftover primes
+        ReduceModPrimes(vLimbs, 1, nPrimes, &vRemainders[1]);
+        for (unsigned int nSeq = 1; nSeq < nPrimes; nSeq += (nSeq < 1000)? 1 : 997)
+            BOOST_CHECK_EQUAL(vRemainders[nSeq], (bn % vPrimes[nSeq]).getuint());
+        BOOST_CHECK_EQUAL(vRemainders[nPrimes - 1], (bn % vPrimes.back()).getuint());
+    }
+
+    // Trial division stops below the limit
+    CBigNum bn = CBigNum(GetRandHash()) * 7919;
+    bool fSmallFactor = false;
+    for (unsigned int nSeq = 0; vPrimes[nSeq] < 7919; nSeq++)
+        fSmallFactor = fSmallFactor || (bn % vPrimes[nSeq] == 0);
+    BOOST_CHECK_EQUAL(TrialDivisionTest(bn, 7919), !fSmallFactor);
+    BOOST_CHECK(!TrialDivisionTest(bn, 7920));
+    BOOST_CHECK(TrialDivisionTest(CBigNum(1), 1000));
+}
+
+BOOST_AUTO_TEST_CASE(primorial_matches_product)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    CBigNum bnProduct = 1;
+    CBigNum bnPrevious = 1;
+    for (unsigned int p = 0; p <= 300; p++)
+    {
+        bool fPrime = std::find(vPrimes.begin(), vPrimes.end(), p) != vPrimes.end();
+        if (fPrime)
+            bnProduct *= p;
+        CBigNum bnPrimorial;
+        Primorial(p, bnPrimorial);
+        BOOST_CHECK(bnPrimorial == bnProduct);
+
+        // First primorial reaching a number just above the previous one
+        if (fPrime)
+        {
+            CBigNum bn = bnPrevious + 1;
+            PrimorialAt(bn, bnPrimorial);
+            BOOST_CHECK(bnPrimorial == bnProduct);
+            PrimorialAt(bnProduct, bnPrimorial);
+            BOOST_CHECK(bnPrimorial == bnProduct);
+            bnPrevious = bnProduct;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sieve_matches_reference)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    const unsigned int nSieveSize = 20011; // not a multiple of the word size
+    const unsigned int nWeavePrimes = 40;
+    for (unsigned int nChainLength = 3; nChainLength <= 8; nChainLength++)
+    {
+        uint256 hashBlockHeader = Hash(BEGIN(nChainLength), END(nChainLength)) | (uint256(1) << 255);
+        CBigNum bnFixedMultiplier = 2 * 3 * 5 * 7;
+        unsigned int nBits = TargetFromInt(nChainLength) | 0x654321;
+        CSieveOfEratosthenes sieve(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier);
+        for (unsigned int i = 0; i < nWeavePrimes; i++)
+            BOOST_CHECK(sieve.Weave());
+
+        CBigNum bnFixedFactor = bnFixedMultiplier * CBigNum(hashBlockHeader);
+        std::vector<unsigned int> vFixedFactorMod;
+        for (unsigned int nPrimeSeq = 0; nPrimeSeq < nWeavePrimes; nPrimeSeq++)
+            vFixedFactorMod.push_back((bnFixedFactor % vPrimes[nPrimeSeq]).getuint());
+
+        unsigned int nExpectedCount = 0;
+        std::vector<std::pair<unsigned int, unsigned int> > vExpected;
+        for (unsigned int nMultiplier = 0; nMultiplier < nSieveSize; nMultiplier++)
+        {
+            unsigned int nType = ReferenceCandidateType(vFixedFactorMod, nWeavePrimes, nChainLength, nMultiplier);
+            if (nType == 0)
+                continue;
+            nExpectedCount++;
+            if (nMultiplier > 0) // the scan never yields multiplier 0
+                vExpected.push_back(std::make_pair(nMultiplier, nType));
+        }
+        BOOST_CHECK_EQUAL(sieve.GetCandidateCount(), nExpectedCount);
+
+        std::vector<std::pair<unsigned int, unsigned int> > vScanned;
+        unsigned int nMultiplier, nType;
+        while (sieve.GetNextCandidateMultiplier(nMultiplier, nType))
+            vScanned.push_back(std::make_pair(nMultiplier, nType));
+        BOOST_CHECK(vScanned == vExpected);
+    }
+}
+
+// Reference: whether some woven prime divides the number at nBiTwinSeq of the
+// interleaved chain h * m * 2^k -/+ 1
+static bool ReferenceIsComposite(const std::vector<unsigned int>& vFixedFactorMod, unsigned int nWeavePrimes, unsigned int nBiTwinSeq, unsigned int nMultiplier)
+{
+    for (unsigned int nPrimeSeq = 0; nPrimeSeq < nWeavePrimes; nPrimeSeq++)
+    {
+        uint64 nPrime = vPrimes[nPrimeSeq];
+        uint64 nNumber = (vFixedFactorMod[nPrimeSeq] * (uint64)nMultiplier) % nPrime;
+        for (unsigned int k = 0; k < nBiTwinSeq / 2; k++)
+            nNumber = (nNumber * 2) % nPrime;
+        if (nNumber != 0 && nNumber == ((nBiTwinSeq & 1)? nPrime - 1 : 1))
+            return true;
+    }
+    return false;
+}
+
+// Reference: whether the sieve knows the number at nBiTwinSeq to have no
+// factor; below twice the chain length the tail layer of its kind tells
+// only for all its numbers at once
+static bool ReferenceIsKnownClear(const std::vector<unsigned int>& vFixedFactorMod, unsigned int nWeavePrimes, unsigned int nChainLength, unsigned int nBiTwinSeq, unsigned int nMultiplier)
+{
+    if (nBiTwinSeq >= 2 * nChainLength)
+        return !ReferenceIsComposite(vFixedFactorMod, nWeavePrimes, nBiTwinSeq, nMultiplier);
+    for (unsigned int nSeq = nBiTwinSeq % 2; nSeq < 2 * nChainLength; nSeq += 2)
+        if (nSeq >= nChainLength && ReferenceIsComposite(vFixedFactorMod, nWeavePrimes, nSeq, nMultiplier))
+            return false;
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(sieve_extension_layers)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    const unsigned int nSieveSize = 20011;
+    const unsigned int nWeavePrimes = 40;
+    const unsigned int nExtensions = 3;
+    unsigned int nChainLength = 5;
+    uint256 hashBlockHeader = Hash(BEGIN(nExtensions), END(nExtensions)) | (uint256(1) << 255);
+    CBigNum bnFixedMultiplier = 2 * 3 * 5 * 7;
+    unsigned int nBits = TargetFromInt(nChainLength);
+    CSieveOfEratosthenes sieve(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier);
+    CSieveOfEratosthenes sieveExtended(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier, nExtensions);
+    for (unsigned int i = 0; i < nWeavePrimes; i++)
+    {
+        sieve.Weave();
+        sieveExtended.Weave();
+    }
+
+    CBigNum bnFixedFactor = bnFixedMultiplier * CBigNum(hashBlockHeader);
+    std::vector<unsigned int> vFixedFactorMod;
+    for (unsigned int nPrimeSeq = 0; nPrimeSeq < nWeavePrimes; nPrimeSeq++)
+        vFixedFactorMod.push_back((bnFixedFactor % vPrimes[nPrimeSeq]).getuint());
+
+    // Same candidates; the extension layers only tell them apart
+    std::vector<unsigned int> vMaxLengthCount(nChainLength + nExtensions + 1, 0);
+    unsigned int nMultiplier, nType, nMultiplierExtended, nTypeExtended;
+    while (sieve.GetNextCandidateMultiplier(nMultiplier, nType))
+    {
+        BOOST_REQUIRE(sieveExtended.GetNextCandidateMultiplier(nMultiplierExtended, nTypeExtended));
+        BOOST_CHECK_EQUAL(nMultiplierExtended, nMultiplier);
+        BOOST_CHECK_EQUAL(nTypeExtended, nType);
+        BOOST_CHECK_EQUAL(sieve.GetCandidateMaxLength(nMultiplier, nType), nChainLength);
+
+        unsigned int nExpectedLength = nChainLength;
+        unsigned int nBiTwinSeq = (nType == PRIME_CHAIN_BI_TWIN)? nChainLength : (2 * nChainLength + ((nType == PRIME_CHAIN_CUNNINGHAM2)? 1 : 0));
+        while (nExpectedLength < nChainLength + nExtensions && ReferenceIsKnownClear(vFixedFactorMod, nWeavePrimes, nChainLength, nBiTwinSeq, nMultiplier))
+        {
+            nExpectedLength++;
+            nBiTwinSeq += (nType == PRIME_CHAIN_BI_TWIN)? 1 : 2;
+        }
+        unsigned int nMaxLength = sieveExtended.GetCandidateMaxLength(nMultiplier, nType);
+        BOOST_CHECK_EQUAL(nMaxLength, nExpectedLength);
+        vMaxLengthCount[nMaxLength]++;
+    }
+    BOOST_CHECK(!sieveExtended.GetNextCandidateMultiplier(nMultiplierExtended, nTypeExtended));
+    BOOST_CHECK(vMaxLengthCount[nChainLength] > 0);
+    BOOST_CHECK(vMaxLengthCount[nChainLength + nExtensions] > 0);
+
+    // Segmented weaving fills the extension layers the same way
+    CSieveOfEratosthenes sieveSegmented(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier, nExtensions);
+    BOOST_CHECK_EQUAL(sieveSegmented.WeaveSegmented(nWeavePrimes, 1000), nWeavePrimes);
+    while (sieveSegmented.GetNextCandidateMultiplier(nMultiplier, nType))
+    {
+        BOOST_REQUIRE(sieveExtended.GetNextCandidateMultiplier(nMultiplierExtended, nTypeExtended));
+        BOOST_CHECK_EQUAL(nMultiplierExtended, nMultiplier);
+        BOOST_CHECK_EQUAL(sieveSegmented.GetCandidateMaxLength(nMultiplier, nType), sieveExtended.GetCandidateMaxLength(nMultiplier, nType));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sieve_segmented_weave)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    const unsigned int nSieveSize = 100003;
+    const unsigned int nWeavePrimes = 2000;
+    uint256 hashBlockHeader = Hash(BEGIN(nSieveSize), END(nSieveSize)) | (uint256(1) << 255);
+    CBigNum bnFixedMultiplier = 2 * 3 * 5 * 7 * 11;
+    unsigned int nBits = TargetFromInt(6);
+    CSieveOfEratosthenes sieve(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier);
+    for (unsigned int i = 0; i < nWeavePrimes; i++)
+        sieve.Weave();
+
+    const unsigned int nSegmentSizes[] = {64, 1000, 4096, 32768, 1000000};
+    BOOST_FOREACH(unsigned int nSegmentSize, nSegmentSizes)
+    {
+        CSieveOfEratosthenes sieveSegmented(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier);
+        BOOST_CHECK_EQUAL(sieveSegmented.WeaveSegmented(nWeavePrimes, nSegmentSize), nWeavePrimes);
+        BOOST_CHECK_EQUAL(sieveSegmented.GetCandidateCount(), sieve.GetCandidateCount());
+        unsigned int nMultiplier, nType, nMultiplierSegmented, nTypeSegmented;
+        bool fMore;
+        do
+        {
+            fMore = sieve.GetNextCandidateMultiplier(nMultiplier, nType);
+            BOOST_CHECK_EQUAL(sieveSegmented.GetNextCandidateMultiplier(nMultiplierSegmented, nTypeSegmented), fMore);
+            if (fMore)
+            {
+                BOOST_CHECK_EQUAL(nMultiplierSegmented, nMultiplier);
+                BOOST_CHECK_EQUAL(nTypeSegmented, nType);
+            }
+        } while (fMore);
+    }
+
+    // Weaving in batches of primes, as MineBuildSieve() does, gives the same sieve
+    CSieveOfEratosthenes sieveBatches(nSieveSize, nBits, hashBlockHeader, bnFixedMultiplier);
+    unsigned int nWeaved = 0;
+    while (nWeaved < nWeavePrimes)
+        nWeaved += sieveBatches.WeaveSegmented(std::min(700u, nWeavePrimes - nWeaved), 4096);
+    BOOST_CHECK_EQUAL(sieveBatches.GetCandidateCount(), sieve.GetCandidateCount());
+    unsigned int nMultiplier, nType, nMultiplierBatches, nTypeBatches;
+    while (sieve.GetNextCandidateMultiplier(nMultiplier, nType))
+    {
+        BOOST_REQUIRE(sieveBatches.GetNextCandidateMultiplier(nMultiplierBatches, nTypeBatches));
+        BOOST_CHECK_EQUAL(nMultiplierBatches, nMultiplier);
+        BOOST_CHECK_EQUAL(nTypeBatches, nType);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(chain_test_batch_matches_single)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    // Candidates of a real sieve, so chains of some length do turn up
+    uint256 hashBlockHeader = Hash(BEGIN(nFractionalBits), END(nFractionalBits)) | (uint256(1) << 255);
+    CBigNum bnFixedMultiplier = 2 * 3 * 5 * 7 * 11 * 13;
+    unsigned int nBits = TargetFromInt(3);
+    CSieveOfEratosthenes sieve(100000, nBits, hashBlockHeader, bnFixedMultiplier);
+    for (unsigned int i = 0; i < 500; i++)
+        sieve.Weave();
+
+    CBigNum bnFixedFactor = CBigNum(hashBlockHeader) * bnFixedMultiplier;
+    std::vector<CBigNum> vChainOrigins;
+    std::vector<unsigned int> vCandidateTypes;
+    unsigned int nMultiplier, nType;
+    while (sieve.GetNextCandidateMultiplier(nMultiplier, nType) && vChainOrigins.size() < 3001)
+    {
+        vChainOrigins.push_back(bnFixedFactor * nMultiplier);
+        vCandidateTypes.push_back(nType);
+    }
+
+    std::vector<unsigned int> vChainLength, vChainLengthAbort;
+    ProbablePrimeChainTestBatchForMiner(vChainOrigins, vCandidateTypes, nBits, false, vChainLength);
+    ProbablePrimeChainTestBatchForMiner(vChainOrigins, vCandidateTypes, nBits, true, vChainLengthAbort);
+    BOOST_REQUIRE_EQUAL(vChainLength.size(), vChainOrigins.size());
+    BOOST_REQUIRE_EQUAL(vChainLengthAbort.size(), vChainOrigins.size());
+    unsigned int nChains = 0;
+    unsigned int nBiTwinChains = 0;
+    for (unsigned int i = 0; i < vChainOrigins.size(); i++)
+    {
+        unsigned int nChainLength = 0;
+        bool fChain = ProbablePrimeChainTestForMiner(vChainOrigins[i], nBits, vCandidateTypes[i], false, nChainLength);
+        BOOST_CHECK_EQUAL(vChainLength[i], nChainLength);
+        nChains += (fChain? 1 : 0);
+
+        // Aborting short chains keeps the verdict and the chains of length 2
+        unsigned int nChainLengthAbort = 0;
+        BOOST_CHECK_EQUAL(ProbablePrimeChainTestForMiner(vChainOrigins[i], nBits, vCandidateTypes[i], true, nChainLengthAbort), fChain);
+        BOOST_CHECK_EQUAL(vChainLengthAbort[i], nChainLengthAbort);
+        BOOST_CHECK(nChainLengthAbort <= nChainLength);
+        BOOST_CHECK_EQUAL(std::min(TargetGetLength(nChainLengthAbort), 2u), std::min(TargetGetLength(nChainLength), 2u));
+
+        // Bi-twin chains report their full length, also short of the target
+        unsigned int nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin;
+        ProbablePrimeChainTest(vChainOrigins[i], nBits, false, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin);
+        if (vCandidateTypes[i] == PRIME_CHAIN_BI_TWIN && TargetGetLength(nChainLengthCunningham1) >= 2)
+        {
+            BOOST_CHECK_EQUAL(nChainLength, nChainLengthBiTwin);
+            nBiTwinChains++;
+        }
+    }
+    BOOST_CHECK(nChains > 0);
+    BOOST_CHECK(nBiTwinChains > 0);
+}
+
+// Proof-of-work check as it used to be: Euler-Lagrange-Lifchitz chain test,
+// Fermat-only chain test to double check, chain test of the halved origin
+static bool ReferenceCheckPrimeProofOfWork(uint256 hashBlockHeader, unsigned int nBits, const CBigNum& bnPrimeChainMultiplier, unsigned int& nChainType, unsigned int& nChainLength)
+{
+    CBigNum bnPrimeChainOrigin = CBigNum(hashBlockHeader) * bnPrimeChainMultiplier;
+    unsigned int nChainLengthCunningham1 = 0;
+    unsigned int nChainLengthCunningham2 = 0;
+    unsigned int nChainLengthBiTwin = 0;
+    if (!ProbablePrimeChainTest(bnPrimeChainOrigin, nBits, false, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin))
+        return false;
+    unsigned int nChainLengthCunningham1FermatTest = 0;
+    unsigned int nChainLengthCunningham2FermatTest = 0;
+    unsigned int nChainLengthBiTwinFermatTest = 0;
+    if (!ProbablePrimeChainTest(bnPrimeChainOrigin, nBits, true, nChainLengthCunningham1FermatTest, nChainLengthCunningham2FermatTest, nChainLengthBiTwinFermatTest))
+        return false;
+    if (nChainLengthCunningham1 != nChainLengthCunningham1FermatTest ||
+        nChainLengthCunningham2 != nChainLengthCunningham2FermatTest ||
+        nChainLengthBiTwin != nChainLengthBiTwinFermatTest)
+        return false;
+
+    nChainLength = nChainLengthCunningham1;
+    nChainType = PRIME_CHAIN_CUNNINGHAM1;
+    if (nChainLengthCunningham2 > nChainLength)
+    {
+        nChainLength = nChainLengthCunningham2;
+        nChainType = PRIME_CHAIN_CUNNINGHAM2;
+    }
+    if (nChainLengthBiTwin > nChainLength)
+    {
+        nChainLength = nChainLengthBiTwin;
+        nChainType = PRIME_CHAIN_BI_TWIN;
+    }
+
+    if (bnPrimeChainMultiplier % 2 == 0 && bnPrimeChainOrigin % 4 == 0)
+    {
+        unsigned int nChainLengthCunningham1Extended = 0;
+        unsigned int nChainLengthCunningham2Extended = 0;
+        unsigned int nChainLengthBiTwinExtended = 0;
+        if (ProbablePrimeChainTest(bnPrimeChainOrigin / 2, nBits, false, nChainLengthCunningham1Extended, nChainLengthCunningham2Extended, nChainLengthBiTwinExtended))
+        {
+            if (nChainLengthCunningham1Extended > nChainLength || nChainLengthCunningham2Extended > nChainLength || nChainLengthBiTwinExtended > nChainLength)
+                return false;
+        }
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(check_pow_matches_triple_pass)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    // Short targets, so that plenty of certificates pass
+    unsigned int nTargetMinLengthSaved = nTargetMinLength;
+    nTargetMinLength = 1;
+    unsigned int nPassed = 0, nNotNormalized = 0;
+    for (int nHash = 0; nHash < 2; nHash++)
+    {
+        // Odd and even header hashes, the latter with certificates to normalize
+        uint256 hashBlockHeader = Hash(BEGIN(nHash), END(nHash)) | (uint256(1) << 255);
+        hashBlockHeader = (nHash == 0)? (hashBlockHeader | 1) : (hashBlockHeader & ~uint256(1));
+        CBigNum bnFixedMultiplier = 2 * 3 * 5 * 7 * 11 * 13;
+        for (unsigned int nLength = 1; nLength <= 3; nLength++)
+        {
+            unsigned int nBits = TargetFromInt(nLength);
+            CSieveOfEratosthenes sieve(20000, nBits, hashBlockHeader, bnFixedMultiplier);
+            for (unsigned int i = 0; i < 1000; i++)
+                sieve.Weave();
+            unsigned int nMultiplier, nType, nCount = 0;
+            while (sieve.GetNextCandidateMultiplier(nMultiplier, nType) && nCount++ < 1000)
+            {
+                // The candidate, a neighbour off the sieve, and a doubled
+                // multiplier leaving a longer chain at half the origin
+                CBigNum vbnMultiplier[3] = {bnFixedMultiplier * nMultiplier, bnFixedMultiplier * (nMultiplier + 1), bnFixedMultiplier * nMultiplier * 2};
+                for (unsigned int i = 0; i < 3; i++)
+                {
+                    unsigned int nChainType = 0, nChainLength = 0;
+                    unsigned int nChainTypeExpected = 0, nChainLengthExpected = 0;
+                    bool fPassedExpected = ReferenceCheckPrimeProofOfWork(hashBlockHeader, nBits, vbnMultiplier[i], nChainTypeExpected, nChainLengthExpected);
+                    bool fPassed = CheckPrimeProofOfWork(hashBlockHeader, nBits, vbnMultiplier[i], nChainType, nChainLength);
+                    BOOST_CHECK_EQUAL(fPassed, fPassedExpected);
+                    if (fPassed && fPassedExpected)
+                    {
+                        BOOST_CHECK_EQUAL(nChainType, nChainTypeExpected);
+                        BOOST_CHECK_EQUAL(nChainLength, nChainLengthExpected);
+                    }
+                    nPassed += (fPassed? 1 : 0);
+                    if (i == 2 && !fPassed)
+                    {
+                        unsigned int nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin;
+                        if (ProbablePrimeChainTest(CBigNum(hashBlockHeader) * vbnMultiplier[i], nBits, false, nChainLengthCunningham1, nChainLengthCunningham2, nChainLengthBiTwin))
+                            nNotNormalized++;
+                    }
+                }
+            }
+        }
+    }
+    nTargetMinLength = nTargetMinLengthSaved;
+    BOOST_CHECK(nPassed > 200);
+    BOOST_CHECK(nNotNormalized > 0);
+}
+
+BOOST_AUTO_TEST_CASE(sieve_tuner_converges)
+{
+    if (vPrimes.empty())
+        GeneratePrimeTable();
+
+    // Synthetic rounds: length 2 chains are most common at half the largest
+    // sieve with primorial 13#, length 1 chains come at the same rate everywhere
+    unsigned int nBits = TargetFromInt(8);
+    CSieveTuner tuner(true);
+    std::map<std::pair<unsigned int, unsigned int>, unsigned int> mapHandedOut;
+    for (unsigned int nRound = 0; nRound < 4000; nRound++)
+    {
+        CSieveSetting setting;
+        unsigned int nSetting = tuner.GetSetting(nBits, setting);
+        BOOST_REQUIRE(setting.nSieveSize > 0 && setting.nSieveSize <= nMaxSieveSize);
+        BOOST_REQUIRE(setting.nPrimorialMultiplier >= nPrimorialMultiplierMin && setting.nPrimorialMultiplier <= nPrimorialMultiplierMax);
+        int nSizeDistance = abs((int) (setting.nSieveSize / (nMaxSieveSize / nSieveSizeSteps)) - 2);
+        int nPrimorialDistance = abs((int) setting.nPrimorialMultiplier - 13);
+        unsigned int nChainsTwo = 100 - 10 * nSizeDistance - 2 * nPrimorialDistance;
+        std::vector<unsigned int> vChainLength(1000, TargetFromInt(1));
+        for (unsigned int i = 0; i < nChainsTwo; i++)
+            vChainLength[i] = TargetFromInt(2);
+        tuner.AddResults(nBits, nSetting, 10 * 1000000, vChainLength);
+        if (nRound >= 3000)
+            mapHandedOut[std::make_pair(setting.nSieveSize, setting.nPrimorialMultiplier)]++;
+    }
+    // Settled on the best setting, trying its neighbours now and then
+    BOOST_CHECK(mapHandedOut[std::make_pair(nMaxSieveSize / 2, 13u)] > 800);
+
+    // Untuned, the default setting
+    CSieveTuner tunerDisabled(false);
+    CSieveSetting setting;
+    BOOST_CHECK_EQUAL(tunerDisabled.GetSetting(nBits, setting), 0u);
+    BOOST_CHECK_EQUAL(setting.nSieveSize, nMaxSieveSize);
+    BOOST_CHECK_EQUAL(setting.nPrimorialMultiplier, nPrimorialMultiplierMin);
+}
+
+BOOST_AUTO_TEST_CASE(pow_cache_lookup)
+{
+    CPrimeProofOfWorkCache cache;
+    uint256 hashBlockHeader = (uint256(1) << 255) + 12345;
+    unsigned int nBits = TargetFromInt(9);
+    CBigNum bnMultiplier = 30030;
+    unsigned int nChainType = 0, nChainLength = 0;
+    BOOST_CHECK(!cache.Get(hashBlockHeader, nBits, bnMultiplier, nChainType, nChainLength));
+    cache.Set(hashBlockHeader, nBits, bnMultiplier, PRIME_CHAIN_BI_TWIN, nBits + 7);
+    BOOST_CHECK(cache.Get(hashBlockHeader, nBits, bnMultiplier, nChainType, nChainLength));
+    BOOST_CHECK_EQUAL(nChainType, (unsigned int) PRIME_CHAIN_BI_TWIN);
+    BOOST_CHECK_EQUAL(nChainLength, nBits + 7);
+
+    // Any other header, target or multiplier misses
+    BOOST_CHECK(!cache.Get(hashBlockHeader + 1, nBits, bnMultiplier, nChainType, nChainLength));
+    BOOST_CHECK(!cache.Get(hashBlockHeader, nBits + 1, bnMultiplier, nChainType, nChainLength));
+    BOOST_CHECK(!cache.Get(hashBlockHeader, nBits, bnMultiplier * 2, nChainType, nChainLength));
+
+    // Bounded by -maxpowcachesize, as it was when the cache was created
+    mapArgs["-maxpowcachesize"] = "100";
+    CPrimeProofOfWorkCache cacheSmall;
+    mapArgs["-maxpowcachesize"] = "0";
+    for (unsigned int i = 0; i < 1000; i++)
+        cacheSmall.Set(hashBlockHeader, nBits, CBigNum(i + 1), PRIME_CHAIN_CUNNINGHAM1, nBits);
+    BOOST_CHECK_EQUAL(cacheSmall.size(), 100u);
+    CPrimeProofOfWorkCache cacheOff;
+    cacheOff.Set(hashBlockHeader + 2, nBits, bnMultiplier, PRIME_CHAIN_CUNNINGHAM1, nBits);
+    BOOST_CHECK(!cacheOff.Get(hashBlockHeader + 2, nBits, bnMultiplier, nChainType, nChainLength));
+    mapArgs.erase("-maxpowcachesize");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
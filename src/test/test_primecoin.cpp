@@ -7,6 +7,7 @@
 #include "main.h"
 #include "wallet.h"
 #include "util.h"
+#include "test_primecoin.h"
 
 CWallet* pwalletMain;
 CClientUIInterface uiInterface;
@@ -37,6 +38,7 @@ struct TestingSetup {
         nScriptCheckThreads = 3;
         for (int i=0; i < nScriptCheckThreads-1; i++)
             threadGroup.create_thread(&ThreadScriptCheck);
+        threadGroup.create_thread(&ThreadInputsCheck);
     }
     ~TestingSetup()
     {
@@ -64,3 +66,45 @@ void StartShutdown()
   exit(0);
 }
 
+
+CScript ScriptTrue()
+{
+    return CScript() << OP_TRUE;
+}
+
+CScript RedeemScriptWithSigOps(unsigned int nMultisigs)
+{
+    CScript script;
+    script << OP_0 << OP_IF;
+    for (unsigned int i = 0; i < nMultisigs; i++)
+        script << OP_CHECKMULTISIG;
+    script << OP_ENDIF << OP_1;
+    return script;
+}
+
+CScript PayToScriptHash(const CScript& redeemScript)
+{
+    CScript script;
+    script.SetDestination(redeemScript.GetID());
+    return script;
+}
+
+CTransaction Spend(const COutPoint& prevout, int64 nValue, const CScript& scriptSig, unsigned int nSigOps)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig = scriptSig;
+    tx.vout.resize(1);
+    tx.vout[0].nValue = nValue;
+    tx.vout[0].scriptPubKey = ScriptTrue();
+    if (nSigOps > 0)
+    {
+        CScript scriptSigOps;
+        for (unsigned int i = 0; i < nSigOps; i++)
+            scriptSigOps << OP_CHECKSIG;
+        tx.vout[0].nValue -= MIN_TXOUT_AMOUNT;
+        tx.vout.push_back(CTxOut(MIN_TXOUT_AMOUNT, scriptSigOps));
+    }
+    return tx;
+}
@@ -0,0 +1,23 @@
+#ifndef PRIMECOIN_TEST_TEST_PRIMECOIN_H
+#define PRIMECOIN_TEST_TEST_PRIMECOIN_H
+
+#include "main.h"
+#include "script.h"
+
+//
+// Transaction helpers shared by the unit tests
+//
+
+// Script anyone can spend
+CScript ScriptTrue();
+
+// Redeem script evaluating to true with nMultisigs*20 sigops in a branch not taken
+CScript RedeemScriptWithSigOps(unsigned int nMultisigs);
+
+CScript PayToScriptHash(const CScript& redeemScript);
+
+// Spend prevout to outputs worth nValue in total: one anyone can spend, and
+// if nSigOps > 0 one of MIN_TXOUT_AMOUNT with nSigOps legacy sigops
+CTransaction Spend(const COutPoint& prevout, int64 nValue, const CScript& scriptSig = CScript(), unsigned int nSigOps = 0);
+
+#endif
@@ -17,7 +17,7 @@ const std::string CLIENT_NAME("Seneca");
 const int CLIENT_VERSION_MAJOR = 0;
 const int CLIENT_VERSION_MINOR = 8;
 const int CLIENT_VERSION_REVISION = 6;
-const int CLIENT_VERSION_BUILD = 0;
+const int CLIENT_VERSION_BUILD = 1;
 
 static const int CLIENT_VERSION =
     1000000 * CLIENT_VERSION_MAJOR
@@ -53,4 +53,8 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// block index records carry the prime chain multiplier starting with this
+// client version
+static const int BLOCK_INDEX_MULTIPLIER_VERSION = 80601;
+
 #endif // __VERSION_H__
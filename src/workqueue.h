@@ -0,0 +1,110 @@
+// Copyright (c) 2013 Primecoin developers
+// See COPYING for license.
+
+#ifndef __WORKQUEUE_H__
+#define __WORKQUEUE_H__
+
+#include <boost/foreach.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <deque>
+#include <vector>
+
+
+/** Work-stealing queue for a fixed pool of worker threads.
+  * The work items are represented by a type T, which must provide swap().
+  *
+  * Every worker owns a deque. It pushes the work it produces onto the back
+  * and pops from the back, so it keeps working on what is still warm in its
+  * cache. A worker that runs out of work steals from the front of another
+  * worker's deque, taking half of what is queued there so that it does not
+  * have to come back for more right away.
+  */
+template<typename T> class CWorkStealingQueue {
+private:
+    struct CWorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<T> queue;
+    };
+
+    // One deque per worker (boost::mutex cannot be copied)
+    std::vector<CWorkerQueue*> vQueues;
+
+    CWorkStealingQueue(const CWorkStealingQueue&);
+    CWorkStealingQueue& operator=(const CWorkStealingQueue&);
+
+public:
+    CWorkStealingQueue(unsigned int nWorkers) {
+        for (unsigned int i = 0; i < nWorkers; i++)
+            vQueues.push_back(new CWorkerQueue());
+    }
+
+    ~CWorkStealingQueue() {
+        BOOST_FOREACH(CWorkerQueue* pqueue, vQueues)
+            delete pqueue;
+    }
+
+    // Add a batch of work items to the deque of worker nWorker
+    void Push(unsigned int nWorker, std::vector<T> &vItems) {
+        CWorkerQueue &worker = *vQueues[nWorker];
+        boost::unique_lock<boost::mutex> lock(worker.mutex);
+        BOOST_FOREACH(T &item, vItems) {
+            worker.queue.push_back(T());
+            item.swap(worker.queue.back());
+        }
+    }
+
+    // Take the most recently pushed work item of worker nWorker
+    bool Pop(unsigned int nWorker, T &item) {
+        CWorkerQueue &worker = *vQueues[nWorker];
+        boost::unique_lock<boost::mutex> lock(worker.mutex);
+        if (worker.queue.empty())
+            return false;
+        item.swap(worker.queue.back());
+        worker.queue.pop_back();
+        return true;
+    }
+
+    // Steal work for worker nWorker from the other workers' deques
+    // The first stolen item is returned, the rest is moved to nWorker's deque
+    bool Steal(unsigned int nWorker, T &item) {
+        for (unsigned int i = 1; i < vQueues.size(); i++) {
+            CWorkerQueue &victim = *vQueues[(nWorker + i) % vQueues.size()];
+            std::vector<T> vStolen;
+            {
+                boost::unique_lock<boost::mutex> lock(victim.mutex);
+                unsigned int nSteal = (victim.queue.size() + 1) / 2;
+                vStolen.resize(nSteal);
+                for (unsigned int j = 0; j < nSteal; j++) {
+                    vStolen[j].swap(victim.queue.front());
+                    victim.queue.pop_front();
+                }
+            }
+            if (vStolen.empty())
+                continue;
+            item.swap(vStolen.back());
+            vStolen.pop_back();
+            Push(nWorker, vStolen);
+            return true;
+        }
+        return false;
+    }
+
+    // Number of work items queued for worker nWorker
+    unsigned int Size(unsigned int nWorker) {
+        CWorkerQueue &worker = *vQueues[nWorker];
+        boost::unique_lock<boost::mutex> lock(worker.mutex);
+        return worker.queue.size();
+    }
+
+    // Drop all work queued for worker nWorker
+    void Clear(unsigned int nWorker) {
+        CWorkerQueue &worker = *vQueues[nWorker];
+        boost::unique_lock<boost::mutex> lock(worker.mutex);
+        worker.queue.clear();
+    }
+};
+
+#endif // __WORKQUEUE_H__